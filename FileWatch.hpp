@@ -45,13 +45,39 @@
 #include <sys/types.h>
 #include <sys/inotify.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #endif // __unix__
 
 #ifdef __linux__
 #include <linux/limits.h>
+#include <sys/syscall.h>
+// io_uring is driven through the raw system calls, so there's no liburing to link, and only if the headers are new enough
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/uio.h>
+#endif
+#endif
+#if defined(IORING_FEAT_EXT_ARG) && defined(__NR_io_uring_setup) && !defined(FILEWATCH_NO_IO_URING)
+#define FILEWATCH_IO_URING 1
+#endif
+#if defined(__has_include)
+#if __has_include(<sys/fanotify.h>)
+#include <sys/fanotify.h>
+#include <poll.h>
+#endif
+#endif
+// directory file handles in events need linux 5.9
+#if defined(FAN_REPORT_DFID_NAME) && !defined(FILEWATCH_NO_FANOTIFY)
+#define FILEWATCH_FANOTIFY 1
+#endif
 #endif
 
 #if defined(__APPLE__) || defined(__MACH__)
@@ -59,11 +85,20 @@
 #include <CoreServices/CoreServices.h>
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <dirent.h>
 #define FILEWATCH_PLATFORM_MAC 1
 #endif
 
+// FileWatch::next_batch() is only there when compiling as C++20 with coroutine support
+#if defined(__cpp_impl_coroutine) && defined(__has_include) && !defined(FILEWATCH_NO_COROUTINES)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define FILEWATCH_COROUTINES 1
+#endif
+#endif
+
 #include <functional>
 #include <atomic>
 #include <thread>
@@ -71,14 +106,21 @@
 #include <condition_variable>
 #include <utility>
 #include <vector>
+#include <deque>
+#include <list>
+#include <memory>
 #include <array>
 #include <unordered_map>
 #include <unordered_set>
+#include <map>
+#include <limits>
+#include <stdexcept>
 #include <system_error>
 #include <string>
 #include <algorithm>
 #include <type_traits>
 #include <future>
+#include <exception>
 #include <regex>
 #include <cstddef>
 #include <cstring>
@@ -86,6 +128,7 @@
 #include <cassert>
 #include <cstdlib>
 #include <iostream>
+#include <chrono>
 
 #ifdef FILEWATCH_PLATFORM_MAC
 extern "C" int __getdirentries64(int, char *, int, long *);
@@ -97,7 +140,10 @@ namespace filewatch {
 		removed,
 		modified,
 		renamed_old,
-		renamed_new
+		renamed_new,
+		// events had to be dropped and nothing could work out what they were, whatever is known of the watched path may be
+		// out of date. Its path is empty. See QueueFullPolicy::rescan.
+		rescan
 	};
       
       template<typename StringType>
@@ -145,6 +191,8 @@ namespace filewatch {
                   return FILEWATCH_TO_STRING(Event:renamed_old);
             case Event::renamed_new:
                   return FILEWATCH_TO_STRING(Event::renamed_new);
+            case Event::rescan:
+                  return FILEWATCH_TO_STRING(Event::rescan);
             }
             assert(false);
       }
@@ -162,196 +210,4388 @@ namespace filewatch {
       }
 
 	/**
-	* \class FileWatch
-	*
-	* \brief Watches a folder or file, and will notify of changes via function callback.
+	* \class SpscRing
 	*
-	* \author Thomas Monkman
+	* \brief Bounded lock free queue between exactly one producer thread and one consumer thread.
 	*
+	* Slots are allocated once and reused, so filling a slot that has held a long enough path before does not allocate.
+	* The producer claims slots and publishes them in batches, the consumer reads them in place and releases them once done.
+	* Either side waits by spinning briefly, then yielding, and only then parking on a condition variable, which the other side
+	* only touches when it sees it parked.
 	*/
-	template<class StringType>
-	class FileWatch
+	template<typename T>
+	class SpscRing
 	{
-		typedef typename StringType::value_type C;
-		typedef std::basic_string<C, std::char_traits<C>> UnderpinningString;
-		typedef std::basic_regex<C, std::regex_traits<C>> UnderpinningRegex;
-
 	public:
+		explicit SpscRing(std::size_t capacity) :
+			_slots(round_up_to_power_of_two(capacity)),
+			_mask(_slots.size() - 1)
+		{}
 
-		FileWatch(StringType path, UnderpinningRegex pattern, std::function<void(const StringType& file, const Event event_type)> callback) :
-			_path(absolute_path_of(path)),
-			_pattern(pattern),
-			_callback(callback),
-                  _directory(get_directory(path))
+		SpscRing(const SpscRing&) = delete;
+		SpscRing& operator=(const SpscRing&) = delete;
+
+		std::size_t capacity() const { return _slots.size(); }
+
+		// Any thread, a snapshot of how many slots are published but not yet released.
+		std::size_t size() const
 		{
-			init();
+			return _tail.load(std::memory_order_acquire) - _head.load(std::memory_order_acquire);
 		}
 
-		FileWatch(StringType path, std::function<void(const StringType& file, const Event event_type)> callback) :
-			FileWatch<StringType>(path, UnderpinningRegex(_regex_all), callback) {}
-
-		~FileWatch() {
-			destroy();
+		// Producer, the next free slot to fill in or nullptr when the queue is full. It is not visible until publish().
+		T* claim()
+		{
+			if (_claimed - _head_cache == _slots.size())
+			{
+				_head_cache = _head.load(std::memory_order_acquire);
+				if (_claimed - _head_cache == _slots.size())
+				{
+					return nullptr;
+				}
+			}
+			return &_slots[_claimed++ & _mask];
 		}
 
-		FileWatch(const FileWatch<StringType>& other) : FileWatch<StringType>(other._path, other._callback) {}
+		// Producer, makes every claimed slot visible to the consumer. Returns false if there was nothing to publish.
+		bool publish()
+		{
+			if (_claimed == _tail.load(std::memory_order_relaxed))
+			{
+				return false;
+			}
+			_tail.store(_claimed, std::memory_order_release);
+			wake(_consumer_parked);
+			return true;
+		}
 
-		FileWatch<StringType>& operator=(const FileWatch<StringType>& other) 
+		// Producer, true once the consumer has released every slot claimed so far, so it no longer looks at any of them.
+		bool drained() const
 		{
-			if (this == &other) { return *this; }
+			return _head.load(std::memory_order_acquire) == _claimed;
+		}
 
-			destroy();
-			_path = other._path;
-			_callback = other._callback;
-			_directory = get_directory(other._path);
-			init();
-			return *this;
+		// Producer, asks the consumer to drop one more of the oldest slots it hasn't peeked, of those published so far.
+		// It does at its next peek(), there is no room until then.
+		void discard_oldest()
+		{
+			_discard_before.store(_claimed, std::memory_order_relaxed);
+			_discard.fetch_add(1, std::memory_order_release);
 		}
 
-		// Const memeber varibles don't let me implent moves nicely, if moves are really wanted std::unique_ptr should be used and move that.
-		FileWatch<StringType>(FileWatch<StringType>&&) = delete;
-		FileWatch<StringType>& operator=(FileWatch<StringType>&&) & = delete;
+		// Any thread, how many slots have been dropped for discard_oldest().
+		std::uint64_t discarded() const
+		{
+			return _discarded.load(std::memory_order_relaxed);
+		}
 
-	private:
-		static constexpr C _regex_all[] = { '.', '*', '\0' };
-		static constexpr C _this_directory[] = { '.', '/', '\0' };
+		// Producer, wait until a slot can be claimed. Returns false if `stop` was set first.
+		bool wait_for_space(const std::atomic<bool>& stop)
+		{
+			return wait(_producer_parked, [this] { return _claimed - _head.load(std::memory_order_acquire) < _slots.size(); }, stop, nullptr);
+		}
 
-		struct PathParts
+		// Consumer, the published slots starting at `first` that are contiguous in memory, 0 if there are none.
+		std::size_t peek(const T*& first)
 		{
-			PathParts(StringType directory, StringType filename) : directory(directory), filename(filename) {}
-			StringType directory;
-			StringType filename;
-		};
-		const StringType _path;
+			if (_discard.load(std::memory_order_relaxed) != 0)
+			{
+				discard();
+			}
+			const auto head = _head.load(std::memory_order_relaxed);
+			if (head == _tail_cache)
+			{
+				_tail_cache = _tail.load(std::memory_order_acquire);
+				if (head == _tail_cache)
+				{
+					return 0;
+				}
+			}
+			first = &_slots[head & _mask];
+			return (std::min)(_tail_cache - head, _slots.size() - (head & _mask));
+		}
 
-		UnderpinningRegex _pattern;
+		// Consumer, hand the first `count` peeked slots back to the producer.
+		void release(std::size_t count)
+		{
+			_head.store(_head.load(std::memory_order_relaxed) + count, std::memory_order_release);
+			wake(_producer_parked);
+		}
 
-		static constexpr std::size_t _buffer_size = { 1024 * 256 };
+		// Consumer, wait until something is published. Returns false if `stop` was set first.
+		bool wait_for_data(const std::atomic<bool>& stop)
+		{
+			return wait(_consumer_parked, [this] { return has_data(); }, stop, nullptr);
+		}
 
-		// only used if watch a single file
-		StringType _filename;
+		// Consumer, as above but gives up at `deadline`, returning false.
+		bool wait_for_data(const std::atomic<bool>& stop, std::chrono::steady_clock::time_point deadline)
+		{
+			return wait(_consumer_parked, [this] { return has_data(); }, stop, &deadline);
+		}
 
-		std::function<void(const StringType& file, const Event event_type)> _callback;
+		// Any thread, wakes both sides so they notice their stop flag.
+		void wake_all()
+		{
+			std::lock_guard<std::mutex> lock(_park_mutex);
+			_park_cv.notify_all();
+		}
 
-		std::thread _watch_thread;
+	private:
+		static constexpr std::size_t _cache_line = 64;
+		static constexpr int _spin_count = 64;
+		static constexpr int _yield_count = 16;
+
+		std::vector<T> _slots;
+		const std::size_t _mask;
+
+		// producer side
+		char _producer_padding[_cache_line];
+		std::atomic<std::size_t> _tail = { 0 };
+		std::size_t _claimed = { 0 };
+		std::size_t _head_cache = { 0 };
+
+		// consumer side
+		char _consumer_padding[_cache_line];
+		std::atomic<std::size_t> _head = { 0 };
+		std::size_t _tail_cache = { 0 };
+		std::atomic<std::uint64_t> _discarded = { 0 };
+
+		// asked for by the producer, dropped by the consumer
+		char _discard_padding[_cache_line];
+		std::atomic<std::size_t> _discard = { 0 };
+		std::atomic<std::size_t> _discard_before = { 0 };
+
+		char _parking_padding[_cache_line];
+		std::atomic<bool> _producer_parked = { false };
+		std::atomic<bool> _consumer_parked = { false };
+		std::mutex _park_mutex = {};
+		std::condition_variable _park_cv = {};
+
+		static std::size_t round_up_to_power_of_two(std::size_t value)
+		{
+			std::size_t result = 2;
+			while (result < value)
+			{
+				result <<= 1;
+			}
+			return result;
+		}
 
-		std::condition_variable _cv;
-		std::mutex _callback_mutex;
-		std::vector<std::pair<StringType, Event>> _callback_information;
-		std::thread _callback_thread;
+		bool has_data() const
+		{
+			return _head.load(std::memory_order_relaxed) != _tail.load(std::memory_order_acquire);
+		}
 
-		std::promise<void> _running;
-		std::atomic<bool> _destory = { false };
-		bool _watching_single_file = { false };
+		// Consumer, drops what discard_oldest() asked for. Asks for slots that were released meanwhile are forgotten,
+		// and a later `before` may be used for an earlier ask, which can only take slots that are older still.
+		void discard()
+		{
+			const auto count = _discard.exchange(0, std::memory_order_acquire);
+			// may drop past the cached tail, peek() has to see the tail that `before` was bounded by
+			_tail_cache = _tail.load(std::memory_order_acquire);
+			const auto before = (std::min)(_discard_before.load(std::memory_order_relaxed), _tail_cache);
+			const auto head = _head.load(std::memory_order_relaxed);
+			const auto dropped = before > head ? (std::min)(count, before - head) : 0;
+			if (dropped > 0)
+			{
+				_discarded.store(_discarded.load(std::memory_order_relaxed) + dropped, std::memory_order_relaxed);
+				release(dropped);
+			}
+		}
 
-#pragma mark "Platform specific data"
-#ifdef _WIN32
-		HANDLE _directory = { nullptr };
-		HANDLE _close_event = { nullptr };
+		// Pairs with the fence in wait(): either the parked side sees our update, or we see it parked and wake it.
+		void wake(std::atomic<bool>& parked)
+		{
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (parked.load(std::memory_order_relaxed))
+			{
+				wake_all();
+			}
+		}
 
-		const DWORD _listen_filters =
-			FILE_NOTIFY_CHANGE_SECURITY |
-			FILE_NOTIFY_CHANGE_CREATION |
-			FILE_NOTIFY_CHANGE_LAST_ACCESS |
-			FILE_NOTIFY_CHANGE_LAST_WRITE |
-			FILE_NOTIFY_CHANGE_SIZE |
-			FILE_NOTIFY_CHANGE_ATTRIBUTES |
-			FILE_NOTIFY_CHANGE_DIR_NAME |
-			FILE_NOTIFY_CHANGE_FILE_NAME;
+		template<typename Ready>
+		bool wait(std::atomic<bool>& parked, Ready ready, const std::atomic<bool>& stop, const std::chrono::steady_clock::time_point* deadline)
+		{
+			for (int i = 0; i < _spin_count + _yield_count; ++i)
+			{
+				if (ready())
+				{
+					return true;
+				}
+				if (stop)
+				{
+					return false;
+				}
+				if (i >= _spin_count)
+				{
+					std::this_thread::yield();
+				}
+			}
 
-		const std::unordered_map<DWORD, Event> _event_type_mapping = {
-			{ FILE_ACTION_ADDED, Event::added },
-			{ FILE_ACTION_REMOVED, Event::removed },
-			{ FILE_ACTION_MODIFIED, Event::modified },
-			{ FILE_ACTION_RENAMED_OLD_NAME, Event::renamed_old },
-			{ FILE_ACTION_RENAMED_NEW_NAME, Event::renamed_new }
-		};
-#endif // WIN32
+			std::unique_lock<std::mutex> lock(_park_mutex);
+			parked.store(true, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			auto woken = true;
+			if (deadline)
+			{
+				woken = _park_cv.wait_until(lock, *deadline, [&] { return ready() || stop; });
+			}
+			else
+			{
+				_park_cv.wait(lock, [&] { return ready() || stop; });
+			}
+			parked.store(false, std::memory_order_relaxed);
+			return woken && !stop;
+		}
+	};
 
-#if __unix__
-		struct FolderInfo {
-			int folder;
-			int watch;
-		};
+#if FILEWATCH_IO_URING
+	/**
+	* \class UringReader
+	*
+	* \brief Reads an inotify descriptor through io_uring, keeping a chain of reads into registered buffers queued in the kernel
+	* so the next batch is read while the last one is handled. The reads are hard linked, so they complete, and are handed out,
+	* in the order the data was read. Submitting the next chain and waiting for completions is a single system call.
+	*/
+	class UringReader
+	{
+	public:
+		// Null when the kernel can't do it (no io_uring, older than 5.11 or turned off), use epoll and read() then.
+		// `wake` is polled alongside, next() returns 0 from the moment it is readable.
+		static std::unique_ptr<UringReader> create(int fd, int wake, std::size_t buffer_size)
+		{
+			std::unique_ptr<UringReader> reader(new UringReader(fd, wake, buffer_size));
+			return reader->_ring < 0 ? nullptr : std::move(reader);
+		}
 
-		FolderInfo  _directory;
+		~UringReader()
+		{
+			if (_ring >= 0)
+			{
+				cancel_reads();
+			}
+			if (_sqes != MAP_FAILED)
+			{
+				munmap(_sqes, _sqes_size);
+			}
+			if (_rings != MAP_FAILED)
+			{
+				munmap(_rings, _rings_size);
+			}
+			if (_ring >= 0)
+			{
+				close(_ring); // cancels whatever is still queued
+			}
+		}
 
-		const std::uint32_t _listen_filters = IN_MODIFY | IN_CREATE | IN_DELETE;
+		UringReader(const UringReader&) = delete;
+		UringReader& operator=(const UringReader&) = delete;
 
-		const static std::size_t event_size = (sizeof(struct inotify_event));
-#endif // __unix__
+		// Waits for at most `timeout_ms` (-1 for ever) for the oldest read to complete and returns its length, with `data`
+		// pointing at the bytes until the next call. Returns 0 on a timeout, a signal or once `wake` is readable, and -1
+		// with errno set if a read failed.
+		ssize_t next(const char*& data, int timeout_ms)
+		{
+			for (auto waited = false; ; waited = true)
+			{
+				reap();
+				while (_next < _chain && _done[_next])
+				{
+					const auto slot = _next++;
+					if (_results[slot] == -EAGAIN || _results[slot] == 0)
+					{
+						continue;
+					}
+					if (_results[slot] < 0)
+					{
+						errno = -_results[slot];
+						return -1;
+					}
+					data = &_buffers[slot * _slot_size];
+					return _results[slot];
+				}
+				if (_woken || waited)
+				{
+					return 0;
+				}
 
-#if FILEWATCH_PLATFORM_MAC
-            struct FileState 
-            {
-                  int fd;
-                  uint32_t nlink;
-                  time_t last_modification;
+				if (_next == _chain)
+				{
+					queue_reads();
+				}
+				if (!_wake_armed)
+				{
+					queue_poll(_wake, _wake_slot, 0);
+					_wake_armed = true;
+				}
+				if (timeout_ms == 0 && _unsubmitted == 0)
+				{
+					return 0;
+				}
+				if (enter(timeout_ms) < 0)
+				{
+					return 0;
+				}
+			}
+		}
 
-                  FileState(int fd, uint32_t nlink, time_t lt) 
-                        : fd(fd), nlink(nlink), 
-                        last_modification(lt)
-                  {
+		// After draining `wake`: watch it again, rather than returning 0 for good.
+		void rearm_wake()
+		{
+			if (_woken)
+			{
+				_woken = false;
+				_wake_armed = false;
+			}
+		}
 
-                  }
-                  FileState(const FileState&) = delete;
-                  FileState& operator=(const FileState&) = delete;
-                  FileState(FileState&& other) : fd(other.fd), nlink(other.nlink), last_modification(other.last_modification)
-                  {
-                        other.fd = -1;
-                  }
+	private:
+		static constexpr std::size_t _chain = { 4 };
+		static constexpr std::uint64_t _wake_slot = { _chain };
+		static constexpr std::uint64_t _ready_slot = { _chain + 1 };
+		static constexpr std::uint64_t _cancel_slot = { _chain + 2 };
+
+		const int _fd;
+		const int _wake;
+		int _ring = { -1 };
+		bool _registered = { false };
+		const std::size_t _slot_size;
+		std::vector<char> _buffers;
+
+		void* _rings = MAP_FAILED;
+		std::size_t _rings_size = { 0 };
+		struct io_uring_sqe* _sqes = static_cast<struct io_uring_sqe*>(MAP_FAILED);
+		std::size_t _sqes_size = { 0 };
+		unsigned* _sq_tail = { nullptr };
+		unsigned _sq_mask = { 0 };
+		unsigned* _sq_array = { nullptr };
+		unsigned* _cq_head = { nullptr };
+		unsigned* _cq_tail = { nullptr };
+		unsigned _cq_mask = { 0 };
+		struct io_uring_cqe* _cqes = { nullptr };
+		// queued entries go in at _sq_local_tail, the kernel sees them once enter() publishes it
+		unsigned _sq_local_tail = { 0 };
+		unsigned _unsubmitted = { 0 };
+
+		// the current chain, read in order, _next is the first read not handed out yet
+		std::array<int, _chain> _results = {};
+		std::array<bool, _chain> _done = {};
+		std::size_t _next = { _chain };
+		// the last chain only got EAGAIN back (older kernels don't poll non blocking reads), start the next with a poll
+		bool _poll_first = { false };
+		bool _wake_armed = { false };
+		bool _woken = { false };
+
+		UringReader(int fd, int wake, std::size_t buffer_size) :
+			_fd(fd),
+			_wake(wake),
+			_slot_size(buffer_size / _chain),
+			_buffers(_slot_size * _chain)
+		{
+			struct io_uring_params params = {};
+			const auto ring = static_cast<int>(syscall(__NR_io_uring_setup, 8, &params));
+			if (ring < 0)
+			{
+				return;
+			}
+			const auto needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_FAST_POLL | IORING_FEAT_EXT_ARG;
+			_rings_size = (std::max)(params.sq_off.array + params.sq_entries * sizeof(unsigned), params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+			_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+			if ((params.features & needed) != needed ||
+				(_rings = mmap(nullptr, _rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING)) == MAP_FAILED ||
+				(_sqes = static_cast<struct io_uring_sqe*>(mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES))) == MAP_FAILED)
+			{
+				close(ring);
+				return;
+			}
+			_ring = ring;
+
+			char* rings = static_cast<char*>(_rings);
+			_sq_tail = reinterpret_cast<unsigned*>(rings + params.sq_off.tail);
+			_sq_local_tail = *_sq_tail;
+			_sq_mask = *reinterpret_cast<unsigned*>(rings + params.sq_off.ring_mask);
+			_sq_array = reinterpret_cast<unsigned*>(rings + params.sq_off.array);
+			_cq_head = reinterpret_cast<unsigned*>(rings + params.cq_off.head);
+			_cq_tail = reinterpret_cast<unsigned*>(rings + params.cq_off.tail);
+			_cq_mask = *reinterpret_cast<unsigned*>(rings + params.cq_off.ring_mask);
+			_cqes = reinterpret_cast<struct io_uring_cqe*>(rings + params.cq_off.cqes);
+
+			// pinning the buffers can fail against RLIMIT_MEMLOCK, plain reads into them work all the same
+			std::array<struct iovec, _chain> buffers;
+			for (std::size_t slot = 0; slot < _chain; ++slot)
+			{
+				buffers[slot].iov_base = &_buffers[slot * _slot_size];
+				buffers[slot].iov_len = _slot_size;
+			}
+			_registered = syscall(__NR_io_uring_register, _ring, IORING_REGISTER_BUFFERS, buffers.data(), static_cast<unsigned>(_chain)) == 0;
+		}
 
-                  FileState invalidate_and_clone() {
-                        int fd = this->fd;
+		struct io_uring_sqe* queue(std::uint8_t opcode, int fd, std::uint64_t user_data, std::uint8_t flags)
+		{
+			const auto tail = _sq_local_tail++;
+			++_unsubmitted;
+			struct io_uring_sqe* sqe = &_sqes[tail & _sq_mask];
+			std::memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = opcode;
+			sqe->fd = fd;
+			sqe->flags = flags;
+			sqe->user_data = user_data;
+			_sq_array[tail & _sq_mask] = tail & _sq_mask;
+			return sqe;
+		}
 
-                        this->fd = -1;
-                        return FileState {fd, nlink, last_modification};
-                  }
+		void queue_poll(int fd, std::uint64_t user_data, std::uint8_t flags)
+		{
+			queue(IORING_OP_POLL_ADD, fd, user_data, flags)->poll_events = POLLIN;
+		}
 
-                  ~FileState() 
-                  {
-                        if (fd != -1) {
-                              close(fd);
-                        }
-                  }
-            };
-            std::unordered_map<StringType, FileState> _directory_snapshot{};
-            bool _previous_event_is_rename = false;
-            CFRunLoopRef _run_loop = nullptr;
-            int _file_fd = -1;
-            struct timespec _last_modification_time = {};
-            FSEventStreamRef _directory;
-            // fd for single file
-#endif // FILEWATCH_PLATFORM_MAC
+		void queue_reads()
+		{
+			if (_poll_first)
+			{
+				queue_poll(_fd, _ready_slot, IOSQE_IO_HARDLINK);
+			}
+			_poll_first = true;
+			for (std::size_t slot = 0; slot < _chain; ++slot)
+			{
+				auto* read = queue(_registered ? IORING_OP_READ_FIXED : IORING_OP_READ, _fd, slot, slot + 1 < _chain ? IOSQE_IO_HARDLINK : 0);
+				read->addr = reinterpret_cast<std::uint64_t>(&_buffers[slot * _slot_size]);
+				read->len = static_cast<std::uint32_t>(_slot_size);
+				read->buf_index = static_cast<std::uint16_t>(slot);
+				_done[slot] = false;
+			}
+			_next = 0;
+		}
 
-		void init() 
+		// Submit whatever is queued and wait for a completion, -1 if the wait timed out or was interrupted.
+		int enter(int timeout_ms)
 		{
-#ifdef _WIN32
-			_close_event = CreateEvent(NULL, TRUE, FALSE, NULL);
-			if (!_close_event) {
-				throw std::system_error(GetLastError(), std::system_category());
+			__atomic_store_n(_sq_tail, _sq_local_tail, __ATOMIC_RELEASE);
+			struct __kernel_timespec timeout = {};
+			timeout.tv_sec = timeout_ms / 1000;
+			timeout.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+			struct io_uring_getevents_arg arguments = {};
+			arguments.ts = timeout_ms < 0 ? 0 : reinterpret_cast<std::uint64_t>(&timeout);
+			const auto result = syscall(__NR_io_uring_enter, _ring, _unsubmitted, timeout_ms == 0 ? 0 : 1,
+				IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arguments, sizeof(arguments));
+			if (result >= 0)
+			{
+				_unsubmitted -= static_cast<unsigned>(result);
 			}
-#endif // WIN32
+			return result < 0 ? -1 : 0;
+		}
 
-			_callback_thread = std::thread([this]() {
-				try {
-					callback_thread();
-				} catch (...) {
-					try {
-						_running.set_exception(std::current_exception());
-					}
-					catch (...) {} // set_exception() may throw too
+		void reap()
+		{
+			auto head = __atomic_load_n(_cq_head, __ATOMIC_RELAXED);
+			const auto tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+			for (; head != tail; ++head)
+			{
+				const struct io_uring_cqe& completion = _cqes[head & _cq_mask];
+				if (completion.user_data == _wake_slot)
+				{
+					_woken = true;
 				}
-			});
+				else if (completion.user_data < _chain)
+				{
+					_results[completion.user_data] = completion.res;
+					_done[completion.user_data] = true;
+					_poll_first = _poll_first && completion.res == -EAGAIN;
+				}
+			}
+			__atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+		}
+
+		// A read still queued would write into _buffers after they are gone. Cancelling the one in progress starts the next
+		// in the (hard linked) chain, so keep cancelling until every read has completed.
+		void cancel_reads()
+		{
+			reap();
+			for (int round = 0; round < 4 * static_cast<int>(_chain); ++round)
+			{
+				auto pending = false;
+				for (std::size_t slot = 0; slot < _chain; ++slot)
+				{
+					if (_next < _chain && !_done[slot])
+					{
+						queue(IORING_OP_ASYNC_CANCEL, -1, _cancel_slot, 0)->addr = slot;
+						pending = true;
+					}
+				}
+				if (!pending)
+				{
+					return;
+				}
+				queue(IORING_OP_ASYNC_CANCEL, -1, _cancel_slot, 0)->addr = _ready_slot;
+				enter(100);
+				reap();
+			}
+		}
+	};
+#endif // FILEWATCH_IO_URING
+
+#if __unix__
+	/**
+	* \class InotifyHub
+	*
+	* \brief A single inotify instance, epoll reactor thread and dispatch thread shared by every FileWatch created with Options::shared_hub.
+	*
+	* Watchers register as clients and events are routed to them by watch descriptor, so adding watchers costs no extra threads or file descriptors.
+	* The hub lives as long as at least one watcher holds it.
+	*/
+	class InotifyHub
+	{
+	public:
+		class Client
+		{
+		public:
+			virtual ~Client() {}
+			// reactor thread, an event for one of the watches this client added
+			virtual void on_event(const struct inotify_event* event) = 0;
+			// reactor thread, every event of the current read has been handed to the client
+			virtual void on_read_end() = 0;
+			// reactor thread, the time asked for with InotifyHub::wake_at() has passed
+			virtual void on_timeout() = 0;
+			// dispatch thread, runs once after one or more calls to InotifyHub::schedule()
+			virtual void dispatch() = 0;
+			// reactor thread, reading events failed and the client won't be called with any more of them
+			virtual void on_error(std::exception_ptr error) = 0;
+
+		private:
+			friend class InotifyHub;
+			bool _touched = false; // reactor thread only
+			bool _scheduled = false; // guarded by _dispatch_mutex
+		};
+
+		static std::shared_ptr<InotifyHub> instance(bool use_io_uring)
+		{
+			static std::mutex mutex;
+			static std::weak_ptr<InotifyHub> current;
+
+			std::lock_guard<std::mutex> lock(mutex);
+			auto hub = current.lock();
+			// one whose reactor has stopped on an error is left to the watchers still using it
+			if (!hub || hub->failed())
+			{
+				hub = std::make_shared<InotifyHub>(use_io_uring);
+				current = hub;
+			}
+			return hub;
+		}
+
+		explicit InotifyHub(bool use_io_uring) :
+			_use_io_uring(use_io_uring)
+		{
+			_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+			_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			_epoll = epoll_create1(EPOLL_CLOEXEC);
+			if (_inotify < 0 || _wake < 0 || _epoll < 0 || !watch_for_input(_inotify) || !watch_for_input(_wake))
+			{
+				const auto error = errno;
+				close_descriptors();
+				throw std::system_error(error, std::system_category());
+			}
+
+			_reactor_thread = std::thread([this]() { reactor(); });
+			_dispatch_thread = std::thread([this]() { dispatcher(); });
+		}
+
+		~InotifyHub()
+		{
+			_stop = true;
+			const std::uint64_t wake = 1;
+			if (write(_wake, &wake, sizeof(wake)) < 0) {} // can only fail if the counter is already non zero, which wakes the reactor anyway
+			{
+				std::lock_guard<std::mutex> lock(_dispatch_mutex);
+			}
+			_dispatch_cv.notify_all();
+			_reactor_thread.join();
+			_dispatch_thread.join();
+			close_descriptors();
+		}
+
+		InotifyHub(const InotifyHub&) = delete;
+		InotifyHub& operator=(const InotifyHub&) = delete;
+
+		// Until release(), the client's events are kept for it instead of handed over, so it can register its watches and
+		// scan what they cover without holding up anyone else's events. Call before its first add_watch().
+		void hold(Client* client)
+		{
+			std::lock_guard<std::recursive_mutex> lock(_watch_mutex);
+			_held[client];
+		}
+
+		// The reactor hands the client what was kept for it, then carries on as usual.
+		void release(Client* client)
+		{
+			std::lock_guard<std::recursive_mutex> lock(_watch_mutex);
+			const auto held = _held.find(client);
+			if (held == _held.end())
+			{
+				return;
+			}
+			held->second.released = true;
+			if (std::this_thread::get_id() != _reactor_thread.get_id())
+			{
+				const std::uint64_t wake = 1;
+				if (write(_wake, &wake, sizeof(wake)) < 0) {} // can only fail if the counter is already non zero, which wakes the reactor anyway
+			}
+		}
+
+		// Same contract as inotify_add_watch(), watching a directory another client already watches shares the descriptor.
+		int add_watch(Client* client, const char* path, std::uint32_t mask)
+		{
+			std::lock_guard<std::recursive_mutex> lock(_watch_mutex);
+			if (_error != 0)
+			{
+				// nobody would read its events
+				errno = _error;
+				return -1;
+			}
+			const auto watch = inotify_add_watch(_inotify, path, mask | IN_MASK_ADD);
+			if (watch < 0)
+			{
+				return watch;
+			}
+			auto& clients = _watches[watch];
+			if (std::find(clients.begin(), clients.end(), client) == clients.end())
+			{
+				clients.push_back(client);
+			}
+			_client_watches[client].insert(watch);
+			return watch;
+		}
+
+		// Same contract as inotify_rm_watch(), the descriptor is only really removed once no other client uses it.
+		void remove_watch(Client* client, int watch)
+		{
+			std::lock_guard<std::recursive_mutex> lock(_watch_mutex);
+			unsubscribe(client, watch);
+			_client_watches[client].erase(watch);
+		}
+
+		// Removes every watch of the client, once this returns the client is never called again.
+		void remove_client(Client* client)
+		{
+			{
+				std::lock_guard<std::recursive_mutex> lock(_watch_mutex);
+				const auto owned = _client_watches.find(client);
+				if (owned != _client_watches.end())
+				{
+					for (const auto watch : owned->second)
+					{
+						unsubscribe(client, watch);
+					}
+					_client_watches.erase(owned);
+				}
+				for (auto wake = _wakes.begin(); wake != _wakes.end(); )
+				{
+					wake = wake->second == client ? _wakes.erase(wake) : std::next(wake);
+				}
+				_held.erase(client);
+			}
+
+			std::unique_lock<std::mutex> lock(_dispatch_mutex);
+			_ready.erase(std::remove(_ready.begin(), _ready.end(), client), _ready.end());
+			for (auto timer = _timers.begin(); timer != _timers.end(); )
+			{
+				timer = timer->second == client ? _timers.erase(timer) : std::next(timer);
+			}
+			client->_scheduled = false;
+			_dispatch_cv.wait(lock, [this, client] { return _dispatching != client; });
+		}
+
+		// Queue the client for a dispatch() call, repeated calls before it runs are merged.
+		void schedule(Client* client)
+		{
+			{
+				std::lock_guard<std::mutex> lock(_dispatch_mutex);
+				if (!make_ready(client))
+				{
+					return;
+				}
+			}
+			_dispatch_cv.notify_all();
+		}
+
+		// Call the client's on_timeout(), on the reactor thread, once `when` has passed.
+		void wake_at(Client* client, std::chrono::steady_clock::time_point when)
+		{
+			std::lock_guard<std::recursive_mutex> lock(_watch_mutex);
+			_wakes.insert(std::make_pair(when, client));
+			if (std::this_thread::get_id() != _reactor_thread.get_id())
+			{
+				// it may be asleep without a timeout, or with a later one
+				const std::uint64_t wake = 1;
+				if (write(_wake, &wake, sizeof(wake)) < 0) {} // can only fail if the counter is already non zero, which wakes the reactor anyway
+			}
+		}
+
+		// Queue the client for a dispatch() call once `when` has passed.
+		void schedule_at(Client* client, std::chrono::steady_clock::time_point when)
+		{
+			{
+				std::lock_guard<std::mutex> lock(_dispatch_mutex);
+				_timers.insert(std::make_pair(when, client));
+			}
+			_dispatch_cv.notify_all();
+		}
+
+		// True once the reactor has stopped on an error.
+		bool failed()
+		{
+			std::lock_guard<std::recursive_mutex> lock(_watch_mutex);
+			return _error != 0;
+		}
+
+	private:
+		const bool _use_io_uring;
+		int _inotify = { -1 };
+		int _wake = { -1 };
+		int _epoll = { -1 };
+		std::atomic<bool> _stop = { false };
+
+		std::recursive_mutex _watch_mutex = {};
+		std::unordered_map<int, std::vector<Client*>> _watches = {};
+		std::unordered_map<Client*, std::unordered_set<int>> _client_watches = {};
+		std::vector<Client*> _targets = {};
+		std::multimap<std::chrono::steady_clock::time_point, Client*> _wakes = {};
+		// the errno that stopped the reactor, 0 while it is running
+		int _error = { 0 };
+		// the records read for clients between hold() and release(), past the limit only an IN_Q_OVERFLOW is kept, as the
+		// kernel would do
+		struct Held
+		{
+			std::vector<char> events = {};
+			bool overflowed = { false };
+			bool released = { false };
+		};
+		std::unordered_map<Client*, Held> _held = {};
+		static constexpr std::size_t _held_limit = { 4 * 1024 * 1024 };
+
+		std::mutex _dispatch_mutex = {};
+		std::condition_variable _dispatch_cv = {};
+		std::deque<Client*> _ready = {};
+		std::multimap<std::chrono::steady_clock::time_point, Client*> _timers = {};
+		Client* _dispatching = { nullptr };
+
+		std::thread _reactor_thread = {};
+		std::thread _dispatch_thread = {};
+
+		bool watch_for_input(int fd)
+		{
+			struct epoll_event event = {};
+			event.events = EPOLLIN;
+			event.data.fd = fd;
+			return epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &event) == 0;
+		}
+
+		void close_descriptors()
+		{
+			for (const auto fd : { _epoll, _wake, _inotify })
+			{
+				if (fd >= 0)
+				{
+					close(fd);
+				}
+			}
+		}
+
+		void unsubscribe(Client* client, int watch)
+		{
+			const auto found = _watches.find(watch);
+			if (found == _watches.end())
+			{
+				return;
+			}
+			auto& clients = found->second;
+			clients.erase(std::remove(clients.begin(), clients.end(), client), clients.end());
+			if (clients.empty())
+			{
+				_watches.erase(found);
+				inotify_rm_watch(_inotify, watch);
+			}
+		}
+
+		void route(const struct inotify_event* event, std::vector<Client*>& touched)
+		{
+			const auto found = _watches.find(event->wd);
+			if (event->mask & IN_Q_OVERFLOW)
+			{
+				// the kernel dropped events, any client could have lost some
+				_targets.clear();
+				for (const auto& client : _client_watches)
+				{
+					_targets.push_back(client.first);
+				}
+			}
+			else if (found == _watches.end())
+			{
+				return;
+			}
+			else
+			{
+				// clients may add watches while handling the event, so work from a copy of the subscribers
+				_targets.assign(found->second.begin(), found->second.end());
+			}
+			if (event->mask & IN_IGNORED)
+			{
+				for (auto* client : _targets)
+				{
+					_client_watches[client].erase(event->wd);
+				}
+				_watches.erase(found);
+			}
+
+			for (auto* client : _targets)
+			{
+				const auto held = _held.find(client);
+				if (held != _held.end())
+				{
+					keep(held->second, event);
+					continue;
+				}
+				client->on_event(event);
+				if (!client->_touched)
+				{
+					client->_touched = true;
+					touched.push_back(client);
+				}
+			}
+		}
+
+		void reactor()
+		{
+			std::vector<char> buffer(1024 * 256);
+			std::vector<Client*> touched;
+#if FILEWATCH_IO_URING
+			// created and destroyed on this thread, which owns the reads it queues
+			const auto uring = _use_io_uring ? UringReader::create(_inotify, _wake, buffer.size()) : nullptr;
+#endif // FILEWATCH_IO_URING
+			while (_stop == false)
+			{
+#if FILEWATCH_IO_URING
+				if (uring)
+				{
+					const char* data = nullptr;
+					auto length = uring->next(data, next_wake_timeout());
+					for (; _stop == false && length > 0; length = uring->next(data, 0))
+					{
+						route_all(data, length, touched);
+					}
+					if (length < 0)
+					{
+						fail(errno);
+						return;
+					}
+					if (drain_wake())
+					{
+						uring->rearm_wake();
+					}
+					run_wakes();
+					continue;
+				}
+#endif // FILEWATCH_IO_URING
+				struct epoll_event ready[2];
+				if (epoll_wait(_epoll, ready, 2, next_wake_timeout()) < 0 && errno != EINTR)
+				{
+					fail(errno);
+					return;
+				}
+
+				drain_wake();
+				ssize_t length = 0;
+				while (_stop == false && (length = read(_inotify, buffer.data(), buffer.size())) > 0)
+				{
+					route_all(buffer.data(), length, touched);
+				}
+				run_wakes();
+			}
+		}
+
+		void route_all(const char* buffer, ssize_t length, std::vector<Client*>& touched)
+		{
+			std::lock_guard<std::recursive_mutex> lock(_watch_mutex);
+			for (ssize_t i = 0; i < length; )
+			{
+				const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(&buffer[i]); // NOLINT
+				route(event, touched);
+				i += sizeof(struct inotify_event) + event->len;
+			}
+			for (auto* client : touched)
+			{
+				client->_touched = false;
+				client->on_read_end();
+			}
+			touched.clear();
+		}
+
+		// The reactor stops on `error`, every client is told as none of them will see another event.
+		void fail(int error)
+		{
+			const auto thrown = std::make_exception_ptr(std::system_error(error, std::system_category()));
+			std::lock_guard<std::recursive_mutex> lock(_watch_mutex);
+			_error = error;
+			_wakes.clear();
+			for (const auto& client : _client_watches)
+			{
+				client.first->on_error(thrown);
+			}
+		}
+
+		// Clears a wake_at() from another thread, the one from the destructor is left so the reactor sees it. True if it was set.
+		bool drain_wake()
+		{
+			std::uint64_t wakes = 0;
+			return _stop == false && read(_wake, &wakes, sizeof(wakes)) == sizeof(wakes);
+		}
+
+		static void keep(Held& held, const struct inotify_event* event)
+		{
+			if (held.overflowed)
+			{
+				return;
+			}
+			const auto size = sizeof(struct inotify_event) + event->len;
+			if (held.events.size() + size > _held_limit)
+			{
+				struct inotify_event overflow = {};
+				overflow.wd = -1;
+				overflow.mask = IN_Q_OVERFLOW;
+				event = &overflow;
+				held.overflowed = true;
+			}
+			const auto* bytes = reinterpret_cast<const char*>(event); // NOLINT
+			held.events.insert(held.events.end(), bytes, bytes + sizeof(struct inotify_event) + event->len);
+		}
+
+		// Hands released clients what was kept for them, then lets them wrap up as after a read.
+		void run_released()
+		{
+			std::vector<std::pair<Client*, std::vector<char>>> released;
+			for (auto held = _held.begin(); held != _held.end(); )
+			{
+				if (held->second.released)
+				{
+					released.emplace_back(held->first, std::move(held->second.events));
+					held = _held.erase(held);
+				}
+				else
+				{
+					++held;
+				}
+			}
+			for (const auto& client : released)
+			{
+				const auto& events = client.second;
+				for (std::size_t i = 0; i < events.size(); )
+				{
+					const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(&events[i]); // NOLINT
+					client.first->on_event(event);
+					i += sizeof(struct inotify_event) + event->len;
+				}
+				client.first->on_read_end();
+			}
+		}
+
+		void run_wakes()
+		{
+			std::lock_guard<std::recursive_mutex> lock(_watch_mutex);
+			run_released();
+			const auto now = std::chrono::steady_clock::now();
+			while (!_wakes.empty() && _wakes.begin()->first <= now)
+			{
+				Client* client = _wakes.begin()->second;
+				_wakes.erase(_wakes.begin());
+				client->on_timeout();
+			}
+		}
+
+		// Milliseconds epoll_wait() may sleep for before the next wake_at() is due, -1 for none.
+		int next_wake_timeout()
+		{
+			std::lock_guard<std::recursive_mutex> lock(_watch_mutex);
+			if (_wakes.empty())
+			{
+				return -1;
+			}
+			const auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(_wakes.begin()->first - std::chrono::steady_clock::now()).count();
+			// round up, waking early would just go straight back to sleep
+			return wait < 0 ? 0 : static_cast<int>(wait) + 1;
+		}
+
+		bool make_ready(Client* client)
+		{
+			if (client->_scheduled)
+			{
+				return false;
+			}
+			client->_scheduled = true;
+			_ready.push_back(client);
+			return true;
+		}
+
+		void dispatcher()
+		{
+			std::unique_lock<std::mutex> lock(_dispatch_mutex);
+			while (true)
+			{
+				const auto now = std::chrono::steady_clock::now();
+				while (!_timers.empty() && _timers.begin()->first <= now)
+				{
+					make_ready(_timers.begin()->second);
+					_timers.erase(_timers.begin());
+				}
+				if (_ready.empty() && !_stop)
+				{
+					if (_timers.empty())
+					{
+						_dispatch_cv.wait(lock);
+					}
+					else
+					{
+						_dispatch_cv.wait_until(lock, _timers.begin()->first);
+					}
+					continue;
+				}
+				if (_stop)
+				{
+					return;
+				}
+				Client* client = _ready.front();
+				_ready.pop_front();
+				client->_scheduled = false;
+				_dispatching = client;
+				lock.unlock();
+
+				try
+				{
+					client->dispatch();
+				}
+				catch (...) {} // one watcher must not take down the others
+
+				lock.lock();
+				_dispatching = nullptr;
+				_dispatch_cv.notify_all();
+			}
+		}
+	};
+
+#endif // __unix__
+
+	/**
+	* \class SnapshotIndex
+	*
+	* \brief Every entry of a directory tree sorted by path, with the paths packed one after another in a single buffer,
+	* so two of them can be compared in one merge pass. It can be saved to, and loaded from, a versioned binary file.
+	*/
+	template<typename StringType>
+	class SnapshotIndex
+	{
+		typedef typename StringType::value_type C;
+		typedef std::basic_string<C, std::char_traits<C>> UnderpinningString;
+
+	public:
+		struct FileState
+		{
+			std::uint64_t inode;
+			std::int64_t size;
+			std::int64_t modified; // nanoseconds
+			bool directory;
+			// of the contents when Options::suppress_unchanged_writes last hashed them, 0 when they weren't
+			std::uint64_t hash;
+
+			// Hashes are only compared when both sides have one.
+			bool operator==(const FileState& other) const
+			{
+				return inode == other.inode && size == other.size && modified == other.modified && directory == other.directory
+					&& (hash == 0 || other.hash == 0 || hash == other.hash);
+			}
+			bool operator!=(const FileState& other) const { return !(*this == other); }
+		};
+		typedef std::vector<std::pair<UnderpinningString, FileState>> Entries;
+
+		SnapshotIndex() {}
+
+		explicit SnapshotIndex(Entries entries)
+		{
+			std::sort(entries.begin(), entries.end(), [](const typename Entries::value_type& left, const typename Entries::value_type& right) {
+				return left.first < right.first;
+			});
+			std::size_t characters = 0;
+			for (const auto& entry : entries)
+			{
+				characters += entry.first.size();
+			}
+			_paths.reserve(characters);
+			_entries.reserve(entries.size());
+			for (const auto& entry : entries)
+			{
+				_entries.push_back(Entry{ _paths.size(), entry.first.size(), entry.second });
+				_paths.insert(_paths.end(), entry.first.begin(), entry.first.end());
+			}
+		}
+
+		std::size_t size() const { return _entries.size(); }
+		bool empty() const { return _entries.empty(); }
+		UnderpinningString path(std::size_t index) const { return UnderpinningString(path_data(index), _entries[index].length); }
+		const FileState& state(std::size_t index) const { return _entries[index].state; }
+
+		// The index of `path`, or size() if it isn't there.
+		std::size_t find(const UnderpinningString& path) const
+		{
+			std::size_t first = 0;
+			std::size_t count = _entries.size();
+			while (count > 0)
+			{
+				const auto half = count / 2;
+				if (compare(*this, first + half, path.data(), path.size()) < 0)
+				{
+					first += half + 1;
+					count -= half + 1;
+				}
+				else
+				{
+					count = half;
+				}
+			}
+			return first < _entries.size() && compare(*this, first, path.data(), path.size()) == 0 ? first : _entries.size();
+		}
+
+		// Calls `on_change(path, event)` for every difference between `before` and this, in path order. An entry that
+		// turned from a file into a directory, or back, is reported removed and then added.
+		template<typename OnChange>
+		void diff(const SnapshotIndex& before, OnChange on_change) const
+		{
+			std::size_t old = 0;
+			std::size_t now = 0;
+			while (old < before.size() || now < size())
+			{
+				const auto order = old == before.size() ? 1
+					: now == size() ? -1
+					: compare(before, old, path_data(now), _entries[now].length);
+				if (order < 0)
+				{
+					on_change(before.path(old++), Event::removed);
+				}
+				else if (order > 0)
+				{
+					on_change(path(now++), Event::added);
+				}
+				else
+				{
+					if (before.state(old).directory != state(now).directory)
+					{
+						on_change(path(now), Event::removed);
+						on_change(path(now), Event::added);
+					}
+					else if (before.state(old) != state(now))
+					{
+						on_change(path(now), Event::modified);
+					}
+					++old;
+					++now;
+				}
+			}
+		}
+
+#if __unix__ || FILEWATCH_PLATFORM_MAC
+		// Writes the index to `file`, noting which tree it is of. It is written to a temporary file renamed over `file`
+		// once complete, so a crash part way leaves the last one intact. Returns false if it couldn't be written.
+		bool save(const std::string& file, const UnderpinningString& root, bool recursive) const
+		{
+			FileHeader header = {};
+			std::memcpy(header.magic, magic(), sizeof(header.magic));
+			header.version = _version;
+			header.char_size = sizeof(C);
+			header.recursive = recursive;
+			header.root_length = root.size();
+			header.count = _entries.size();
+			header.path_length = _paths.size();
+			const auto size = sizeof(header) + _entries.size() * sizeof(FileRecord) + (root.size() + _paths.size()) * sizeof(C);
+
+			const std::string temporary = file + ".tmp";
+			const int fd = open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			if (fd < 0)
+			{
+				return false;
+			}
+			void* mapped = MAP_FAILED;
+			if (ftruncate(fd, static_cast<off_t>(size)) == 0
+				&& (mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) != MAP_FAILED)
+			{
+				char* out = static_cast<char*>(mapped);
+				std::memcpy(out, &header, sizeof(header));
+				auto* records = reinterpret_cast<FileRecord*>(out + sizeof(header)); // NOLINT
+				for (std::size_t i = 0; i < _entries.size(); ++i)
+				{
+					const auto& entry = _entries[i];
+					records[i] = FileRecord{ entry.offset, entry.length, entry.state.inode, entry.state.size, entry.state.modified,
+						entry.state.hash, entry.state.directory };
+				}
+				auto* paths = reinterpret_cast<C*>(records + _entries.size()); // NOLINT
+				std::copy(root.begin(), root.end(), paths);
+				std::copy(_paths.begin(), _paths.end(), paths + root.size());
+				munmap(mapped, size);
+			}
+			const auto written = mapped != MAP_FAILED && fsync(fd) == 0;
+			close(fd);
+			if (!written || rename(temporary.c_str(), file.c_str()) != 0)
+			{
+				unlink(temporary.c_str());
+				return false;
+			}
+			return true;
+		}
+
+		// Reads `file` into `index` through a read only mapping. Returns false, leaving `index` as it was, if it is missing,
+		// damaged, of another version, or of a tree other than `root` (with `recursive`).
+		static bool load(const std::string& file, const UnderpinningString& root, bool recursive, SnapshotIndex& index)
+		{
+			const int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd < 0)
+			{
+				return false;
+			}
+			struct stat statbuf = {};
+			void* mapped = MAP_FAILED;
+			std::size_t size = 0;
+			if (fstat(fd, &statbuf) == 0 && statbuf.st_size >= static_cast<off_t>(sizeof(FileHeader)))
+			{
+				size = static_cast<std::size_t>(statbuf.st_size);
+				mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			}
+			close(fd);
+			if (mapped == MAP_FAILED)
+			{
+				return false;
+			}
+			SnapshotIndex loaded;
+			const auto valid = loaded.read(static_cast<const char*>(mapped), size, root, recursive);
+			munmap(mapped, size);
+			if (valid)
+			{
+				index = std::move(loaded);
+			}
+			return valid;
+		}
+#endif // __unix__ || FILEWATCH_PLATFORM_MAC
+
+	private:
+		// the layout on disk, in the machine's own byte order
+		struct FileHeader
+		{
+			char magic[8];
+			std::uint32_t version;
+			std::uint32_t char_size;
+			std::uint64_t recursive;
+			std::uint64_t root_length;
+			std::uint64_t count;
+			std::uint64_t path_length;
+		};
+		struct FileRecord
+		{
+			std::uint64_t path_offset;
+			std::uint64_t path_length;
+			std::uint64_t inode;
+			std::int64_t size;
+			std::int64_t modified;
+			std::uint64_t hash;
+			std::uint64_t directory;
+		};
+		// an enum so it needs no out of line definition in a header only library
+		enum : std::uint32_t { _version = 1 };
+		static const char* magic() { return "FWSNAP\0"; }
+
+		struct Entry
+		{
+			std::size_t offset;
+			std::size_t length;
+			FileState state;
+		};
+
+		std::vector<C> _paths = {};
+		std::vector<Entry> _entries = {};
+
+		const C* path_data(std::size_t index) const { return _paths.data() + _entries[index].offset; }
+
+		bool read(const char* data, std::size_t size, const UnderpinningString& root, bool recursive)
+		{
+			FileHeader header;
+			std::memcpy(&header, data, sizeof(header));
+			if (std::memcmp(header.magic, magic(), sizeof(header.magic)) != 0 || header.version != _version || header.char_size != sizeof(C)
+				|| header.recursive != static_cast<std::uint64_t>(recursive) || header.root_length != root.size())
+			{
+				return false;
+			}
+			// checked one step at a time, so a damaged count can't overflow the sum
+			const auto space = (size - sizeof(header)) / sizeof(FileRecord);
+			const auto characters = header.root_length + header.path_length;
+			if (header.count > space || characters < header.root_length
+				|| characters > (size - sizeof(header) - header.count * sizeof(FileRecord)) / sizeof(C))
+			{
+				return false;
+			}
+			const auto* records = reinterpret_cast<const FileRecord*>(data + sizeof(header)); // NOLINT
+			const auto* paths = reinterpret_cast<const C*>(records + header.count); // NOLINT
+			if (!std::equal(root.begin(), root.end(), paths))
+			{
+				return false;
+			}
+			_paths.assign(paths + header.root_length, paths + header.root_length + header.path_length);
+			_entries.reserve(static_cast<std::size_t>(header.count));
+			for (std::size_t i = 0; i < header.count; ++i)
+			{
+				const auto& record = records[i];
+				if (record.path_offset > header.path_length || record.path_length > header.path_length - record.path_offset)
+				{
+					return false;
+				}
+				_entries.push_back(Entry{ static_cast<std::size_t>(record.path_offset), static_cast<std::size_t>(record.path_length),
+					FileState{ record.inode, record.size, record.modified, record.directory != 0, record.hash } });
+				// find() and diff() rely on the order
+				if (i > 0 && compare(*this, i - 1, path_data(i), record.path_length) >= 0)
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+
+		// Orders like std::basic_string's operator<.
+		static int compare(const SnapshotIndex& index, std::size_t entry, const C* path, std::size_t length)
+		{
+			const auto own_length = index._entries[entry].length;
+			const auto order = std::char_traits<C>::compare(index.path_data(entry), path, (std::min)(own_length, length));
+			if (order != 0)
+			{
+				return order;
+			}
+			return own_length < length ? -1 : own_length > length ? 1 : 0;
+		}
+	};
+
+#if __unix__ || FILEWATCH_PLATFORM_MAC
+	/**
+	* \class DirectoryScanner
+	*
+	* \brief Lists a directory tree and stats every entry, so one scan can be compared against a later one.
+	*
+	* Every thread keeps its own queue of directories still to list, taking the newest from its own and the oldest from
+	* another's once its own is empty. Helper threads are only started once a thread has more than one directory waiting,
+	* so scanning a single directory never starts a thread. On linux directories are read with getdents64 into a large
+	* buffer per thread.
+	*/
+	template<typename StringType>
+	class DirectoryScanner
+	{
+		typedef typename StringType::value_type C;
+		typedef std::basic_string<C, std::char_traits<C>> UnderpinningString;
+
+	public:
+		typedef typename SnapshotIndex<StringType>::FileState FileState;
+		typedef typename SnapshotIndex<StringType>::Entries Result;
+
+		// Every entry below `root` with its path relative to it, only the top level unless `recursive` is set. Without
+		// `stat_entries` only the inode and whether it is a directory are filled in, both taken from the listing when the
+		// filesystem reports entry types, so most entries cost no stat() at all.
+		static Result scan(const UnderpinningString& root, bool recursive, bool stat_entries = true)
+		{
+			DirectoryScanner scanner(root, recursive, stat_entries);
+			return scanner.run();
+		}
+
+		// As scan(), sorted into an index.
+		static SnapshotIndex<StringType> index(const UnderpinningString& root, bool recursive, bool stat_entries = true)
+		{
+			return SnapshotIndex<StringType>(scan(root, recursive, stat_entries));
+		}
+
+		static FileState state_of(const struct stat& statbuf)
+		{
+#if FILEWATCH_PLATFORM_MAC
+			const auto& modified = statbuf.st_mtimespec;
+#else
+			const auto& modified = statbuf.st_mtim;
+#endif // FILEWATCH_PLATFORM_MAC
+			return FileState{
+				static_cast<std::uint64_t>(statbuf.st_ino),
+				static_cast<std::int64_t>(statbuf.st_size),
+				static_cast<std::int64_t>(modified.tv_sec) * 1000000000 + modified.tv_nsec,
+				S_ISDIR(statbuf.st_mode),
+				0
+			};
+		}
+
+	private:
+		static constexpr std::size_t _buffer_size = { 128 * 1024 };
+
+		struct Worker
+		{
+			std::mutex mutex = {};
+			std::deque<UnderpinningString> pending = {};
+			Result result = {};
+			std::vector<UnderpinningString> found = {};
+#ifdef __linux__
+			std::vector<char> buffer = {};
+#endif // __linux__
+		};
+
+		const UnderpinningString _root;
+		const bool _recursive;
+		const bool _stat_entries;
+		// all made up front, so stealing never looks at a container that is growing
+		std::deque<Worker> _workers;
+
+		// directories queued or being listed, and just the queued ones
+		std::atomic<std::size_t> _outstanding = { 0 };
+		std::atomic<std::size_t> _queued = { 0 };
+		std::mutex _idle_mutex = {};
+		std::condition_variable _idle_cv = {};
+		std::vector<std::thread> _helpers = {};
+
+		DirectoryScanner(const UnderpinningString& root, bool recursive, bool stat_entries) :
+			_root(root),
+			_recursive(recursive),
+			_stat_entries(stat_entries),
+			_workers(recursive ? std::max(1u, std::min(8u, std::thread::hardware_concurrency())) : 1)
+		{}
+
+		Result run()
+		{
+			push(_workers.front(), std::vector<UnderpinningString>{ UnderpinningString() });
+			work(_workers.front());
+			for (auto& helper : _helpers)
+			{
+				helper.join();
+			}
+
+			Result all = std::move(_workers.front().result);
+			for (auto worker = std::next(_workers.begin()); worker != _workers.end(); ++worker)
+			{
+				all.insert(all.end(), std::make_move_iterator(worker->result.begin()), std::make_move_iterator(worker->result.end()));
+			}
+			return all;
+		}
+
+		void work(Worker& self)
+		{
+			UnderpinningString directory;
+			while (take(self, directory))
+			{
+				list(directory, self);
+				if (!self.found.empty())
+				{
+					push(self, self.found);
+					self.found.clear();
+				}
+				if (--_outstanding == 0)
+				{
+					std::lock_guard<std::mutex> lock(_idle_mutex);
+					_idle_cv.notify_all();
+				}
+			}
+		}
+
+		void push(Worker& self, const std::vector<UnderpinningString>& directories)
+		{
+			// counted before anyone can steal them, so _outstanding only reaches 0 once no thread is still in here and no
+			// helper can be started after run() has joined them
+			_outstanding += directories.size();
+			_queued += directories.size();
+			std::size_t waiting = 0;
+			{
+				std::lock_guard<std::mutex> lock(self.mutex);
+				self.pending.insert(self.pending.end(), directories.begin(), directories.end());
+				waiting = self.pending.size();
+			}
+
+			std::lock_guard<std::mutex> lock(_idle_mutex);
+			if (waiting > 1 && _helpers.size() + 1 < _workers.size())
+			{
+				Worker& helper = _workers[_helpers.size() + 1];
+				_helpers.emplace_back([this, &helper] { work(helper); });
+			}
+			_idle_cv.notify_all();
+		}
+
+		bool pop(Worker& from, UnderpinningString& directory, bool newest)
+		{
+			std::lock_guard<std::mutex> lock(from.mutex);
+			if (from.pending.empty())
+			{
+				return false;
+			}
+			if (newest)
+			{
+				directory = std::move(from.pending.back());
+				from.pending.pop_back();
+			}
+			else
+			{
+				directory = std::move(from.pending.front());
+				from.pending.pop_front();
+			}
+			--_queued;
+			return true;
+		}
+
+		// The next directory to list, false once every directory has been listed.
+		bool take(Worker& self, UnderpinningString& directory)
+		{
+			while (true)
+			{
+				// our own newest is likely still in the cache, stealing the oldest takes the biggest share of the tree
+				if (pop(self, directory, true))
+				{
+					return true;
+				}
+				for (auto& other : _workers)
+				{
+					if (&other != &self && pop(other, directory, false))
+					{
+						return true;
+					}
+				}
+				std::unique_lock<std::mutex> lock(_idle_mutex);
+				if (_outstanding == 0)
+				{
+					return false;
+				}
+				_idle_cv.wait(lock, [this] { return _queued > 0 || _outstanding == 0; });
+			}
+		}
+
+		void add(Worker& self, int fd, const UnderpinningString& directory, const char* name, std::uint64_t inode, unsigned char type)
+		{
+			const UnderpinningString entry_name{ name };
+			if (isParentOrSelfDirectory(entry_name))
+			{
+				return;
+			}
+			FileState state = { inode, 0, 0, type == DT_DIR, 0 };
+			if (_stat_entries || type == DT_UNKNOWN)
+			{
+				struct stat statbuf = {};
+				if (fstatat(fd, name, &statbuf, AT_SYMLINK_NOFOLLOW) != 0)
+				{
+					return; // gone again already
+				}
+				const auto stated = state_of(statbuf);
+				state.inode = stated.inode;
+				state.directory = stated.directory;
+				if (_stat_entries)
+				{
+					state = stated;
+				}
+			}
+			UnderpinningString child = directory.empty() ? entry_name : directory + C('/') + entry_name;
+			if (_recursive && state.directory)
+			{
+				self.found.push_back(child);
+			}
+			self.result.emplace_back(std::move(child), state);
+		}
+
+		void list(const UnderpinningString& directory, Worker& self)
+		{
+			const UnderpinningString path = directory.empty() ? _root : _root + C('/') + directory;
+			const int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (fd < 0)
+			{
+				return;
+			}
+#ifdef __linux__
+			// the record layout getdents64 fills in, glibc only wraps it from 2.30
+			struct LinuxDirent64
+			{
+				std::uint64_t d_ino;
+				std::int64_t d_off;
+				unsigned short d_reclen;
+				unsigned char d_type;
+				char d_name[1];
+			};
+			self.buffer.resize(_buffer_size);
+			long length = 0;
+			while ((length = syscall(SYS_getdents64, fd, self.buffer.data(), self.buffer.size())) > 0)
+			{
+				for (long offset = 0; offset < length; )
+				{
+					const auto* entry = reinterpret_cast<const LinuxDirent64*>(&self.buffer[offset]); // NOLINT
+					add(self, fd, directory, entry->d_name, entry->d_ino, entry->d_type);
+					offset += entry->d_reclen;
+				}
+			}
+			close(fd);
+#else
+			DIR* handle = fdopendir(fd);
+			if (handle == nullptr)
+			{
+				close(fd);
+				return;
+			}
+			while (const struct dirent* entry = readdir(handle))
+			{
+				add(self, fd, directory, entry->d_name, entry->d_ino, entry->d_type);
+			}
+			closedir(handle);
+#endif // __linux__
+		}
+	};
+#endif // __unix__ || FILEWATCH_PLATFORM_MAC
+
+	/**
+	* \class Xxh64
+	*
+	* \brief The 64 bit xxHash of a stream of bytes, fed in pieces of any size. Four independent lanes take 32 bytes
+	* per step, which compilers keep in registers and pipeline (or vectorise), so it hashes at memory speed.
+	*/
+	class Xxh64
+	{
+	public:
+		explicit Xxh64(std::uint64_t seed = 0) :
+			_lanes{ { seed + prime1 + prime2, seed + prime2, seed, seed - prime1 } },
+			_seed(seed)
+		{
+		}
+
+		static std::uint64_t of(const void* data, std::size_t length, std::uint64_t seed = 0)
+		{
+			Xxh64 hash(seed);
+			hash.update(data, length);
+			return hash.digest();
+		}
+
+		void update(const void* data, std::size_t length)
+		{
+			const auto* bytes = static_cast<const unsigned char*>(data);
+			_total += length;
+			if (_buffered + length < stripe)
+			{
+				std::memcpy(&_buffer[_buffered], bytes, length);
+				_buffered += length;
+				return;
+			}
+			if (_buffered > 0)
+			{
+				const auto fill = stripe - _buffered;
+				std::memcpy(&_buffer[_buffered], bytes, fill);
+				consume(_buffer.data());
+				bytes += fill;
+				length -= fill;
+				_buffered = 0;
+			}
+			for (; length >= stripe; bytes += stripe, length -= stripe)
+			{
+				consume(bytes);
+			}
+			std::memcpy(_buffer.data(), bytes, length);
+			_buffered = length;
+		}
+
+		std::uint64_t digest() const
+		{
+			std::uint64_t hash = _seed + prime5;
+			if (_total >= stripe)
+			{
+				hash = rotate(_lanes[0], 1) + rotate(_lanes[1], 7) + rotate(_lanes[2], 12) + rotate(_lanes[3], 18);
+				for (const auto lane : _lanes)
+				{
+					hash = (hash ^ round(0, lane)) * prime1 + prime4;
+				}
+			}
+			hash += _total;
+
+			const unsigned char* tail = _buffer.data();
+			auto remaining = _buffered;
+			for (; remaining >= 8; tail += 8, remaining -= 8)
+			{
+				hash = rotate(hash ^ round(0, read64(tail)), 27) * prime1 + prime4;
+			}
+			if (remaining >= 4)
+			{
+				hash = rotate(hash ^ (read32(tail) * prime1), 23) * prime2 + prime3;
+				tail += 4;
+				remaining -= 4;
+			}
+			for (; remaining > 0; ++tail, --remaining)
+			{
+				hash = rotate(hash ^ (*tail * prime5), 11) * prime1;
+			}
+
+			hash ^= hash >> 33;
+			hash *= prime2;
+			hash ^= hash >> 29;
+			hash *= prime3;
+			return hash ^ (hash >> 32);
+		}
+
+	private:
+		// an enum can't hold 64 bit values portably, and static constexpr members would need out of line definitions
+		static const std::uint64_t prime1 = 11400714785074694791ull;
+		static const std::uint64_t prime2 = 14029467366897019727ull;
+		static const std::uint64_t prime3 = 1609587929392839161ull;
+		static const std::uint64_t prime4 = 9650029242287828579ull;
+		static const std::uint64_t prime5 = 2870177450012600261ull;
+		enum : std::size_t { stripe = 32 };
+
+		std::array<std::uint64_t, 4> _lanes;
+		std::array<unsigned char, stripe> _buffer = {};
+		std::size_t _buffered = { 0 };
+		std::uint64_t _total = { 0 };
+		const std::uint64_t _seed;
+
+		static std::uint64_t rotate(std::uint64_t value, int bits)
+		{
+			return (value << bits) | (value >> (64 - bits));
+		}
+
+		static std::uint64_t round(std::uint64_t lane, std::uint64_t input)
+		{
+			return rotate(lane + input * prime2, 31) * prime1;
+		}
+
+		// little endian whatever the machine, a single load where it is little endian already
+		static std::uint64_t read64(const unsigned char* bytes)
+		{
+			return read32(bytes) | (read32(bytes + 4) << 32);
+		}
+
+		static std::uint64_t read32(const unsigned char* bytes)
+		{
+			return std::uint64_t(bytes[0]) | (std::uint64_t(bytes[1]) << 8) | (std::uint64_t(bytes[2]) << 16) | (std::uint64_t(bytes[3]) << 24);
+		}
+
+		void consume(const unsigned char* bytes)
+		{
+			_lanes[0] = round(_lanes[0], read64(bytes));
+			_lanes[1] = round(_lanes[1], read64(bytes + 8));
+			_lanes[2] = round(_lanes[2], read64(bytes + 16));
+			_lanes[3] = round(_lanes[3], read64(bytes + 24));
+		}
+	};
+
+#if __unix__
+
+	/**
+	* \class EventSource
+	*
+	* \brief Where a FileWatch gets its inotify records from, set through Options::event_source to replace the real inotify
+	* instance. The records go through the same parsing, filtering, queueing and callbacks as real ones.
+	*/
+	class EventSource
+	{
+	public:
+		virtual ~EventSource() {}
+		// same contract as inotify_add_watch() and inotify_rm_watch()
+		virtual int add_watch(const char* path, std::uint32_t mask) = 0;
+		virtual int remove_watch(int watch) = 0;
+		// Fills `buffer` with whole inotify_event records and returns the bytes used. Waits for at most `timeout_ms` (-1 for
+		// ever, as epoll_wait() does) and returns 0 if nothing came, or -1 once stop() has been called. Throwing stops the
+		// watch, which reports the exception in Stats::reader_error.
+		virtual ssize_t read(char* buffer, std::size_t size, int timeout_ms) = 0;
+		// any thread, makes read() return -1 from now on
+		virtual void stop() = 0;
+	};
+
+	/**
+	* \class SyntheticEventSource
+	*
+	* \brief An EventSource that replays a fixed list of records, addressed to the first watch added, as fast as the
+	* reader takes them or at a set rate. The records are encoded once, each read() only copies them.
+	*/
+	class SyntheticEventSource : public EventSource
+	{
+	public:
+		struct Record
+		{
+			std::string name;
+			std::uint32_t mask;
+		};
+
+		// Repeats `records` until `total` have been read, at most `rate` per second (0 for no limit).
+		SyntheticEventSource(const std::vector<Record>& records, std::uint64_t total, double rate = 0) :
+			_total(total),
+			_rate(rate)
+		{
+			for (const auto& record : records)
+			{
+				// the kernel pads names with NULs so the next record stays aligned
+				const auto length = (record.name.size() / sizeof(struct inotify_event) + 1) * sizeof(struct inotify_event);
+				_offsets.push_back(_encoded.size());
+				_encoded.resize(_encoded.size() + sizeof(struct inotify_event) + length);
+				struct inotify_event header = {};
+				header.mask = record.mask;
+				header.len = static_cast<std::uint32_t>(length);
+				std::memcpy(&_encoded[_offsets.back()], &header, sizeof(header));
+				std::memcpy(&_encoded[_offsets.back() + sizeof(header)], record.name.data(), record.name.size());
+			}
+			_offsets.push_back(_encoded.size());
+		}
+
+		int add_watch(const char*, std::uint32_t) override
+		{
+			return ++_watches;
+		}
+
+		int remove_watch(int) override
+		{
+			return 0;
+		}
+
+		ssize_t read(char* buffer, std::size_t size, int timeout_ms) override
+		{
+			if (_started == std::chrono::steady_clock::time_point())
+			{
+				_started = std::chrono::steady_clock::now();
+			}
+			const auto deadline = timeout_ms < 0 ? std::chrono::steady_clock::time_point::max()
+				: std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+			auto allowed = due();
+			if (allowed == 0)
+			{
+				// finished, or ahead of the rate: sleep until the next record is due
+				const auto next = _emitted < _total && _rate > 0
+					? _started + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>((_emitted + 1) / _rate))
+					: std::chrono::steady_clock::time_point::max();
+				std::unique_lock<std::mutex> lock(_mutex);
+				_stop_cv.wait_until(lock, std::min(next, deadline), [this] { return _stopped.load(); });
+				allowed = due();
+			}
+			if (_stopped)
+			{
+				return -1;
+			}
+
+			std::size_t used = 0;
+			const auto records = _offsets.size() - 1;
+			while (allowed > 0 && records > 0)
+			{
+				const auto record = static_cast<std::size_t>(_emitted % records);
+				const auto length = _offsets[record + 1] - _offsets[record];
+				if (used + length > size)
+				{
+					break;
+				}
+				std::memcpy(buffer + used, &_encoded[_offsets[record]], length);
+				// the first watch added, like the root of a FileWatch
+				reinterpret_cast<struct inotify_event*>(buffer + used)->wd = 1; // NOLINT
+				used += length;
+				--allowed;
+				_emitted.store(_emitted.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			}
+			return static_cast<ssize_t>(used);
+		}
+
+		void stop() override
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_stopped = true;
+			}
+			_stop_cv.notify_all();
+		}
+
+		// any thread, records handed out so far
+		std::uint64_t emitted() const { return _emitted.load(std::memory_order_relaxed); }
+
+	private:
+		const std::uint64_t _total;
+		const double _rate;
+		std::vector<char> _encoded = {};
+		std::vector<std::size_t> _offsets = {};
+		int _watches = { 0 };
+		std::chrono::steady_clock::time_point _started = {};
+		std::atomic<std::uint64_t> _emitted = { 0 };
+
+		std::mutex _mutex = {};
+		std::condition_variable _stop_cv = {};
+		std::atomic<bool> _stopped = { false };
+
+		// how many records may be handed out right now
+		std::uint64_t due() const
+		{
+			auto limit = _total;
+			if (_rate > 0)
+			{
+				const auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - _started).count();
+				limit = std::min<std::uint64_t>(limit, static_cast<std::uint64_t>(elapsed * _rate));
+			}
+			return limit > _emitted ? limit - _emitted : 0;
+		}
+	};
+
+#if FILEWATCH_FANOTIFY
+	/**
+	* \class FanotifyEventSource
+	*
+	* \brief An EventSource that marks the whole filesystem holding a path with fanotify, so a tree of any size costs one
+	* mark instead of an inotify watch per directory. Events name their directory by file handle, which is looked up in a
+	* map of the handles of every directory passed to add_watch(), events in any other directory are dropped. What is
+	* left is rewritten as inotify_event records, so it goes through the same path as inotify's own.
+	*/
+	class FanotifyEventSource : public EventSource
+	{
+	public:
+		// Null when the filesystem can't be marked: the process lacks CAP_SYS_ADMIN, the kernel is older than 5.9 or the
+		// filesystem can't encode file handles.
+		static std::shared_ptr<FanotifyEventSource> create(const char* path)
+		{
+			std::shared_ptr<FanotifyEventSource> source(new FanotifyEventSource(path));
+			return source->_wake < 0 ? nullptr : source;
+		}
+
+		~FanotifyEventSource()
+		{
+			for (const auto fd : { _wake, _fanotify })
+			{
+				if (fd >= 0)
+				{
+					close(fd);
+				}
+			}
+		}
+
+		FanotifyEventSource(const FanotifyEventSource&) = delete;
+		FanotifyEventSource& operator=(const FanotifyEventSource&) = delete;
+
+		// The whole filesystem is already marked, this only names the directory. The mark reports creates, deletes, modifies
+		// and moves whatever `mask` says, IN_CLOSE_WRITE in it adds closes after writing for the whole filesystem too.
+		int add_watch(const char* path, std::uint32_t mask) override
+		{
+			const auto handle = handle_of(path);
+			if (handle.empty())
+			{
+				return -1;
+			}
+			if ((mask & IN_CLOSE_WRITE) && !_close_write)
+			{
+				if (fanotify_mark(_fanotify, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FAN_CLOSE_WRITE, AT_FDCWD, path) != 0)
+				{
+					return -1;
+				}
+				_close_write = true;
+			}
+			const auto added = _directories.insert(std::make_pair(handle, _next_watch));
+			if (added.second)
+			{
+				_handles[_next_watch++] = handle;
+			}
+			return added.first->second;
+		}
+
+		int remove_watch(int watch) override
+		{
+			const auto found = _handles.find(watch);
+			if (found == _handles.end())
+			{
+				errno = EINVAL;
+				return -1;
+			}
+			_directories.erase(found->second);
+			_handles.erase(found);
+			return 0;
+		}
+
+		ssize_t read(char* buffer, std::size_t size, int timeout_ms) override
+		{
+			if (_handed_out == _translated.size())
+			{
+				_translated.clear();
+				_handed_out = 0;
+				struct pollfd ready[2] = { { _fanotify, POLLIN, 0 }, { _wake, POLLIN, 0 } };
+				if (::poll(ready, 2, timeout_ms) < 0)
+				{
+					if (errno == EINTR)
+					{
+						return 0; // nothing came, the reader calls again
+					}
+					throw std::system_error(errno, std::system_category());
+				}
+				if (ready[1].revents)
+				{
+					return -1;
+				}
+				_raw.resize(size);
+				const auto length = ::read(_fanotify, _raw.data(), _raw.size());
+				if (length > 0)
+				{
+					translate(length);
+				}
+			}
+			if (_stopped)
+			{
+				return -1;
+			}
+
+			// whole records only, what doesn't fit is handed out by the next read()
+			std::size_t used = 0;
+			while (_handed_out + used < _translated.size())
+			{
+				const auto* event = reinterpret_cast<const struct inotify_event*>(&_translated[_handed_out + used]); // NOLINT
+				const auto length = sizeof(struct inotify_event) + event->len;
+				if (used + length > size)
+				{
+					break;
+				}
+				used += length;
+			}
+			std::memcpy(buffer, &_translated[_handed_out], used);
+			_handed_out += used;
+			return static_cast<ssize_t>(used);
+		}
+
+		void stop() override
+		{
+			_stopped = true;
+			const std::uint64_t wake = 1;
+			if (write(_wake, &wake, sizeof(wake)) < 0) {} // can only fail if the counter is already non zero, which wakes the reader anyway
+		}
+
+	private:
+		int _fanotify = { -1 };
+		int _wake = { -1 };
+		std::atomic<bool> _stopped = { false };
+		bool _close_write = { false };
+
+		// directory handle (type and bytes) -> the watch descriptor add_watch() gave it, and back
+		std::unordered_map<std::string, int> _directories = {};
+		std::unordered_map<int, std::string> _handles = {};
+		int _next_watch = { 1 };
+
+		std::vector<char> _raw = {};
+		std::vector<char> _translated = {};
+		std::size_t _handed_out = { 0 };
+		// fanotify has no rename cookies, but the kernel queues both halves of a rename one after the other
+		std::uint32_t _moves = { 0 };
+		bool _last_moved_from = { false };
+
+		explicit FanotifyEventSource(const char* path)
+		{
+			static_assert(FAN_CREATE == IN_CREATE && FAN_MODIFY == IN_MODIFY && FAN_MOVED_FROM == IN_MOVED_FROM && FAN_MOVED_TO == IN_MOVED_TO
+				&& FAN_DELETE == IN_DELETE && FAN_CLOSE_WRITE == IN_CLOSE_WRITE && FAN_ONDIR == IN_ISDIR, "fanotify and inotify masks differ");
+			_fanotify = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_NONBLOCK | FAN_CLOEXEC, O_RDONLY | O_LARGEFILE);
+			if (_fanotify < 0 || fanotify_mark(_fanotify, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+				FAN_CREATE | FAN_MODIFY | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_DELETE | FAN_DELETE_SELF | FAN_ONDIR, AT_FDCWD, path) != 0)
+			{
+				return;
+			}
+			_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		}
+
+		static std::string key_of(const struct file_handle* handle)
+		{
+			std::string key(reinterpret_cast<const char*>(&handle->handle_type), sizeof(handle->handle_type));
+			key.append(reinterpret_cast<const char*>(handle->f_handle), handle->handle_bytes);
+			return key;
+		}
+
+		// Encoded the way fanotify encodes a directory in its events, empty with errno set on failure.
+		static std::string handle_of(const char* path)
+		{
+			std::vector<char> storage(sizeof(struct file_handle) + MAX_HANDLE_SZ);
+			struct file_handle* handle = reinterpret_cast<struct file_handle*>(storage.data()); // NOLINT
+			handle->handle_bytes = MAX_HANDLE_SZ;
+			int mount = 0;
+			if (name_to_handle_at(AT_FDCWD, path, handle, &mount, 0) != 0)
+			{
+				return std::string();
+			}
+			return key_of(handle);
+		}
+
+		void append(int watch, std::uint32_t mask, std::uint32_t cookie, const char* name)
+		{
+			const auto name_length = name ? std::strlen(name) : 0;
+			// padded with NULs like the kernel does, so the next record stays aligned
+			const auto length = name_length ? (name_length / sizeof(struct inotify_event) + 1) * sizeof(struct inotify_event) : 0;
+			const auto offset = _translated.size();
+			_translated.resize(offset + sizeof(struct inotify_event) + length);
+			struct inotify_event header = {};
+			header.wd = watch;
+			header.mask = mask;
+			header.cookie = cookie;
+			header.len = static_cast<std::uint32_t>(length);
+			std::memcpy(&_translated[offset], &header, sizeof(header));
+			std::memcpy(&_translated[offset + sizeof(header)], name, name_length);
+		}
+
+		void translate(ssize_t length)
+		{
+			auto remaining = static_cast<std::size_t>(length);
+			for (const auto* event = reinterpret_cast<const struct fanotify_event_metadata*>(_raw.data()); // NOLINT
+				FAN_EVENT_OK(event, remaining); event = FAN_EVENT_NEXT(event, remaining))
+			{
+				if (event->mask & FAN_Q_OVERFLOW)
+				{
+					append(-1, IN_Q_OVERFLOW, 0, nullptr);
+					continue;
+				}
+				const auto* info = reinterpret_cast<const struct fanotify_event_info_fid*>(reinterpret_cast<const char*>(event) + event->metadata_len); // NOLINT
+				if (event->event_len < event->metadata_len + sizeof(*info) || (info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME && info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID))
+				{
+					continue;
+				}
+				const auto* handle = reinterpret_cast<const struct file_handle*>(info->handle); // NOLINT
+				const char* name = info->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME ? reinterpret_cast<const char*>(handle->f_handle + handle->handle_bytes) : nullptr;
+
+				const auto moved_from = _last_moved_from;
+				_last_moved_from = (event->mask & FAN_MOVED_FROM) != 0;
+				if (_last_moved_from && ++_moves == 0)
+				{
+					++_moves; // a cookie of 0 would match the unpaired halves
+				}
+
+				const auto directory = _directories.find(key_of(handle));
+				if (directory == _directories.end())
+				{
+					continue; // somewhere else on the filesystem
+				}
+				const auto watch = directory->second;
+				if ((event->mask & FAN_DELETE_SELF) && (event->mask & FAN_ONDIR) && (name == nullptr || std::strcmp(name, ".") == 0))
+				{
+					// the watched directory itself is gone, as inotify reports it
+					_handles.erase(watch);
+					_directories.erase(directory);
+					append(watch, IN_IGNORED, 0, nullptr);
+					continue;
+				}
+				if (name == nullptr)
+				{
+					continue;
+				}
+				// events for the same name can be merged into one, split them up again in the order they must have happened
+				for (const std::uint32_t bit : { IN_CREATE, IN_MODIFY, IN_CLOSE_WRITE, IN_MOVED_FROM, IN_MOVED_TO, IN_DELETE })
+				{
+					if (event->mask & bit)
+					{
+						const auto cookie = bit == IN_MOVED_FROM || (bit == IN_MOVED_TO && moved_from) ? _moves : 0;
+						append(watch, bit | (event->mask & FAN_ONDIR), cookie, name);
+					}
+				}
+			}
+		}
+	};
+#endif // FILEWATCH_FANOTIFY
+
+	/**
+	* \class ContentHashes
+	*
+	* \brief The Xxh64 of the contents of recently written files, to tell a rewrite with the same contents from a change.
+	* Least recently written paths are dropped once the entries would take more than a budget of bytes. Files bigger than
+	* a size limit are never read and always count as changed, so hashing one can't hold up the reader for long.
+	*/
+	template<typename StringType>
+	class ContentHashes
+	{
+		typedef typename StringType::value_type C;
+		typedef std::basic_string<C, std::char_traits<C>> UnderpinningString;
+
+	public:
+		// No limit on the size of the files hashed by default.
+		explicit ContentHashes(std::size_t budget, std::uint64_t size_limit = ~std::uint64_t(0)) : _budget(budget), _size_limit(size_limit) {}
+
+		// Hashes `file` and remembers it for `path`. True unless the hash is the one remembered, so a file that can't be
+		// read, or hasn't been seen before, counts as changed.
+		bool changed(const UnderpinningString& path, const UnderpinningString& file)
+		{
+			return changed_from(remembered(path), path, file);
+		}
+
+		// As changed(), against `before` instead of the hash remembered for `path`, e.g. one from a saved snapshot.
+		// A `before` of 0 is no hash at all.
+		bool changed_from(std::uint64_t before, const UnderpinningString& path, const UnderpinningString& file)
+		{
+			std::uint64_t hash = 0;
+			if (!hash_of(file, hash))
+			{
+				forget(path);
+				return true;
+			}
+			remember(path, hash);
+			return before == 0 || before != hash;
+		}
+
+		// The hash remembered for `path`, 0 if there is none.
+		std::uint64_t remembered(const UnderpinningString& path) const
+		{
+			const auto found = _index.find(path);
+			return found != _index.end() ? found->second.hash : 0;
+		}
+
+		void forget(const UnderpinningString& path)
+		{
+			const auto found = _index.find(path);
+			if (found != _index.end())
+			{
+				_bytes -= cost_of(path);
+				_recent.erase(found->second.recent);
+				_index.erase(found);
+			}
+		}
+
+		// Forgets every path `forgotten` returns true for, e.g. everything below a directory that moved.
+		template<typename Predicate>
+		void forget_if(Predicate forgotten)
+		{
+			for (auto entry = _recent.begin(); entry != _recent.end(); )
+			{
+				const auto& path = **entry;
+				++entry;
+				if (forgotten(path))
+				{
+					forget(path);
+				}
+			}
+		}
+
+		void clear()
+		{
+			_index.clear();
+			_recent.clear();
+			_bytes = 0;
+		}
+
+		std::size_t size() const { return _index.size(); }
+
+		std::size_t bytes() const { return _bytes; }
+
+	private:
+		struct Entry
+		{
+			std::uint64_t hash;
+			typename std::list<const UnderpinningString*>::iterator recent;
+		};
+
+		const std::size_t _budget;
+		const std::uint64_t _size_limit;
+		std::size_t _bytes = { 0 };
+		std::unordered_map<UnderpinningString, Entry> _index = {};
+		// most recently written first, pointing at the keys of _index
+		std::list<const UnderpinningString*> _recent = {};
+		std::vector<char> _buffer = {};
+
+		void remember(const UnderpinningString& path, std::uint64_t hash)
+		{
+			const auto found = _index.find(path);
+			if (found != _index.end())
+			{
+				_recent.splice(_recent.begin(), _recent, found->second.recent);
+				found->second.hash = hash;
+				return;
+			}
+			const auto cost = cost_of(path);
+			if (cost > _budget)
+			{
+				return;
+			}
+			while (_bytes + cost > _budget)
+			{
+				forget(*_recent.back());
+			}
+			const auto added = _index.emplace(path, Entry{ hash, _recent.end() }).first;
+			// the key of a node never moves, not even when the table rehashes
+			_recent.push_front(&added->first);
+			added->second.recent = _recent.begin();
+			_bytes += cost;
+		}
+
+		// roughly what an entry takes: its path, a hash node and a list node
+		static std::size_t cost_of(const UnderpinningString& path)
+		{
+			return path.size() * sizeof(C) + sizeof(UnderpinningString) + sizeof(Entry) + 8 * sizeof(void*);
+		}
+
+		// read() rather than mmap(), a writer truncating the file while it is mapped would kill us with SIGBUS
+		bool hash_of(const UnderpinningString& file, std::uint64_t& hash)
+		{
+			const int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd < 0)
+			{
+				return false;
+			}
+			_buffer.resize(128 * 1024);
+			Xxh64 content;
+			ssize_t length = 0;
+			std::uint64_t total = 0;
+			// the limit is checked as it is read, the file may be growing
+			while (total <= _size_limit && ((length = read(fd, _buffer.data(), _buffer.size())) > 0 || (length < 0 && errno == EINTR)))
+			{
+				if (length > 0)
+				{
+					content.update(_buffer.data(), static_cast<std::size_t>(length));
+					total += static_cast<std::uint64_t>(length);
+				}
+			}
+			close(fd);
+			hash = content.digest();
+			return total <= _size_limit && length == 0;
+		}
+	};
+#endif // __unix__
+
+	/**
+	* \class RegexDfa
+	*
+	* \brief A table driven DFA for the regular subset of ECMAScript regex, it matches whole strings like std::regex_match does.
+	*
+	* Literals, escapes, ., character classes, groups, | and the *, +, ?, {n,m} quantifiers are supported, together with ^ and $
+	* at the ends of the pattern. compile() returns false for anything else (back references, look arounds, anchors inside the
+	* pattern, non ASCII ranges, ...) and for patterns whose DFA would get too big, so callers can fall back to std::regex.
+	* Characters are mapped to the equivalence classes the pattern distinguishes, which keeps the table small for wide characters.
+	*/
+	template<typename C>
+	class RegexDfa
+	{
+		typedef std::uint32_t Unit;
+		typedef std::vector<std::pair<Unit, Unit>> Ranges; // inclusive, sorted and merged
+
+	public:
+		bool compile(const C* pattern, std::size_t length)
+		{
+			reset();
+			const C* end = pattern + length;
+			// regex_match has to match the whole string anyway, so anchors at either end change nothing
+			if (pattern != end && *pattern == C('^'))
+			{
+				++pattern;
+			}
+			if (pattern != end && *(end - 1) == C('$') && !is_escaped(pattern, end - 1))
+			{
+				--end;
+			}
+			Parser parser{ *this, pattern, end };
+			const auto root = parser.alternation();
+			return parser.ok && parser.position == end && build(root);
+		}
+
+		// Globs: * and ? never match '/', ** matches anything and "**/" zero or more whole directories, [abc], [a-z] and [!a] work as usual.
+		template<typename String>
+		bool compile_globs(const std::vector<String>& globs)
+		{
+			reset();
+			std::vector<int> alternatives;
+			for (const auto& glob : globs)
+			{
+				alternatives.push_back(parse_glob(glob.data(), glob.data() + glob.size()));
+			}
+			return build(alternatives.empty() ? node(Kind::alternation, Ranges{}, {}) : node(Kind::alternation, Ranges{}, alternatives));
+		}
+
+		bool match(const C* text, std::size_t length) const
+		{
+			int state = 0;
+			for (std::size_t i = 0; i < length && state >= 0; ++i)
+			{
+				const auto unit = to_unit(text[i]);
+				const auto character_class = unit < _small_classes.size() ? _small_classes[unit] : class_of(unit);
+				state = _table[static_cast<std::size_t>(state) * _bounds.size() + character_class];
+			}
+			return state >= 0 && _accepting[static_cast<std::size_t>(state)];
+		}
+
+	private:
+		enum class Kind { set, concat, alternation, star, plus, optional };
+
+		struct Node
+		{
+			Kind kind;
+			Ranges ranges;
+			std::vector<int> children;
+		};
+
+		struct NfaState
+		{
+			Ranges ranges;
+			int next;
+			std::vector<int> epsilon;
+		};
+
+		static constexpr std::size_t _max_states = 4096;
+		static constexpr unsigned _max_repeat = 64;
+
+		std::vector<Node> _nodes = {};
+		std::vector<NfaState> _nfa = {};
+		// class i holds the units in [_bounds[i], _bounds[i + 1])
+		std::vector<Unit> _bounds = {};
+		std::vector<std::uint16_t> _small_classes = {};
+		std::vector<int> _table = {};
+		std::vector<bool> _accepting = {};
+
+		static Unit to_unit(C character)
+		{
+			return static_cast<Unit>(static_cast<typename std::make_unsigned<C>::type>(character));
+		}
+
+		static Unit max_unit()
+		{
+			return static_cast<Unit>(std::numeric_limits<typename std::make_unsigned<C>::type>::max());
+		}
+
+		static bool is_escaped(const C* begin, const C* position)
+		{
+			bool escaped = false;
+			while (position != begin && *(--position) == C('\\'))
+			{
+				escaped = !escaped;
+			}
+			return escaped;
+		}
+
+		static Ranges normalised(Ranges ranges)
+		{
+			std::sort(ranges.begin(), ranges.end());
+			Ranges merged;
+			for (const auto& range : ranges)
+			{
+				if (!merged.empty() && (merged.back().second == max_unit() || range.first <= merged.back().second + 1))
+				{
+					merged.back().second = (std::max)(merged.back().second, range.second);
+				}
+				else
+				{
+					merged.push_back(range);
+				}
+			}
+			return merged;
+		}
+
+		static Ranges complement(const Ranges& ranges)
+		{
+			Ranges result;
+			Unit next = 0;
+			for (const auto& range : ranges)
+			{
+				if (range.first > next)
+				{
+					result.emplace_back(next, range.first - 1);
+				}
+				if (range.second == max_unit())
+				{
+					return result;
+				}
+				next = range.second + 1;
+			}
+			result.emplace_back(next, max_unit());
+			return result;
+		}
+
+		static Ranges single(C character)
+		{
+			return Ranges{ { to_unit(character), to_unit(character) } };
+		}
+
+		static Ranges everything()
+		{
+			return Ranges{ { 0, max_unit() } };
+		}
+
+		static Ranges all_but_slash()
+		{
+			return complement(single(C('/')));
+		}
+
+		void reset()
+		{
+			_nodes.clear();
+			_nfa.clear();
+			_bounds.clear();
+			_small_classes.clear();
+			_table.clear();
+			_accepting.clear();
+		}
+
+		int node(Kind kind, Ranges ranges, std::vector<int> children)
+		{
+			_nodes.push_back(Node{ kind, std::move(ranges), std::move(children) });
+			return static_cast<int>(_nodes.size() - 1);
+		}
+
+		int set(Ranges ranges)
+		{
+			return node(Kind::set, normalised(std::move(ranges)), {});
+		}
+
+		int empty()
+		{
+			return node(Kind::concat, Ranges{}, {});
+		}
+
+		struct Parser
+		{
+			RegexDfa& dfa;
+			const C* position;
+			const C* end;
+			bool ok = true;
+
+			Parser(RegexDfa& dfa, const C* position, const C* end) : dfa(dfa), position(position), end(end) {}
+
+			bool at(C character) const { return position != end && *position == character; }
+
+			int fail()
+			{
+				ok = false;
+				return dfa.empty();
+			}
+
+			int alternation()
+			{
+				std::vector<int> alternatives = { concatenation() };
+				while (ok && at(C('|')))
+				{
+					++position;
+					alternatives.push_back(concatenation());
+				}
+				return alternatives.size() == 1 ? alternatives.front() : dfa.node(Kind::alternation, Ranges{}, alternatives);
+			}
+
+			int concatenation()
+			{
+				std::vector<int> parts;
+				while (ok && position != end && !at(C('|')) && !at(C(')')))
+				{
+					parts.push_back(repetition());
+				}
+				return parts.size() == 1 ? parts.front() : dfa.node(Kind::concat, Ranges{}, parts);
+			}
+
+			bool number(unsigned& value)
+			{
+				const C* start = position;
+				value = 0;
+				while (position != end && *position >= C('0') && *position <= C('9'))
+				{
+					value = value * 10 + static_cast<unsigned>(*position++ - C('0'));
+					if (value > _max_repeat)
+					{
+						return false;
+					}
+				}
+				return position != start;
+			}
+
+			int repetition()
+			{
+				int atom = this->atom();
+				while (ok && position != end)
+				{
+					if (at(C('*')) || at(C('+')) || at(C('?')))
+					{
+						const auto kind = at(C('*')) ? Kind::star : at(C('+')) ? Kind::plus : Kind::optional;
+						++position;
+						atom = dfa.node(kind, Ranges{}, { atom });
+					}
+					else if (at(C('{')))
+					{
+						++position;
+						unsigned minimum = 0;
+						unsigned maximum = 0;
+						bool unbounded = false;
+						if (!number(minimum))
+						{
+							return fail();
+						}
+						maximum = minimum;
+						if (at(C(',')))
+						{
+							++position;
+							unbounded = !number(maximum);
+						}
+						if (!at(C('}')) || (!unbounded && maximum < minimum))
+						{
+							return fail();
+						}
+						++position;
+						// a node can be referenced more than once, each reference becomes its own copy in the NFA
+						std::vector<int> parts(minimum, atom);
+						if (unbounded)
+						{
+							parts.push_back(dfa.node(Kind::star, Ranges{}, { atom }));
+						}
+						else
+						{
+							for (unsigned i = minimum; i < maximum; ++i)
+							{
+								parts.push_back(dfa.node(Kind::optional, Ranges{}, { atom }));
+							}
+						}
+						atom = dfa.node(Kind::concat, Ranges{}, parts);
+					}
+					else
+					{
+						break;
+					}
+					// lazy quantifiers accept the same strings when the whole string has to match
+					if (at(C('?')))
+					{
+						++position;
+					}
+					if (at(C('*')) || at(C('+')) || at(C('?')) || at(C('{')))
+					{
+						return fail();
+					}
+				}
+				return atom;
+			}
+
+			// \d, \w, \s and friends, or a single character. Returns false for escapes we don't model.
+			bool escape(Ranges& ranges, bool in_class)
+			{
+				if (position == end)
+				{
+					return false;
+				}
+				const C character = *position++;
+				Ranges digits = { { to_unit(C('0')), to_unit(C('9')) } };
+				Ranges word = { { to_unit(C('0')), to_unit(C('9')) }, { to_unit(C('A')), to_unit(C('Z')) }, { to_unit(C('_')), to_unit(C('_')) }, { to_unit(C('a')), to_unit(C('z')) } };
+				Ranges space = { { 9, 13 }, { 32, 32 } };
+				switch (character)
+				{
+				case C('d'): ranges = digits; return true;
+				case C('D'): ranges = complement(normalised(digits)); return true;
+				case C('w'): ranges = word; return true;
+				case C('W'): ranges = complement(normalised(word)); return true;
+				case C('s'): ranges = space; return true;
+				case C('S'): ranges = complement(normalised(space)); return true;
+				case C('n'): ranges = single(C('\n')); return true;
+				case C('t'): ranges = single(C('\t')); return true;
+				case C('r'): ranges = single(C('\r')); return true;
+				case C('f'): ranges = single(C('\f')); return true;
+				case C('v'): ranges = single(C('\v')); return true;
+				case C('b'):
+					// a backspace in a class, a word boundary outside of one
+					ranges = single(C('\b'));
+					return in_class;
+				default:
+					if ((character >= C('0') && character <= C('9')) || (character >= C('a') && character <= C('z')) || (character >= C('A') && character <= C('Z')))
+					{
+						return false;
+					}
+					ranges = single(character);
+					return true;
+				}
+			}
+
+			int character_class()
+			{
+				const bool negated = at(C('^'));
+				if (negated)
+				{
+					++position;
+				}
+				Ranges ranges;
+				while (position != end && !at(C(']')))
+				{
+					Ranges item;
+					if (at(C('\\')))
+					{
+						++position;
+						if (!escape(item, true))
+						{
+							return fail();
+						}
+					}
+					else
+					{
+						item = single(*position++);
+					}
+
+					if (at(C('-')) && position + 1 != end && *(position + 1) != C(']'))
+					{
+						++position;
+						Ranges upper;
+						if (at(C('\\')))
+						{
+							++position;
+							if (!escape(upper, true))
+							{
+								return fail();
+							}
+						}
+						else
+						{
+							upper = single(*position++);
+						}
+						// ranges between class escapes are errors, and ranges past ASCII depend on the locale's collation in std::regex
+						if (item.size() != 1 || upper.size() != 1 || item[0].first != item[0].second || upper[0].first != upper[0].second
+							|| upper[0].first > 127 || item[0].first > upper[0].first)
+						{
+							return fail();
+						}
+						item[0].second = upper[0].first;
+					}
+					ranges.insert(ranges.end(), item.begin(), item.end());
+				}
+				if (!at(C(']')))
+				{
+					return fail();
+				}
+				++position;
+				const auto normal = normalised(ranges);
+				return dfa.set(negated ? complement(normal) : normal);
+			}
+
+			int atom()
+			{
+				const C character = *position++;
+				switch (character)
+				{
+				case C('('):
+				{
+					if (at(C('?')))
+					{
+						if (position + 1 == end || *(position + 1) != C(':'))
+						{
+							return fail();
+						}
+						position += 2;
+					}
+					const auto group = alternation();
+					if (!at(C(')')))
+					{
+						return fail();
+					}
+					++position;
+					return group;
+				}
+				case C('['):
+					return character_class();
+				case C('.'):
+					return dfa.set(complement(normalised(Ranges{ { to_unit(C('\n')), to_unit(C('\n')) }, { to_unit(C('\r')), to_unit(C('\r')) }, { 0x2028, 0x2029 } })));
+				case C('\\'):
+				{
+					Ranges ranges;
+					return escape(ranges, false) ? dfa.set(ranges) : fail();
+				}
+				case C('*'): case C('+'): case C('?'): case C('{'): case C('}'): case C(']'): case C('^'): case C('$'):
+					return fail();
+				default:
+					return dfa.set(single(character));
+				}
+			}
+		};
+
+		// The `]` closing a glob class whose `[` is just before `position`, or `end` if it isn't closed and the `[` is literal.
+		// A `]` straight after the `[` or `[!` is a member of the class, not its end.
+		static const C* closing_bracket(const C* position, const C* end)
+		{
+			if (position != end && (*position == C('!') || *position == C('^')))
+			{
+				++position;
+			}
+			return position == end ? end : std::find(position + 1, end, C(']'));
+		}
+
+		int parse_glob(const C* position, const C* end)
+		{
+			std::vector<int> parts;
+			while (position != end)
+			{
+				const C character = *position++;
+				if (character == C('*') && position != end && *position == C('*'))
+				{
+					++position;
+					const auto anything = node(Kind::star, Ranges{}, { set(everything()) });
+					if (position != end && *position == C('/'))
+					{
+						++position;
+						parts.push_back(node(Kind::optional, Ranges{}, { node(Kind::concat, Ranges{}, { anything, set(single(C('/'))) }) }));
+					}
+					else
+					{
+						parts.push_back(anything);
+					}
+				}
+				else if (character == C('*'))
+				{
+					parts.push_back(node(Kind::star, Ranges{}, { set(all_but_slash()) }));
+				}
+				else if (character == C('?'))
+				{
+					parts.push_back(set(all_but_slash()));
+				}
+				else if (character == C('[') && closing_bracket(position, end) != end)
+				{
+					const C* closing = closing_bracket(position, end);
+					const bool negated = *position == C('!') || *position == C('^');
+					if (negated)
+					{
+						++position;
+					}
+					Ranges ranges;
+					do
+					{
+						Unit low = to_unit(*position++);
+						Unit high = low;
+						if (position + 1 < closing && *position == C('-'))
+						{
+							high = to_unit(*(position + 1));
+							position += 2;
+						}
+						ranges.emplace_back((std::min)(low, high), (std::max)(low, high));
+					} while (position != closing);
+					++position;
+					if (negated)
+					{
+						// like * and ?, a negated class never matches a directory separator
+						ranges.emplace_back(to_unit(C('/')), to_unit(C('/')));
+					}
+					const auto normal = normalised(ranges);
+					parts.push_back(set(negated ? complement(normal) : normal));
+				}
+				else
+				{
+					if (character == C('\\') && position != end)
+					{
+						parts.push_back(set(single(*position++)));
+					}
+					else
+					{
+						parts.push_back(set(single(character)));
+					}
+				}
+			}
+			return node(Kind::concat, Ranges{}, parts);
+		}
+
+		int add_state()
+		{
+			_nfa.push_back(NfaState{ Ranges{}, -1, {} });
+			return static_cast<int>(_nfa.size() - 1);
+		}
+
+		// Thompson construction, returns the start and accepting state of the fragment
+		std::pair<int, int> emit(int index)
+		{
+			const Node& current = _nodes[static_cast<std::size_t>(index)];
+			const auto start = add_state();
+			switch (current.kind)
+			{
+			case Kind::set:
+			{
+				const auto accept = add_state();
+				_nfa[static_cast<std::size_t>(start)].ranges = current.ranges;
+				_nfa[static_cast<std::size_t>(start)].next = accept;
+				return { start, accept };
+			}
+			case Kind::concat:
+			{
+				auto accept = start;
+				const auto children = current.children;
+				for (const auto child : children)
+				{
+					const auto fragment = emit(child);
+					_nfa[static_cast<std::size_t>(accept)].epsilon.push_back(fragment.first);
+					accept = fragment.second;
+				}
+				return { start, accept };
+			}
+			case Kind::alternation:
+			{
+				const auto accept = add_state();
+				const auto children = current.children;
+				for (const auto child : children)
+				{
+					const auto fragment = emit(child);
+					_nfa[static_cast<std::size_t>(start)].epsilon.push_back(fragment.first);
+					_nfa[static_cast<std::size_t>(fragment.second)].epsilon.push_back(accept);
+				}
+				return { start, accept };
+			}
+			case Kind::star:
+			case Kind::plus:
+			case Kind::optional:
+			{
+				const auto kind = current.kind;
+				const auto fragment = emit(current.children.front());
+				const auto accept = add_state();
+				_nfa[static_cast<std::size_t>(start)].epsilon.push_back(fragment.first);
+				_nfa[static_cast<std::size_t>(fragment.second)].epsilon.push_back(accept);
+				if (kind != Kind::plus)
+				{
+					_nfa[static_cast<std::size_t>(start)].epsilon.push_back(accept);
+				}
+				if (kind != Kind::optional)
+				{
+					_nfa[static_cast<std::size_t>(fragment.second)].epsilon.push_back(fragment.first);
+				}
+				return { start, accept };
+			}
+			}
+			return { start, start };
+		}
+
+		void closure(std::vector<int>& states) const
+		{
+			std::vector<bool> seen(_nfa.size(), false);
+			std::vector<int> pending = states;
+			states.clear();
+			while (!pending.empty())
+			{
+				const auto state = pending.back();
+				pending.pop_back();
+				if (seen[static_cast<std::size_t>(state)])
+				{
+					continue;
+				}
+				seen[static_cast<std::size_t>(state)] = true;
+				states.push_back(state);
+				for (const auto next : _nfa[static_cast<std::size_t>(state)].epsilon)
+				{
+					pending.push_back(next);
+				}
+			}
+			std::sort(states.begin(), states.end());
+		}
+
+		std::uint16_t class_of(Unit unit) const
+		{
+			return static_cast<std::uint16_t>(std::upper_bound(_bounds.begin(), _bounds.end(), unit) - _bounds.begin() - 1);
+		}
+
+		static bool contains(const Ranges& ranges, Unit unit)
+		{
+			for (const auto& range : ranges)
+			{
+				if (unit >= range.first && unit <= range.second)
+				{
+					return true;
+				}
+			}
+			return false;
+		}
+
+		// subset construction over the character classes the NFA can tell apart
+		bool build(int root)
+		{
+			const auto fragment = emit(root);
+			const auto final_state = fragment.second;
+
+			_bounds.push_back(0);
+			for (const auto& state : _nfa)
+			{
+				for (const auto& range : state.ranges)
+				{
+					_bounds.push_back(range.first);
+					if (range.second != max_unit())
+					{
+						_bounds.push_back(range.second + 1);
+					}
+				}
+			}
+			std::sort(_bounds.begin(), _bounds.end());
+			_bounds.erase(std::unique(_bounds.begin(), _bounds.end()), _bounds.end());
+			if (_bounds.size() > 0xffff)
+			{
+				return false;
+			}
+			_small_classes.resize(static_cast<std::size_t>((std::min)(max_unit(), Unit(255))) + 1);
+			for (std::size_t unit = 0; unit < _small_classes.size(); ++unit)
+			{
+				_small_classes[unit] = class_of(static_cast<Unit>(unit));
+			}
+
+			std::map<std::vector<int>, int> known;
+			std::vector<std::vector<int>> subsets;
+			std::vector<int> start = { fragment.first };
+			closure(start);
+			known[start] = 0;
+			subsets.push_back(start);
+
+			for (std::size_t current = 0; current < subsets.size(); ++current)
+			{
+				const auto subset = subsets[current];
+				_accepting.push_back(std::binary_search(subset.begin(), subset.end(), final_state));
+				for (std::size_t character_class = 0; character_class < _bounds.size(); ++character_class)
+				{
+					std::vector<int> next;
+					for (const auto state : subset)
+					{
+						const auto& nfa_state = _nfa[static_cast<std::size_t>(state)];
+						if (nfa_state.next >= 0 && contains(nfa_state.ranges, _bounds[character_class]))
+						{
+							next.push_back(nfa_state.next);
+						}
+					}
+					if (next.empty())
+					{
+						_table.push_back(-1);
+						continue;
+					}
+					closure(next);
+					const auto found = known.find(next);
+					if (found != known.end())
+					{
+						_table.push_back(found->second);
+						continue;
+					}
+					if (subsets.size() == _max_states)
+					{
+						return false;
+					}
+					known[next] = static_cast<int>(subsets.size());
+					_table.push_back(static_cast<int>(subsets.size()));
+					subsets.push_back(next);
+				}
+			}
+			_nodes.clear();
+			_nfa.clear();
+			return true;
+		}
+	};
+
+	/**
+	* \class PathFilter
+	*
+	* \brief Decides which paths are reported. Implicitly made from a std::regex, which is used as is with std::regex_match.
+	*
+	* The faster options are built up front: compile() turns a regex into a DFA (falling back to std::regex for features
+	* a DFA can't express), globs() does the same for glob patterns and extensions() is a hash set lookup of the extension.
+	* A default constructed filter lets everything through without looking at the path.
+	*/
+	template<typename StringType>
+	class PathFilter
+	{
+		typedef typename StringType::value_type C;
+		typedef std::basic_string<C, std::char_traits<C>> UnderpinningString;
+		typedef std::basic_regex<C, std::regex_traits<C>> UnderpinningRegex;
+
+	public:
+		PathFilter() {}
+
+		PathFilter(UnderpinningRegex pattern) : _kind(Kind::regex), _regex(std::move(pattern)) {}
+
+		static PathFilter compile(const UnderpinningString& pattern)
+		{
+			PathFilter filter;
+			if (filter._dfa.compile(pattern.data(), pattern.size()))
+			{
+				filter._kind = Kind::dfa;
+				return filter;
+			}
+			return PathFilter(UnderpinningRegex(pattern));
+		}
+
+		static PathFilter globs(const std::vector<UnderpinningString>& patterns)
+		{
+			PathFilter filter;
+			if (!filter._dfa.compile_globs(patterns))
+			{
+				throw std::length_error("filewatch: glob patterns are too complex");
+			}
+			filter._kind = Kind::dfa;
+			return filter;
+		}
+
+		// Extensions may be given with or without the leading '.', e.g. { "cpp", ".h" }.
+		static PathFilter extensions(const std::vector<UnderpinningString>& extensions)
+		{
+			PathFilter filter;
+			filter._kind = Kind::extensions;
+			for (const auto& extension : extensions)
+			{
+				filter._extensions.insert(!extension.empty() && extension[0] == C('.') ? extension.substr(1) : extension);
+			}
+			return filter;
+		}
+
+		// True when matching runs on a DFA rather than std::regex.
+		bool is_compiled() const { return _kind == Kind::dfa; }
+
+		bool match(const UnderpinningString& path) const
+		{
+			return _kind == Kind::regex ? std::regex_match(path, _regex) : match(path.data(), path.size());
+		}
+
+		bool match(const C* path, std::size_t length) const
+		{
+			switch (_kind)
+			{
+			case Kind::all:
+				return true;
+			case Kind::dfa:
+				return _dfa.match(path, length);
+			case Kind::extensions:
+			{
+				for (std::size_t i = length; i > 0; --i)
+				{
+					if (path[i - 1] == C('.'))
+					{
+						// short extensions fit the small string buffer, so looking them up doesn't allocate
+						return _extensions.count(UnderpinningString(path + i, length - i)) > 0;
+					}
+					if (path[i - 1] == C('/') || path[i - 1] == C('\\'))
+					{
+						return false;
+					}
+				}
+				return false;
+			}
+			case Kind::regex:
+				return std::regex_match(path, path + length, _regex);
+			}
+			return false;
+		}
+
+	private:
+		enum class Kind { all, regex, dfa, extensions };
+
+		Kind _kind = { Kind::all };
+		UnderpinningRegex _regex = {};
+		RegexDfa<C> _dfa = {};
+		std::unordered_set<UnderpinningString> _extensions = {};
+	};
+
+	/**
+	* \class FileEvent
+	*
+	* \brief One change, as handed to a batch callback.
+	*
+	*/
+	template<typename StringType>
+	class FileEvent
+	{
+	public:
+		const StringType& path() const { return _interned ? *_interned : _path; }
+		Event type() const { return _type; }
+
+	private:
+		template<class> friend class FileWatch;
+		template<class> friend class Coalescer;
+		template<class> friend class CallbackPool;
+
+		// set when the path lives in an InternedPaths table, otherwise it is the copy in _path
+		const StringType* _interned = { nullptr };
+		StringType _path = {};
+		Event _type = { Event::added };
+		// when the event was read, for Stats::latency
+		std::chrono::steady_clock::time_point _read_at = {};
+	};
+
+	/**
+	* \class EventBatch
+	*
+	* \brief A contiguous run of events handed to a batch callback, it only stays valid until the callback returns.
+	*
+	*/
+	template<typename StringType>
+	class EventBatch
+	{
+	public:
+		typedef FileEvent<StringType> value_type;
+		typedef const value_type* const_iterator;
+		typedef const_iterator iterator;
+
+		EventBatch(const value_type* events, std::size_t count) : _events(events), _count(count) {}
+
+		const_iterator begin() const { return _events; }
+		const_iterator end() const { return _events + _count; }
+		const value_type* data() const { return _events; }
+		const value_type& operator[](std::size_t index) const { return _events[index]; }
+		std::size_t size() const { return _count; }
+		bool empty() const { return _count == 0; }
+
+	private:
+		const value_type* _events;
+		std::size_t _count;
+	};
+
+	/**
+	* \class InternedPaths
+	*
+	* \brief Maps a watch descriptor plus the name in an event to the full relative path, built only the first time it is seen.
+	*
+	* Entries never move, so events can point at their path instead of copying it, and looking one up hashes the raw name
+	* in place. Once warm, turning an event into a path allocates nothing.
+	*/
+	template<typename StringType>
+	class InternedPaths
+	{
+		typedef typename StringType::value_type C;
+		typedef std::basic_string<C, std::char_traits<C>> UnderpinningString;
+
+	public:
+		struct Entry
+		{
+			int wd;
+			// the forget() count of the descriptor when the entry was added, it is stale once they differ
+			std::uint32_t generation;
+			std::string name;
+			std::size_t hash;
+			StringType path;
+			// whether the watch's filter let the path through, worked out once along with the path
+			bool passes;
+		};
+
+		// past this many entries the table is emptied at the next clear_if_full() that is safe
+		static constexpr std::size_t max_entries = { 1 << 16 };
+
+		std::size_t size() const { return _entries.size(); }
+
+		const Entry* find(int wd, const char* name, std::size_t length) const
+		{
+			if (_buckets.empty())
+			{
+				return nullptr;
+			}
+			const auto hash = hash_of(wd, name, length);
+			for (auto bucket = hash & (_buckets.size() - 1); _buckets[bucket] != 0; bucket = (bucket + 1) & (_buckets.size() - 1))
+			{
+				const Entry& entry = _entries[_buckets[bucket] - 1];
+				if (entry.hash == hash && entry.wd == wd && entry.generation == generation_of(wd) && entry.name.compare(0, std::string::npos, name, length) == 0)
+				{
+					return &entry;
+				}
+			}
+			return nullptr;
+		}
+
+		// Adds an entry that find() could not, `path` and `passes` are only called now.
+		template<typename MakePath, typename Passes>
+		const Entry& insert(int wd, const char* name, std::size_t length, MakePath make_path, Passes passes)
+		{
+			if ((_indexed + 1) * 2 > _buckets.size())
+			{
+				rehash(std::max<std::size_t>(_buckets.size() * 2, 64));
+			}
+			const auto hash = hash_of(wd, name, length);
+			UnderpinningString path = make_path();
+			const bool pass = passes(path);
+			_entries.push_back(Entry{ wd, generation_of(wd), std::string(name, length), hash, StringType(std::move(path)), pass });
+			place(_entries.size() - 1);
+			return _entries.back();
+		}
+
+		// Stops the entries of one descriptor being found, e.g. when it is reused or its directory is renamed. The entries
+		// of other descriptors are untouched, and the stale ones stay alive as queued events may point at them.
+		void forget(int wd)
+		{
+			if (wd < 0)
+			{
+				return;
+			}
+			if (static_cast<std::size_t>(wd) >= _generations.size())
+			{
+				_generations.resize(wd + 1, 0);
+			}
+			++_generations[wd];
+		}
+
+		// Frees everything once it has grown too big, only call it when nothing points at an entry any more.
+		void clear_if_full()
+		{
+			if (_entries.size() > max_entries)
+			{
+				_entries.clear();
+				_buckets.clear();
+				_indexed = 0;
+			}
+		}
+
+	private:
+		// a deque never moves its elements when growing at the back
+		std::deque<Entry> _entries = {};
+		// open addressing over _entries, index + 1 so 0 is empty
+		std::vector<std::uint32_t> _buckets = {};
+		// how many entries are in _buckets, stale ones are left out at the next rehash
+		std::size_t _indexed = { 0 };
+		// per descriptor, how many times it was forget()-ten. Descriptors are small and handed out in order, so a vector.
+		std::vector<std::uint32_t> _generations = {};
+
+		std::uint32_t generation_of(int wd) const
+		{
+			return wd >= 0 && static_cast<std::size_t>(wd) < _generations.size() ? _generations[wd] : 0;
+		}
+
+		static std::size_t hash_of(int wd, const char* name, std::size_t length)
+		{
+			std::uint64_t hash = 14695981039346656037ull ^ static_cast<std::uint32_t>(wd);
+			for (std::size_t i = 0; i < length; ++i)
+			{
+				hash = (hash ^ static_cast<unsigned char>(name[i])) * 1099511628211ull;
+			}
+			return static_cast<std::size_t>(hash ^ (hash >> 32));
+		}
+
+		void place(std::size_t index)
+		{
+			auto bucket = _entries[index].hash & (_buckets.size() - 1);
+			while (_buckets[bucket] != 0)
+			{
+				bucket = (bucket + 1) & (_buckets.size() - 1);
+			}
+			_buckets[bucket] = static_cast<std::uint32_t>(index + 1);
+			++_indexed;
+		}
+
+		void rehash(std::size_t bucket_count)
+		{
+			_buckets.assign(bucket_count, 0);
+			_indexed = 0;
+			for (std::size_t i = 0; i < _entries.size(); ++i)
+			{
+				if (_entries[i].generation == generation_of(_entries[i].wd))
+				{
+					place(i);
+				}
+			}
+		}
+	};
+
+	/**
+	* \class Coalescer
+	*
+	* \brief Merges the changes to each path that arrive within a time window into one, e.g. added + modified + modified becomes added.
+	*
+	* Changes are released in the order their path was first seen, once the window from that first change has passed.
+	* A hash index over the pending paths makes merging a change O(1). Renames are never merged, they end the pending
+	* change of their path so what follows them starts a new one.
+	*/
+	template<typename StringType>
+	class Coalescer
+	{
+		typedef typename StringType::value_type C;
+		typedef std::basic_string<C, std::char_traits<C>> UnderpinningString;
+
+	public:
+		typedef std::chrono::steady_clock Clock;
+
+		explicit Coalescer(Clock::duration window) : _window(window) {}
+
+		bool empty() const { return _pending.empty(); }
+
+		Clock::time_point next_deadline() const { return _pending.front().deadline; }
+
+		void add(const StringType& path, Event event, Clock::time_point now)
+		{
+			const bool mergeable = event != Event::renamed_old && event != Event::renamed_new;
+			const UnderpinningString key = path;
+			const auto found = _index.find(key);
+			if (found != _index.end())
+			{
+				if (mergeable)
+				{
+					auto& pending = _pending[found->second - _first];
+					pending.live = merge(pending.event, event);
+					if (!pending.live)
+					{
+						_index.erase(found);
+					}
+					return;
+				}
+				_index.erase(found);
+			}
+
+			if (mergeable)
+			{
+				_index[key] = _first + _pending.size();
+			}
+			_pending.push_back(Pending{ path, event, now + _window, true });
+		}
+
+		// Moves at most `max` changes whose window has passed into `ready`, reusing its elements, and returns how many there were.
+		std::size_t take_due(Clock::time_point now, std::vector<FileEvent<StringType>>& ready, std::size_t max = std::numeric_limits<std::size_t>::max())
+		{
+			std::size_t count = 0;
+			while (!_pending.empty() && _pending.front().deadline <= now && count < max)
+			{
+				auto& pending = _pending.front();
+				if (pending.live)
+				{
+					const auto found = _index.find(UnderpinningString(pending.path));
+					if (found != _index.end() && found->second == _first)
+					{
+						_index.erase(found);
+					}
+					if (count == ready.size())
+					{
+						ready.emplace_back();
+					}
+					ready[count]._interned = nullptr;
+					ready[count]._path = pending.path;
+					ready[count]._type = pending.event;
+					ready[count]._read_at = pending.deadline - _window;
+					++count;
+				}
+				_pending.pop_front();
+				++_first;
+			}
+			return count;
+		}
+
+	private:
+		struct Pending
+		{
+			StringType path;
+			Event event;
+			Clock::time_point deadline;
+			bool live;
+		};
+
+		const Clock::duration _window;
+		std::deque<Pending> _pending = {};
+		// sequence number of _pending.front(), the index stores sequence numbers so popping the front keeps it valid
+		std::size_t _first = { 0 };
+		std::unordered_map<UnderpinningString, std::size_t> _index = {};
+
+		// Folds `next` into `current`, returns false when the two cancel out.
+		static bool merge(Event& current, Event next)
+		{
+			if (current == Event::added && next == Event::removed)
+			{
+				return false;
+			}
+			if (current == Event::added)
+			{
+				return true;
+			}
+			current = (current == Event::removed && next != Event::removed) ? Event::modified : next;
+			return true;
+		}
+	};
+
+	/**
+	* \class CallbackPool
+	*
+	* \brief Runs callbacks on a pool of threads, with the events sharded by a hash of their path. A shard only ever runs on
+	* one thread at a time and in the order its events came, so the changes to a path are still seen in order, while
+	* different paths run in parallel.
+	*
+	* There are several shards per thread. A thread runs the shards it owns first and steals ready shards from the other
+	* threads when it has none, so a slow callback only holds up the few paths that share its shard.
+	*/
+	template<typename StringType>
+	class CallbackPool
+	{
+		typedef typename StringType::value_type C;
+		typedef std::basic_string<C, std::char_traits<C>> UnderpinningString;
+
+	public:
+		typedef std::function<void(const FileEvent<StringType>* events, std::size_t count)> Run;
+
+		// `run` is called with runs of events from one shard, from any of the threads. At most `capacity` events wait for a thread.
+		CallbackPool(std::size_t threads, std::size_t capacity, Run run) :
+			_shards(threads * shards_per_thread),
+			_ready(threads),
+			_capacity(std::max<std::size_t>(capacity, 1)),
+			_run(run)
+		{
+			for (std::size_t thread = 0; thread < threads; ++thread)
+			{
+				_threads.emplace_back([this, thread]() { work(thread); });
+			}
+		}
+
+		~CallbackPool()
+		{
+			stop();
+			for (auto& thread : _threads)
+			{
+				thread.join();
+			}
+		}
+
+		CallbackPool(const CallbackPool&) = delete;
+		CallbackPool& operator=(const CallbackPool&) = delete;
+
+		// Copies the events into their shards, waiting for room while `capacity` are already waiting. False once stopped.
+		bool submit(const FileEvent<StringType>* events, std::size_t count)
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			for (std::size_t i = 0; i < count; ++i)
+			{
+				while (!_stopped && _pending >= _capacity)
+				{
+					_space.wait(lock);
+				}
+				if (_stopped)
+				{
+					return false;
+				}
+				const auto shard = std::hash<UnderpinningString>()(events[i].path()) % _shards.size();
+				auto& queued = _shards[shard];
+				const bool idle = queued.events.empty() && !queued.running;
+				queued.events.emplace_back();
+				auto& event = queued.events.back();
+				// the queued event may point into an InternedPaths table that is freed once it has been released
+				event._path = events[i].path();
+				event._type = events[i]._type;
+				event._read_at = events[i]._read_at;
+				++_pending;
+				if (idle)
+				{
+					_ready[shard % _ready.size()].push_back(shard);
+					_work.notify_one();
+				}
+			}
+			return true;
+		}
+
+		// Wakes everyone up, events still waiting are dropped and the threads finish once their current run returns.
+		void stop()
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stopped = true;
+			_work.notify_all();
+			_space.notify_all();
+		}
+
+	private:
+		// an enum rather than static constexpr members, so they need no out of line definition in a header only library
+		enum : std::size_t { shards_per_thread = 8, max_run = 64 };
+
+		struct Shard
+		{
+			std::deque<FileEvent<StringType>> events = {};
+			// taken by a thread, nobody else may run it
+			bool running = { false };
+		};
+
+		std::mutex _mutex = {};
+		std::condition_variable _work = {};
+		std::condition_variable _space = {};
+		std::vector<Shard> _shards;
+		// for each thread, the shards it owns that have events and aren't running
+		std::vector<std::deque<std::size_t>> _ready;
+		std::size_t _pending = { 0 };
+		const std::size_t _capacity;
+		bool _stopped = { false };
+		const Run _run;
+		std::vector<std::thread> _threads = {};
+
+		// A ready shard for `thread`, one of its own if it has any or else one stolen from the back of another's.
+		bool take(std::size_t thread, std::size_t& shard)
+		{
+			if (!_ready[thread].empty())
+			{
+				shard = _ready[thread].front();
+				_ready[thread].pop_front();
+				return true;
+			}
+			for (std::size_t other = (thread + 1) % _ready.size(); other != thread; other = (other + 1) % _ready.size())
+			{
+				if (!_ready[other].empty())
+				{
+					shard = _ready[other].back();
+					_ready[other].pop_back();
+					return true;
+				}
+			}
+			return false;
+		}
+
+		void work(std::size_t thread)
+		{
+			std::vector<FileEvent<StringType>> run;
+			std::unique_lock<std::mutex> lock(_mutex);
+			for (;;)
+			{
+				std::size_t shard = 0;
+				while (!_stopped && !take(thread, shard))
+				{
+					_work.wait(lock);
+				}
+				if (_stopped)
+				{
+					return;
+				}
+				auto& queued = _shards[shard];
+				queued.running = true;
+				const auto count = std::min<std::size_t>(queued.events.size(), max_run);
+				run.resize(std::max(run.size(), count));
+				for (std::size_t i = 0; i < count; ++i)
+				{
+					std::swap(run[i], queued.events.front());
+					queued.events.pop_front();
+				}
+				_pending -= count;
+				_space.notify_all();
+
+				lock.unlock();
+				try
+				{
+					_run(run.data(), count);
+				}
+				catch (...) {} // a callback throwing something other than std::exception must not take the thread down
+				lock.lock();
+
+				queued.running = false;
+				if (!queued.events.empty())
+				{
+					_ready[shard % _ready.size()].push_back(shard);
+					_work.notify_one();
+				}
+			}
+		}
+	};
+
+	/**
+	* \enum QueueFullPolicy
+	*
+	* \brief What the reader does with new events while Options::queue_capacity of them wait for the callbacks.
+	*/
+	enum class QueueFullPolicy
+	{
+		// wait for the callbacks to make room, leaving further events queued in the kernel (whose queue may then overflow)
+		block,
+		// drop the oldest events the callbacks haven't started on, to make room for the new ones. Until the callbacks
+		// take what is queued, up to queue_capacity of the newest wait with the reader.
+		drop_oldest,
+		// drop the new events
+		drop_newest,
+		// drop everything until the callbacks have caught up, then rescan and report what changed meanwhile as after a
+		// kernel queue overflow (see Options::rescan_on_overflow). Without a snapshot to compare with a single
+		// Event::rescan is reported instead.
+		rescan
+	};
+
+	/**
+	* \struct Options
+	*
+	* \brief Optional behaviour for a FileWatch, a default constructed Options watches exactly as before.
+	*
+	*/
+	struct Options
+	{
+		// Also watch every directory below the watched directory, reported paths are relative to it (e.g. "sub/file.txt").
+		// Only supported on linux, other platforms ignore it.
+		bool recursive = false;
+
+		// Share one inotify instance and one pair of threads between every watcher that sets this, instead of two threads
+		// and an inotify instance each. Callbacks of all shared watchers run one after another on the hub's dispatch thread.
+		// Only supported on linux, other platforms ignore it.
+		bool shared_hub = false;
+
+		// Number of events that can wait for the callback thread, rounded up to a power of two. What happens when it is full
+		// is up to queue_full_policy, by default the reader waits for the callbacks to catch up, leaving further events
+		// queued in the kernel.
+		std::size_t queue_capacity = 1024;
+		QueueFullPolicy queue_full_policy = QueueFullPolicy::block;
+
+		// When non zero, changes to the same path within this window of its first change are merged into one before the
+		// callbacks see them, e.g. added + modified + modified is reported once as added, and added + removed not at all.
+		std::chrono::milliseconds coalesce_window = std::chrono::milliseconds(0);
+
+		// Keep a snapshot (inode, size and modification time of every path) so that when the kernel's event queue overflows,
+		// a rescan can report whatever changed while events were being dropped. Costs an initial scan and the memory of
+		// one entry per path, so it is off unless asked for. Only supported on linux, other platforms ignore it.
+		bool rescan_on_overflow = false;
+
+		// Read inotify through io_uring, with reads queued ahead, when the kernel supports it (5.11 and later) and fall back
+		// to epoll and read() when it doesn't. A shared hub reads the way the watcher that created it asked for.
+		// Only supported on linux, other platforms ignore it.
+		bool use_io_uring = true;
+
+		// Mark the whole filesystem holding the watched path with fanotify instead of adding an inotify watch per directory,
+		// so a recursive watch of millions of directories needs no kernel watches. Needs CAP_SYS_ADMIN and linux 5.9, without
+		// them inotify is used as usual. shared_hub and use_io_uring are ignored when it is in use.
+		// Only supported on linux, other platforms ignore it.
+		bool use_fanotify = false;
+
+		// Keep the snapshot (see rescan_on_overflow) in this file, so a restarted watch can catch up. When the file is there
+		// and of the same tree, whatever changed since it was saved is reported as added, removed or modified before any
+		// live event. It is saved when the watch is destroyed and, while changes come in, at most every snapshot_interval
+		// (never if zero). Only supported on linux, other platforms ignore it.
+		std::string snapshot_file = {};
+		std::chrono::milliseconds snapshot_interval = std::chrono::seconds(60);
+
+		// Hash a file when it is closed after being written and drop the change if it hashes the same as last time, for
+		// writers that rewrite files with the contents they already had. Changes to a file are then reported once, when
+		// the writer closes it, instead of on every write. The hashes remembered are kept within content_hash_budget bytes,
+		// forgetting the least recently written files first. A file is read when its close is handled, which may be after
+		// the next write has begun. Only supported on linux, other platforms ignore it.
+		bool suppress_unchanged_writes = false;
+		std::size_t content_hash_budget = 4 * 1024 * 1024;
+		// Files are hashed on the thread reading events (with shared_hub, the one every watcher shares), which reads nothing
+		// else meanwhile. Files bigger than this many bytes are not hashed and every close after a write is reported.
+		std::uint64_t content_hash_size_limit = 64 * 1024 * 1024;
+
+		// Run the callbacks on this many threads instead of one, see CallbackPool. The changes to a path are still seen in
+		// order but callbacks for different paths run at the same time, so they must be thread safe, and a batch callback
+		// is given runs of events that share a shard. When queue_capacity events are waiting for a thread, whoever hands
+		// them out (with shared_hub, the hub's dispatch thread) waits too. Ignored in pull mode.
+		std::size_t callback_threads = 1;
+
+		// Hand the callbacks to your own thread pool instead of starting a callback thread. It is called with a task that runs
+		// the callbacks for everything queued so far, and only once that task has run is it given another, so the callbacks
+		// still run one after another. A task that runs after the watch is destroyed does nothing, destroying the watch waits
+		// for one that is running. callback_threads is ignored. A coalesce_window needs the timers of a shared_hub to know
+		// when to flush, without one the constructor throws std::invalid_argument. Ignored in pull mode.
+		std::function<void(std::function<void()> task)> executor = {};
+
+		// Run the callbacks on the thread reading events, straight after each read, instead of handing them to a callback
+		// thread. For callbacks cheaper than waking another thread: nothing else is started, but a slow callback holds up
+		// reading, leaving events queued in the kernel (whose queue may then overflow). With shared_hub they run on the hub's
+		// reading thread and hold up every shared watcher. The queue is emptied whenever it fills, so queue_full_policy never
+		// comes into play. callback_threads and executor are ignored, and a coalesce_window is only supported on linux, other
+		// platforms throw std::invalid_argument from the constructor. Ignored in pull mode.
+		bool inline_callbacks = false;
+
+#if __unix__
+		// Read events from here instead of inotify, e.g. a SyntheticEventSource to measure or test the pipeline without
+		// touching the file system. Implies rescan_on_overflow = false, and shared_hub is ignored.
+		std::shared_ptr<EventSource> event_source = {};
+#endif // __unix__
+	};
+
+	/**
+	* \class LatencyHistogram
+	*
+	* \brief Counts of values (nanoseconds) in log linear buckets: exact below 16, then eight buckets per power of two,
+	* so any value is within 12.5% of its bucket's bounds. Covers the whole 64 bit range in 496 buckets.
+	*/
+	class LatencyHistogram
+	{
+	public:
+		// an enum rather than static constexpr members, so they need no out of line definition in a header only library
+		enum : std::size_t { sub_buckets = 8, bucket_count = 62 * sub_buckets };
+
+		static std::size_t bucket_of(std::uint64_t value)
+		{
+			if (value < 2 * sub_buckets)
+			{
+				return static_cast<std::size_t>(value);
+			}
+			const auto exponent = highest_bit(value);
+			return (exponent - 2) * sub_buckets + ((value >> (exponent - 3)) & (sub_buckets - 1));
+		}
+
+		// The largest value that lands in `bucket`.
+		static std::uint64_t upper_bound_of(std::size_t bucket)
+		{
+			if (bucket < 2 * sub_buckets)
+			{
+				return bucket;
+			}
+			const auto shift = bucket / sub_buckets - 1;
+			const std::uint64_t lower = static_cast<std::uint64_t>(sub_buckets + bucket % sub_buckets) << shift;
+			return lower + ((std::uint64_t(1) << shift) - 1);
+		}
+
+		std::uint64_t operator[](std::size_t bucket) const { return _counts[bucket]; }
+
+		std::uint64_t count() const
+		{
+			std::uint64_t total = 0;
+			for (const auto count : _counts)
+			{
+				total += count;
+			}
+			return total;
+		}
+
+		// The value `fraction` (0 to 1) of the recorded values are at or below, rounded up to its bucket. 0 when empty.
+		std::uint64_t percentile(double fraction) const
+		{
+			const auto total = count();
+			if (total == 0)
+			{
+				return 0;
+			}
+			const auto wanted = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(fraction * static_cast<double>(total) + 0.5));
+			std::uint64_t seen = 0;
+			for (std::size_t bucket = 0; bucket < bucket_count; ++bucket)
+			{
+				seen += _counts[bucket];
+				if (seen >= wanted)
+				{
+					return upper_bound_of(bucket);
+				}
+			}
+			return upper_bound_of(bucket_count - 1);
+		}
+
+	private:
+		template<class> friend class FileWatch;
+
+		std::array<std::uint64_t, bucket_count> _counts = {};
+
+		static std::size_t highest_bit(std::uint64_t value)
+		{
+			std::size_t bit = 0;
+			for (std::size_t step = 32; step > 0; step /= 2)
+			{
+				if (value >> step)
+				{
+					value >>= step;
+					bit += step;
+				}
+			}
+			return bit;
+		}
+	};
+
+	/**
+	* \struct Stats
+	*
+	* \brief A snapshot of a FileWatch's counters, see FileWatch::stats(). Counts are totals since the watch was created.
+	*
+	*/
+	struct Stats
+	{
+		// records read from the OS, including ones that turn into no event
+		std::uint64_t events_read = { 0 };
+		// records the filter (or single file watch) dropped
+		std::uint64_t events_filtered = { 0 };
+		// events handed to a callback
+		std::uint64_t events_dispatched = { 0 };
+		// events waiting for the callbacks right now, and the most there have ever been
+		std::size_t queue_depth = { 0 };
+		std::size_t queue_high_water = { 0 };
+		// what Options::queue_full_policy did with a full queue: times the reader had to wait for the callbacks (block),
+		// events dropped (drop_oldest, drop_newest) and times the queue was collapsed into a rescan (rescan)
+		std::uint64_t queue_full_waits = { 0 };
+		std::uint64_t events_dropped_oldest = { 0 };
+		std::uint64_t events_dropped_newest = { 0 };
+		std::uint64_t queue_rescans = { 0 };
+		// times the OS dropped events because we did not read them fast enough (IN_Q_OVERFLOW on linux)
+		std::uint64_t overflows = { 0 };
+		// writes dropped as the file hashed the same as before, see Options::suppress_unchanged_writes
+		std::uint64_t events_unchanged = { 0 };
+		// nanoseconds from an event being read to its callback starting, including any Options::coalesce_window
+		LatencyHistogram latency = {};
+		// set if reading events failed after the watch had started, e.g. a std::system_error from the OS. The watch
+		// reports nothing more and has to be recreated.
+		std::exception_ptr reader_error = {};
+	};
+
+	/**
+	* \class FileWatch
+	*
+	* \brief Watches a folder or file, and will notify of changes via function callback.
+	*
+	* \author Thomas Monkman
+	*
+	*/
+	template<class StringType>
+	class FileWatch
+	{
+		typedef typename StringType::value_type C;
+		typedef std::basic_string<C, std::char_traits<C>> UnderpinningString;
+		typedef std::basic_regex<C, std::regex_traits<C>> UnderpinningRegex;
+
+	public:
+
+		FileWatch(StringType path, PathFilter<StringType> filter, std::function<void(const StringType& file, const Event event_type)> callback, Options options) :
+			FileWatch<StringType>(path, filter, callback, nullptr, options) {}
+
+		FileWatch(StringType path, PathFilter<StringType> filter, std::function<void(const StringType& file, const Event event_type)> callback) :
+			FileWatch<StringType>(path, filter, callback, Options()) {}
+
+		FileWatch(StringType path, std::function<void(const StringType& file, const Event event_type)> callback, Options options) :
+			FileWatch<StringType>(path, PathFilter<StringType>(), callback, options) {}
+
+		FileWatch(StringType path, std::function<void(const StringType& file, const Event event_type)> callback) :
+			FileWatch<StringType>(path, PathFilter<StringType>(), callback, Options()) {}
+
+		// Batch callbacks are called once per run of queued events instead of once per event.
+		FileWatch(StringType path, PathFilter<StringType> filter, std::function<void(const EventBatch<StringType>& events)> callback, Options options) :
+			FileWatch<StringType>(path, filter, nullptr, callback, options) {}
+
+		FileWatch(StringType path, PathFilter<StringType> filter, std::function<void(const EventBatch<StringType>& events)> callback) :
+			FileWatch<StringType>(path, filter, nullptr, callback, Options()) {}
+
+		FileWatch(StringType path, std::function<void(const EventBatch<StringType>& events)> callback, Options options) :
+			FileWatch<StringType>(path, PathFilter<StringType>(), nullptr, callback, options) {}
+
+		FileWatch(StringType path, std::function<void(const EventBatch<StringType>& events)> callback) :
+			FileWatch<StringType>(path, PathFilter<StringType>(), nullptr, callback, Options()) {}
+
+		// Without a callback there is no callback thread, the events are pulled with poll(), try_pop() and wait_for() instead.
+		FileWatch(StringType path, PathFilter<StringType> filter, Options options) :
+			FileWatch<StringType>(path, filter, nullptr, nullptr, options) {}
+
+		FileWatch(StringType path, Options options) :
+			FileWatch<StringType>(path, PathFilter<StringType>(), nullptr, nullptr, options) {}
+
+		~FileWatch() {
+			destroy();
+		}
+
+		// Pull mode only. Moves up to `max` events into `events`, reusing the storage of their paths, and returns how many.
+		// Never blocks. The pull functions must not be called from more than one thread at a time.
+		std::size_t poll(FileEvent<StringType>* events, std::size_t max)
+		{
+			check_pulling();
+			std::size_t count = 0;
+			if (_coalescer) {
+				absorb();
+				const auto due = _coalescer->take_due(Coalescer<StringType>::Clock::now(), _coalesced, max);
+				for (; count < due; ++count) {
+					move_out(_coalesced[count], events[count]);
+				}
+#if __unix__
+				rearm_ready();
+#endif // __unix__
+				return count;
+			}
+
+			const FileEvent<StringType>* queued = nullptr;
+			std::size_t available = 0;
+			while (count < max && (available = _callback_information.peek(queued)) > 0) {
+				available = std::min(available, max - count);
+				for (std::size_t i = 0; i < available; ++i) {
+					move_out(queued[i], events[count + i]);
+				}
+				count += available;
+				_callback_information.release(available);
+			}
+#if __unix__
+			rearm_ready();
+#endif // __unix__
+			return count;
+		}
+
+		// Pull mode only, poll() for a single event.
+		bool try_pop(FileEvent<StringType>& event)
+		{
+			return poll(&event, 1) == 1;
+		}
+
+		// Pull mode only. Waits until poll() has something to return or `timeout` passes, returns whether it has.
+		template<typename Rep, typename Period>
+		bool wait_for(const std::chrono::duration<Rep, Period>& timeout)
+		{
+			check_pulling();
+			const auto deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout);
+			while (_destory == false) {
+				auto until = deadline;
+				if (_coalescer) {
+					absorb();
+					if (!_coalescer->empty()) {
+						if (_coalescer->next_deadline() <= std::chrono::steady_clock::now()) {
+							return true;
+						}
+						until = std::min(until, _coalescer->next_deadline());
+					}
+				}
+				else if (_callback_information.size() > 0) {
+					return true;
+				}
+				if (!_callback_information.wait_for_data(_destory, until) && std::chrono::steady_clock::now() >= deadline) {
+					// one last look, something may have come in just as we gave up
+					return _coalescer ? (absorb(), !_coalescer->empty() && _coalescer->next_deadline() <= deadline) : _callback_information.size() > 0;
+				}
+			}
+			return false;
+		}
+
+#if FILEWATCH_COROUTINES
+		// Awaits the next run of events, see next_batch().
+		class BatchAwaiter
+		{
+		public:
+			explicit BatchAwaiter(FileWatch<StringType>& watch) : _watch(watch) {}
+
+			bool await_ready() { return _watch.batch_ready(); }
+			bool await_suspend(std::coroutine_handle<> awaiting) { return _watch.await_batch(awaiting); }
+			EventBatch<StringType> await_resume() const { return EventBatch<StringType>(_watch._batch, _watch._batch_size); }
+
+		private:
+			FileWatch<StringType>& _watch;
+		};
+
+		// Pull mode only, `co_await watch.next_batch()` for the next run of queued events. A coroutine that has to wait is
+		// resumed by the thread reading events (with shared_hub, the hub's), and reads the events where they are queued, so
+		// they are only valid until it awaits the watch again. Until then they take up room in the queue. An empty batch
+		// means the watch is being destroyed, don't await it again. Only one coroutine may await a watch at a time, and not
+		// alongside the other pull functions. A coalesce_window is not supported and throws std::logic_error.
+		BatchAwaiter next_batch()
+		{
+			check_pulling();
+			if (_coalescer) {
+				throw std::logic_error("FileWatch: next_batch() doesn't support a coalesce_window");
+			}
+			return BatchAwaiter(*this);
+		}
+#endif // FILEWATCH_COROUTINES
+
+#if __unix__
+		// Pull mode only. A descriptor that polls readable while poll() has something to return, for waiting on the events from your own
+		// epoll, poll() or io_uring loop along with sockets and timers. Only wait on it, never read it, poll() clears it once it has taken
+		// everything there is. With a coalesce_window it also becomes readable when a window passes.
+		int ready_fd() const
+		{
+			check_pulling();
+			return _ready_epoll >= 0 ? _ready_epoll : _ready_event;
+		}
+#endif // __unix__
+
+		// Safe to call from any thread, including a callback. The counters are read one by one, so they are not an atomic snapshot.
+		Stats stats() const
+		{
+			Stats stats;
+			stats.events_read = _events_read.load(std::memory_order_relaxed);
+			stats.events_filtered = _events_filtered.load(std::memory_order_relaxed);
+			stats.events_dispatched = _events_dispatched.load(std::memory_order_relaxed);
+			stats.queue_depth = _callback_information.size();
+			stats.queue_high_water = _queue_high_water.load(std::memory_order_relaxed);
+			stats.queue_full_waits = _queue_full_waits.load(std::memory_order_relaxed);
+			stats.events_dropped_oldest = _events_dropped_oldest.load(std::memory_order_relaxed) + _callback_information.discarded();
+			stats.events_dropped_newest = _events_dropped_newest.load(std::memory_order_relaxed);
+			stats.queue_rescans = _queue_rescans.load(std::memory_order_relaxed);
+			stats.overflows = _overflows.load(std::memory_order_relaxed);
+			stats.events_unchanged = _events_unchanged.load(std::memory_order_relaxed);
+			{
+				std::lock_guard<std::mutex> lock(_reader_error_mutex);
+				stats.reader_error = _reader_error;
+			}
+			for (std::size_t bucket = 0; bucket < LatencyHistogram::bucket_count; ++bucket)
+			{
+				stats.latency._counts[bucket] = _latency[bucket].load(std::memory_order_relaxed);
+			}
+			return stats;
+		}
+
+		FileWatch(const FileWatch<StringType>& other) : FileWatch<StringType>(other._path, other._filter, other._callback, other._batch_callback, other._options) {}
+
+		// The path and options are const, so a watch can't be assigned over, copy construct a new one instead.
+		FileWatch<StringType>& operator=(const FileWatch<StringType>&) = delete;
+
+		// Const memeber varibles don't let me implent moves nicely, if moves are really wanted std::unique_ptr should be used and move that.
+		FileWatch(FileWatch<StringType>&&) = delete;
+		FileWatch<StringType>& operator=(FileWatch<StringType>&&) & = delete;
+
+	private:
+		FileWatch(StringType path, PathFilter<StringType> filter, std::function<void(const StringType& file, const Event event_type)> callback,
+			std::function<void(const EventBatch<StringType>& events)> batch_callback, Options options) :
+			_path(absolute_path_of(path)),
+			_options(options),
+			_filter(filter),
+			_callback(callback),
+			_batch_callback(batch_callback),
+                  _directory(get_directory(path))
+		{
+			init();
+		}
+
+		static constexpr C _this_directory[] = { '.', '/', '\0' };
+
+		struct PathParts
+		{
+			PathParts(StringType directory, StringType filename) : directory(directory), filename(filename) {}
+			StringType directory;
+			StringType filename;
+		};
+		const StringType _path;
+
+		const Options _options;
+
+		PathFilter<StringType> _filter;
+
+		static constexpr std::size_t _buffer_size = { 1024 * 256 };
+
+		// only used if watch a single file
+		StringType _filename;
+
+		std::function<void(const StringType& file, const Event event_type)> _callback;
+		std::function<void(const EventBatch<StringType>& events)> _batch_callback;
+		// no callback at all, the owner pulls the events itself
+		const bool _pulling = { !_callback && !_batch_callback };
+
+		std::thread _watch_thread;
+
+		// written by the thread reading the OS events, read by the thread running the callbacks
+		SpscRing<FileEvent<StringType>> _callback_information{ _options.queue_capacity };
+		std::thread _callback_thread;
+		// the reader runs the callbacks itself, see Options::inline_callbacks
+		const bool _inline = { !_pulling && _options.inline_callbacks };
+		// reader thread only. Under QueueFullPolicy::drop_oldest the newest events wait here while the queue is full.
+		std::deque<FileEvent<StringType>> _held_back = {};
+		// under QueueFullPolicy::rescan, events have been dropped and the rescan that makes up for them is still to come
+		bool _rescan_pending = { false };
+#if FILEWATCH_COROUTINES
+		// the coroutine waiting in next_batch(), taken by whoever resumes it
+		std::atomic<void*> _awaiting = { nullptr };
+		// the events handed to it, given back to the reader when it next awaits
+		const FileEvent<StringType>* _batch = { nullptr };
+		std::size_t _batch_size = { 0 };
+#endif // FILEWATCH_COROUTINES
+		// the callbacks run on Options::executor instead of the callback thread
+		const bool _executed = { !_pulling && !_inline && _options.executor };
+		// set while a task is with the executor, there is never more than one as only one thread may take from the queue
+		std::atomic<bool> _task_queued = { false };
+		// what tasks reach the watch through, so one that outlives it finds nothing. Its mutex is held while a task runs.
+		struct ExecutorLink
+		{
+			explicit ExecutorLink(FileWatch<StringType>* watch) : watch(watch) {}
+			std::mutex running = {};
+			FileWatch<StringType>* watch = { nullptr };
+		};
+		// made before _directory, as a shared hub may already publish events while the constructor is running
+		std::shared_ptr<ExecutorLink> _executor_link{ _executed ? std::make_shared<ExecutorLink>(this) : nullptr };
+		// runs the callbacks instead of the callback thread when Options::callback_threads is more than one
+		const bool _pooled = { !_pulling && !_inline && !_executed && _options.callback_threads > 1 };
+		// made before _directory too, a shared hub may dispatch to it before the constructor returns
+		std::unique_ptr<CallbackPool<StringType>> _pool{ _pooled ? new CallbackPool<StringType>(_options.callback_threads, _options.queue_capacity,
+			[this](const FileEvent<StringType>* events, std::size_t count) { call_callbacks(events, count); }) : nullptr };
+
+		// each group is written by one thread only and read by stats() from any, on its own cache line so they don't contend
+		static constexpr std::size_t _cache_line = { 64 };
+		char _reader_stats_padding[_cache_line];
+		std::atomic<std::uint64_t> _events_read = { 0 };
+		std::atomic<std::uint64_t> _events_filtered = { 0 };
+		std::atomic<std::uint64_t> _queue_full_waits = { 0 };
+		std::atomic<std::uint64_t> _events_dropped_oldest = { 0 };
+		std::atomic<std::uint64_t> _events_dropped_newest = { 0 };
+		std::atomic<std::uint64_t> _queue_rescans = { 0 };
+		std::atomic<std::uint64_t> _overflows = { 0 };
+		std::atomic<std::uint64_t> _events_unchanged = { 0 };
+		std::atomic<std::size_t> _queue_high_water = { 0 };
+		char _callback_stats_padding[_cache_line];
+		std::atomic<std::uint64_t> _events_dispatched = { 0 };
+		std::array<std::atomic<std::uint64_t>, LatencyHistogram::bucket_count> _latency = {};
+		char _stats_end_padding[_cache_line];
+
+		// only touched by the thread running the callbacks, null unless Options::coalesce_window is set
+		std::unique_ptr<Coalescer<StringType>> _coalescer{ _options.coalesce_window.count() > 0 ? new Coalescer<StringType>(_options.coalesce_window) : nullptr };
+		std::vector<FileEvent<StringType>> _coalesced = {};
+		// the last flush asked of InotifyHub, so every dispatch doesn't add another timer for the same deadline
+		std::chrono::steady_clock::time_point _flush_scheduled = {};
+
+		std::promise<void> _running;
+		// what stopped the thread reading events after the watch had started, see Stats::reader_error
+		mutable std::mutex _reader_error_mutex = {};
+		std::exception_ptr _reader_error = {};
+		std::atomic<bool> _destory = { false };
+		bool _watching_single_file = { false };
+
+#pragma mark "Platform specific data"
+#ifdef _WIN32
+		HANDLE _directory = { nullptr };
+		HANDLE _close_event = { nullptr };
+
+		const DWORD _listen_filters =
+			FILE_NOTIFY_CHANGE_SECURITY |
+			FILE_NOTIFY_CHANGE_CREATION |
+			FILE_NOTIFY_CHANGE_LAST_ACCESS |
+			FILE_NOTIFY_CHANGE_LAST_WRITE |
+			FILE_NOTIFY_CHANGE_SIZE |
+			FILE_NOTIFY_CHANGE_ATTRIBUTES |
+			FILE_NOTIFY_CHANGE_DIR_NAME |
+			FILE_NOTIFY_CHANGE_FILE_NAME;
+
+		const std::unordered_map<DWORD, Event> _event_type_mapping = {
+			{ FILE_ACTION_ADDED, Event::added },
+			{ FILE_ACTION_REMOVED, Event::removed },
+			{ FILE_ACTION_MODIFIED, Event::modified },
+			{ FILE_ACTION_RENAMED_OLD_NAME, Event::renamed_old },
+			{ FILE_ACTION_RENAMED_NEW_NAME, Event::renamed_new }
+		};
+#endif // WIN32
+
+#if __unix__
+		struct FolderInfo {
+			int folder;
+			int watch;
+		};
+
+		const std::uint32_t _listen_filters = IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+			| (_options.suppress_unchanged_writes ? IN_CLOSE_WRITE : 0);
+
+		// watch descriptor -> path of the watched directory relative to the root, the root maps to an empty path.
+		// Declared before _directory as get_directory() fills it in.
+		std::unordered_map<int, UnderpinningString> _watched_directories = {};
+		// only touched by the thread reading events, queued events point into it
+		InternedPaths<StringType> _interned_paths = {};
+		// what we last knew of every path the filter lets through, used to catch up after IN_Q_OVERFLOW
+		struct SnapshotState
+		{
+			typename DirectoryScanner<StringType>::FileState state;
+			// false once an event has been seen for it, we did not stat it then so can't tell if it changed again since
+			bool known;
+		};
+		std::unordered_map<UnderpinningString, SnapshotState> _snapshot = {};
+		// what a rescan found: the changes to report, in path order, and the snapshot once they have been
+		struct Rescan
+		{
+			std::vector<std::pair<UnderpinningString, Event>> changes = {};
+			std::unordered_map<UnderpinningString, SnapshotState> snapshot = {};
+		};
+		// what changed since the loaded Options::snapshot_file was saved, the reader reports it before its first event
+		std::unique_ptr<Rescan> _catch_up = { nullptr };
+		// changed since it was last saved to Options::snapshot_file
+		bool _snapshot_dirty = { false };
+		std::chrono::steady_clock::time_point _next_snapshot_save = {};
+		// only touched by the thread reading events, null unless Options::suppress_unchanged_writes is set
+		std::unique_ptr<ContentHashes<StringType>> _content_hashes{ _options.suppress_unchanged_writes && !_options.event_source
+			? new ContentHashes<StringType>(_options.content_hash_budget, _options.content_hash_size_limit) : nullptr };
+
+		// an IN_MOVED_FROM waiting for the IN_MOVED_TO with the same cookie, reader thread only
+		struct PendingMove
+		{
+			std::uint32_t cookie;
+			UnderpinningString path;
+			bool directory;
+			bool passes;
+			std::chrono::steady_clock::time_point deadline;
+		};
+		// the kernel queues both halves of a rename together, so they are rarely more than one read apart and few are ever waiting
+		std::deque<PendingMove> _pending_moves = {};
+		static constexpr std::size_t _max_pending_moves = { 64 };
+		// the root directory as given to inotify, subdirectories are opened relative to it
+		UnderpinningString _root_directory = {};
+
+		// forwards the hub's calls, only registered when Options::shared_hub is set
+		struct HubClient : InotifyHub::Client
+		{
+			explicit HubClient(FileWatch<StringType>& watch) : watch(watch) {}
+
+			void on_event(const struct inotify_event* event) override
+			{
+				watch.handle_event(event, -1);
+			}
+
+			void on_read_end() override
+			{
+				watch.end_of_read();
+			}
+
+			void on_timeout() override
+			{
+				watch.end_of_read();
+			}
+
+			void dispatch() override
+			{
+				if (watch._executed)
+				{
+					// a coalesce window has passed, the executor flushes it so only its thread takes from the queue
+					watch.submit_task();
+				}
+				else
+				{
+					watch.dispatch_pending();
+				}
+			}
+
+			void on_error(std::exception_ptr error) override
+			{
+				// as when a watch's own reader thread stops
+				std::lock_guard<std::mutex> lock(watch._reader_error_mutex);
+				watch._reader_error = error;
+			}
+
+			FileWatch<StringType>& watch;
+		};
+
+		// pull mode only, see ready_fd(). The eventfd is signalled when the queue stops being empty, the timerfd when the next coalesce
+		// window passes, and with a coalesce_window both are behind an epoll of their own so there is just the one descriptor.
+		// Declared and opened ahead of _directory, a shared hub can deliver events as soon as the watches are added.
+		int _ready_event = { -1 };
+		int _ready_timer = { -1 };
+		int _ready_epoll = { -1 };
+		// set while _ready_event is signalled, so the reader doesn't write it for every batch
+		std::atomic<bool> _ready_signalled = { false };
+
+		std::shared_ptr<InotifyHub> _hub = {};
+		HubClient _hub_client = HubClient{ *this };
+		// where the records come from when it isn't inotify: Options::event_source, or the fanotify mark of Options::use_fanotify
+		std::shared_ptr<EventSource> _source = {};
+
+		FolderInfo  _directory;
+		// only used without a hub, the reader waits on both and destroy() signals _close_event
+		int _close_event = { -1 };
+		int _epoll = { -1 };
+
+		const static std::size_t event_size = (sizeof(struct inotify_event));
+#endif // __unix__
+
+#if FILEWATCH_PLATFORM_MAC
+            struct FileState 
+            {
+                  int fd;
+                  uint32_t nlink;
+                  time_t last_modification;
+
+                  FileState(int fd, uint32_t nlink, time_t lt) 
+                        : fd(fd), nlink(nlink), 
+                        last_modification(lt)
+                  {
+
+                  }
+                  FileState(const FileState&) = delete;
+                  FileState& operator=(const FileState&) = delete;
+                  FileState(FileState&& other) : fd(other.fd), nlink(other.nlink), last_modification(other.last_modification)
+                  {
+                        other.fd = -1;
+                  }
+
+                  FileState invalidate_and_clone() {
+                        int fd = this->fd;
+
+                        this->fd = -1;
+                        return FileState {fd, nlink, last_modification};
+                  }
+
+                  ~FileState() 
+                  {
+                        if (fd != -1) {
+                              close(fd);
+                        }
+                  }
+            };
+            std::unordered_map<StringType, FileState> _directory_snapshot{};
+            bool _previous_event_is_rename = false;
+            CFRunLoopRef _run_loop = nullptr;
+            int _file_fd = -1;
+            struct timespec _last_modification_time = {};
+            FSEventStreamRef _directory;
+            // fd for single file
+#endif // FILEWATCH_PLATFORM_MAC
+
+		void init() 
+		{
+#if __unix__
+			if (_hub)
+			{
+				// the hub's threads read and dispatch for us
+				return;
+			}
+#endif // __unix__
+#ifdef _WIN32
+			_close_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+			if (!_close_event) {
+				throw std::system_error(GetLastError(), std::system_category());
+			}
+#elif __unix__
+			// an event source wakes its own reader
+			if (!_source) {
+				_close_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+				_epoll = epoll_create1(EPOLL_CLOEXEC);
+				if (_close_event < 0 || _epoll < 0 || !watch_for_input(_directory.folder) || !watch_for_input(_close_event)) {
+					throw std::system_error(errno, std::system_category());
+				}
+			}
+#endif // WIN32
+
+			if (!_pulling && !_inline && !_executed) {
+				_callback_thread = std::thread([this]() {
+					try {
+						callback_thread();
+					} catch (...) {
+						try {
+							_running.set_exception(std::current_exception());
+						}
+						catch (...) {} // set_exception() may throw too
+					}
+				});
+			}
 
 			_watch_thread = std::thread([this]() { 
 				try {
 					monitor_directory();
 				} catch (...) {
+					const auto error = std::current_exception();
 					try {
-						_running.set_exception(std::current_exception());
+						_running.set_exception(error);
+					}
+					catch (...) {
+						// the watch was already up and running, so the constructor can't throw it, stats() reports it instead
+						std::lock_guard<std::mutex> lock(_reader_error_mutex);
+						_reader_error = error;
 					}
-					catch (...) {} // set_exception() may throw too
 				}
 			});
 
@@ -363,25 +4603,83 @@ namespace filewatch {
 		{
 			_destory = true;
 			_running = std::promise<void>();
+			// the reader may be waiting for room in the queue, which the callback thread is about to stop making
+			_callback_information.wake_all();
+			if (_pool) {
+				// and the callback thread, or the hub's, for room in the pool
+				_pool->stop();
+			}
 
 #ifdef _WIN32
 			SetEvent(_close_event);
 #elif __unix__
-			inotify_rm_watch(_directory.folder, _directory.watch);
+			if (_hub)
+			{
+				_hub->remove_client(&_hub_client);
+			}
+			else if (_source)
+			{
+				_source->stop();
+			}
+			else
+			{
+				const std::uint64_t wake = 1;
+				if (write(_close_event, &wake, sizeof(wake)) < 0) {} // can only fail if the counter is already non zero, which wakes the reader anyway
+			}
 #elif FILEWATCH_PLATFORM_MAC
                   if (_run_loop) {
                         CFRunLoopStop(_run_loop);
                   }
 #endif // __unix__
 
-			_cv.notify_all();
-			_watch_thread.join();
-			_callback_thread.join();
+			if (_watch_thread.joinable()) {
+				_watch_thread.join();
+			}
+			if (_callback_thread.joinable()) {
+				_callback_thread.join();
+			}
+			_pool.reset();
+#if FILEWATCH_COROUTINES
+			end_batches();
+#endif // FILEWATCH_COROUTINES
+			if (_executor_link) {
+				// waits for a task that is running, any still with the executor will find nothing to do
+				std::lock_guard<std::mutex> lock(_executor_link->running);
+				_executor_link->watch = nullptr;
+			}
+			_executor_link.reset();
+			_task_queued = false;
 
 #ifdef _WIN32
 			CloseHandle(_directory);
 #elif __unix__
-			close(_directory.folder);
+			if (_hub)
+			{
+				_hub.reset();
+			}
+			else
+			{
+				for (const auto fd : { _epoll, _close_event, _directory.folder })
+				{
+					if (fd >= 0)
+					{
+						close(fd);
+					}
+				}
+			}
+			for (auto* fd : { &_ready_epoll, &_ready_timer, &_ready_event })
+			{
+				if (*fd >= 0)
+				{
+					close(*fd);
+					*fd = -1;
+				}
+			}
+			_ready_signalled = false;
+			if (!_options.snapshot_file.empty() && keeps_snapshot())
+			{
+				save_snapshot();
+			}
 #elif FILEWATCH_PLATFORM_MAC
                   FSEventStreamStop(_directory);
                   FSEventStreamInvalidate(_directory);
@@ -411,14 +4709,303 @@ namespace filewatch {
 			return PathParts(directory, filename);
 		}
 
-		bool pass_filter(const UnderpinningString& file_path)
-		{ 
-			if (_watching_single_file) {
-				const UnderpinningString extracted_filename = { split_directory_and_file(file_path).filename };
-				//if we are watching a single file, only that file should trigger action
-				return extracted_filename == _filename;
+		bool pass_filter(const UnderpinningString& file_path)
+		{ 
+			if (_watching_single_file) {
+				const UnderpinningString extracted_filename = { split_directory_and_file(file_path).filename };
+				//if we are watching a single file, only that file should trigger action
+				return extracted_filename == _filename;
+			}
+			return _filter.match(file_path);
+		}
+
+		// Queue an event for the callbacks, it stays invisible to them until publish(). Only ever called from the reading thread.
+		// False if it was dropped, see QueueFullPolicy.
+		template<typename Path>
+		bool enqueue(const Path& file, const Event event)
+		{
+			auto* slot = claim_slot();
+			if (slot)
+			{
+				// assigning into the slot reuses whatever its previous path allocated
+				slot->_interned = nullptr;
+				slot->_path = file;
+				slot->_type = event;
+			}
+			return slot != nullptr;
+		}
+
+		// As enqueue(), but the event points at `file` which must stay alive until the callbacks have released it.
+		bool enqueue_interned(const StringType& file, const Event event)
+		{
+			auto* slot = claim_slot();
+			if (slot)
+			{
+				slot->_interned = &file;
+				slot->_type = event;
+			}
+			return slot != nullptr;
+		}
+
+		// Only ever called by the thread that owns the counter, so a plain load and store is enough.
+		static void count(std::atomic<std::uint64_t>& counter, std::uint64_t amount = 1)
+		{
+			counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+		}
+
+		// The next slot to fill in. When the queue is full that is up to Options::queue_full_policy, which may wait for the
+		// callbacks to make room or drop the event. Null if the event is dropped, or we are being destroyed.
+		FileEvent<StringType>* claim_slot()
+		{
+			settle_queue(false);
+			if (_rescan_pending)
+			{
+				return nullptr;
+			}
+			// behind what is held back, to keep the order
+			auto* slot = _held_back.empty() ? _callback_information.claim() : hold_back();
+			if (slot == nullptr && _inline)
+			{
+				// the callbacks run right here and make room, unless we are being destroyed
+				publish();
+				slot = _callback_information.claim();
+			}
+			if (slot == nullptr)
+			{
+				switch (_options.queue_full_policy)
+				{
+				case QueueFullPolicy::block:
+					count(_queue_full_waits);
+					while (slot == nullptr)
+					{
+						// full, let the callbacks have what we have so far and wait for them to make room
+						publish();
+						if (!_callback_information.wait_for_space(_destory))
+						{
+							return nullptr;
+						}
+						slot = _callback_information.claim();
+					}
+					break;
+				case QueueFullPolicy::drop_oldest:
+					publish();
+					slot = hold_back();
+					break;
+				case QueueFullPolicy::drop_newest:
+					count(_events_dropped_newest);
+					return nullptr;
+				case QueueFullPolicy::rescan:
+					publish();
+					_rescan_pending = true;
+					count(_queue_rescans);
+					return nullptr;
+				}
+			}
+			slot->_read_at = std::chrono::steady_clock::now();
+			return slot;
+		}
+
+		// How often the reader looks for room again while events wait on it.
+		static std::chrono::milliseconds settle_interval() { return std::chrono::milliseconds(10); }
+
+		// QueueFullPolicy::drop_oldest, the event waits with the reader and the oldest one queued goes to make room for it.
+		// Past queue_capacity of them the oldest held back goes instead.
+		FileEvent<StringType>* hold_back()
+		{
+			if (_held_back.size() == _callback_information.capacity())
+			{
+				_held_back.pop_front();
+				count(_events_dropped_oldest);
+			}
+			else
+			{
+				_callback_information.discard_oldest();
+			}
+			_held_back.emplace_back();
+			return &_held_back.back();
+		}
+
+		// Moves what was held back into the queue as room appears, and once the callbacks have caught up with a queue
+		// collapsed for a rescan, queues the rescan. Rescanning the tree is left to the end of a read (`may_rescan`),
+		// in the middle of handling an event the watches may be being walked.
+		void settle_queue(bool may_rescan)
+		{
+			while (!_held_back.empty())
+			{
+				auto* slot = _callback_information.claim();
+				if (slot == nullptr)
+				{
+					return;
+				}
+				// swapped, so the slot's old path storage is reused by the next one held back
+				std::swap(*slot, _held_back.front());
+				_held_back.pop_front();
+			}
+			if (!_rescan_pending || !_callback_information.drained())
+			{
+				return;
+			}
+#if __unix__
+			if (keeps_snapshot())
+			{
+				if (may_rescan)
+				{
+					_rescan_pending = false;
+					resynchronize(_hub ? -1 : _directory.folder);
+				}
+				return;
+			}
+#endif // __unix__
+			_rescan_pending = false;
+			enqueue(UnderpinningString(), Event::rescan);
+		}
+
+		// Hand everything enqueued so far to the callbacks.
+		void publish()
+		{
+			if (_callback_information.publish())
+			{
+				const auto depth = _callback_information.size();
+				if (depth > _queue_high_water.load(std::memory_order_relaxed))
+				{
+					_queue_high_water.store(depth, std::memory_order_relaxed);
+				}
+				if (_inline)
+				{
+					dispatch_pending();
+					return;
+				}
+				if (_executed)
+				{
+					submit_task();
+					return;
+				}
+#if FILEWATCH_COROUTINES
+				// pairs with the fence in await_batch(): either we see the coroutine waiting, or it sees what we published
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (_awaiting.load(std::memory_order_relaxed) != nullptr)
+				{
+					if (auto* awaiting = _awaiting.exchange(nullptr))
+					{
+						take_batch();
+						std::coroutine_handle<>::from_address(awaiting).resume();
+						return;
+					}
+				}
+#endif // FILEWATCH_COROUTINES
+#if __unix__
+				if (_pulling)
+				{
+					signal_ready();
+				}
+				else if (_hub)
+				{
+					_hub->schedule(&_hub_client);
+				}
+#endif // __unix__
+			}
+		}
+
+#if FILEWATCH_COROUTINES
+		// BatchAwaiter::await_ready(), gives back the last batch and takes the next if there is one already.
+		bool batch_ready()
+		{
+			if (_batch_size > 0)
+			{
+				_callback_information.release(_batch_size);
+				_batch_size = 0;
+			}
+			return _destory || take_batch();
+		}
+
+		// BatchAwaiter::await_suspend(), leaves the coroutine for publish() to resume unless something came in meanwhile.
+		bool await_batch(std::coroutine_handle<> awaiting)
+		{
+			_awaiting.store(awaiting.address(), std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if ((_destory || _callback_information.size() > 0) && _awaiting.exchange(nullptr) != nullptr)
+			{
+				// publish() didn't take it, carry on with what is there
+				if (_destory == false)
+				{
+					take_batch();
+				}
+				return false;
+			}
+			return true;
+		}
+
+		// Whoever resumes the coroutine, the next contiguous run of queued events for it. False if there are none.
+		bool take_batch()
+		{
+			_batch_size = _callback_information.peek(_batch);
+			const auto now = std::chrono::steady_clock::now();
+			for (std::size_t i = 0; i < _batch_size; ++i)
+			{
+				record_latency(_batch[i], now);
+			}
+			count(_events_dispatched, _batch_size);
+			return _batch_size > 0;
+		}
+
+		// After the reader has stopped, a coroutine still waiting is resumed with an empty batch.
+		void end_batches()
+		{
+			if (auto* awaiting = _awaiting.exchange(nullptr))
+			{
+				_batch_size = 0;
+				std::coroutine_handle<>::from_address(awaiting).resume();
+			}
+		}
+#endif // FILEWATCH_COROUTINES
+
+		// Give the executor a task to run the callbacks, unless it already has one that hasn't started on them yet.
+		void submit_task()
+		{
+			if (!_task_queued.exchange(true))
+			{
+				const auto link = _executor_link;
+				_options.executor([link]() {
+					std::lock_guard<std::mutex> lock(link->running);
+					if (link->watch)
+					{
+						link->watch->run_task();
+					}
+				});
+			}
+		}
+
+		void run_task()
+		{
+			// looping rather than submitting another task, an executor that runs tasks straight away would recurse
+			do
+			{
+				dispatch_pending();
+				_task_queued.store(false);
+				// pairs with the exchange in submit_task(): either we see what was published since, or the reader sees us done
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+			} while (_destory == false && _callback_information.size() > 0 && !_task_queued.exchange(true));
+		}
+
+		// A coalesce window needs something to call back once it has passed: the callback thread, with an executor the hub,
+		// and with inline callbacks the reader, which only the linux one knows how to do.
+		static void check_executor(const Options& options, bool hub)
+		{
+			if (options.coalesce_window.count() == 0)
+			{
+				return;
+			}
+			if (options.inline_callbacks)
+			{
+#if !__unix__
+				throw std::invalid_argument("FileWatch: a coalesce_window with inline_callbacks is only supported on linux");
+#endif // !__unix__
+				return;
+			}
+			if (options.executor && !hub)
+			{
+				throw std::invalid_argument("FileWatch: a coalesce_window with an executor needs shared_hub");
 			}
-			return std::regex_match(file_path, _pattern);
 		}
 
 #ifdef _WIN32
@@ -438,6 +5025,7 @@ namespace filewatch {
 
 		HANDLE get_directory(const StringType& path) 
 		{
+			check_executor(_options, false);
 			auto file_info = GetFileAttributesX(path.c_str());
 
 			if (file_info == INVALID_FILE_ATTRIBUTES)
@@ -503,7 +5091,6 @@ namespace filewatch {
 			auto async_pending = false;
 			_running.set_value();
 			do {
-				std::vector<std::pair<StringType, Event>> parsed_information;
 				ReadDirectoryChangesW(
 					_directory,
 					buffer.data(), static_cast<DWORD>(buffer.size()),
@@ -523,139 +5110,819 @@ namespace filewatch {
 					}
 					async_pending = false;
 
-					if (bytes_returned == 0) {
-						break;
-					}
+					if (bytes_returned == 0) {
+						break;
+					}
+
+					FILE_NOTIFY_INFORMATION *file_information = reinterpret_cast<FILE_NOTIFY_INFORMATION*>(&buffer[0]);
+					do
+					{
+						std::wstring changed_file_w{ file_information->FileName, file_information->FileNameLength / sizeof(file_information->FileName[0]) };
+						UnderpinningString changed_file;
+						convert_wstring(changed_file_w, changed_file);
+						count(_events_read);
+						if (pass_filter(changed_file))
+						{
+							enqueue(changed_file, _event_type_mapping.at(file_information->Action));
+						}
+						else
+						{
+							count(_events_filtered);
+						}
+
+						if (file_information->NextEntryOffset == 0) {
+							break;
+						}
+
+						file_information = reinterpret_cast<FILE_NOTIFY_INFORMATION*>(reinterpret_cast<BYTE*>(file_information) + file_information->NextEntryOffset);
+					} while (true);
+					break;
+				}
+				case WAIT_OBJECT_0 + 1:
+					// quit
+					break;
+				case WAIT_FAILED:
+					break;
+				}
+				//dispatch callbacks
+				publish();
+			} while (_destory == false);
+
+			if (async_pending)
+			{
+				//clean up running async io
+				CancelIo(_directory);
+				GetOverlappedResult(_directory, &overlapped_buffer, &bytes_returned, TRUE);
+			}
+		}
+#endif // WIN32
+
+#if __unix__
+
+		bool is_file(const StringType& path) const
+		{
+			struct stat statbuf = {};
+			if (stat(path.c_str(), &statbuf) != 0)
+			{
+				throw std::system_error(errno, std::system_category());
+			}
+			return S_ISREG(statbuf.st_mode);
+		}
+
+		FolderInfo get_directory(const StringType& path) 
+		{
+			if (_pulling)
+			{
+				open_ready_fd();
+			}
+			_source = _options.event_source;
+#if FILEWATCH_FANOTIFY
+			if (!_source && _options.use_fanotify)
+			{
+				_source = FanotifyEventSource::create(UnderpinningString(path).c_str());
+			}
+#endif // FILEWATCH_FANOTIFY
+			if (_options.shared_hub && !_source)
+			{
+				check_executor(_options, true);
+				_hub = InotifyHub::instance(_options.use_io_uring);
+				// the hub keeps our events until we are done here, so nobody else's wait while we scan the tree
+				_hub->hold(&_hub_client);
+				try
+				{
+					const auto directory = watch_directory(path, -1);
+					_hub->release(&_hub_client);
+					return directory;
+				}
+				catch (...)
+				{
+					_hub->remove_client(&_hub_client);
+					throw;
+				}
+			}
+			check_executor(_options, false);
+
+			const auto folder = _source ? -1 : inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+			if (!_source && folder < 0) 
+			{
+				throw std::system_error(errno, std::system_category());
+			}
+			return watch_directory(path, folder);
+		}
+
+		// Adds the watches and sets up the snapshot, `folder` is the inotify instance they go on (-1 when there is none of our own).
+		FolderInfo watch_directory(const StringType& path, int folder)
+		{
+			_watching_single_file = is_file(path);
+
+			const StringType watch_path = [this, &path]() {
+				if (_watching_single_file)
+				{
+					const auto parsed_path = split_directory_and_file(path);
+					_filename = parsed_path.filename;
+					return parsed_path.directory;
+				}
+				else
+				{
+					return path;
+				}
+			}();
+
+			const auto watch = add_watch(folder, watch_path, _listen_filters);
+			if (watch < 0) 
+			{
+				throw std::system_error(errno, std::system_category());
+			}
+			_watched_directories[watch] = UnderpinningString();
+
+			_root_directory = watch_path;
+			if (_options.recursive && !_watching_single_file)
+			{
+				watch_subdirectories(folder, UnderpinningString(), false);
+			}
+			SnapshotIndex<StringType> saved;
+			if (!_options.snapshot_file.empty() && keeps_snapshot()
+				&& SnapshotIndex<StringType>::load(_options.snapshot_file, UnderpinningString(_path), _options.recursive && !_watching_single_file, saved))
+			{
+				for (std::size_t i = 0; i < saved.size(); ++i)
+				{
+					auto saved_path = saved.path(i);
+					if (pass_filter(saved_path))
+					{
+						_snapshot.emplace(std::move(saved_path), SnapshotState{ saved.state(i), true });
+					}
+				}
+				// found here, after the watches are in place, and reported by the reader before any event
+				_catch_up.reset(new Rescan(rescan(folder)));
+			}
+			else if (keeps_snapshot())
+			{
+				// after the watches are in place, so a change is either in the snapshot or reported by an event
+				for (auto& entry : DirectoryScanner<StringType>::scan(_root_directory, _options.recursive && !_watching_single_file))
+				{
+					if (pass_filter(entry.first))
+					{
+						_snapshot[entry.first] = SnapshotState{ entry.second, true };
+					}
+				}
+			}
+			_next_snapshot_save = std::chrono::steady_clock::now() + _options.snapshot_interval;
+			return { folder, watch };
+		}
+
+		UnderpinningString join_path(const UnderpinningString& directory, const UnderpinningString& name) const
+		{
+			if (directory.empty())
+			{
+				return name;
+			}
+			UnderpinningString joined;
+			joined.reserve(directory.size() + 1 + name.size());
+			joined.append(directory).push_back(C('/'));
+			joined.append(name);
+			return joined;
+		}
+
+		// The path an event is about, only built the first time its descriptor and name are seen.
+		const typename InternedPaths<StringType>::Entry& interned_path_of(const struct inotify_event* event)
+		{
+			const auto length = strnlen(event->name, event->len);
+			const auto* entry = _interned_paths.find(event->wd, event->name, length);
+			if (entry != nullptr)
+			{
+				return *entry;
+			}
+			if (_callback_information.drained() && _held_back.empty())
+			{
+				_interned_paths.clear_if_full();
+			}
+			return _interned_paths.insert(event->wd, event->name, length,
+				[this, event] { return relative_path_of(event); },
+				[this](const UnderpinningString& path) { return pass_filter(path); });
+		}
+
+		UnderpinningString relative_path_of(const struct inotify_event* event) const
+		{
+			const UnderpinningString name{ event->name };
+			const auto directory = _watched_directories.find(event->wd);
+			if (directory == _watched_directories.end())
+			{
+				return name;
+			}
+			return join_path(directory->second, name);
+		}
+
+		int add_watch(int folder, const UnderpinningString& path, std::uint32_t mask)
+		{
+			if (_hub)
+			{
+				return _hub->add_watch(&_hub_client, path.c_str(), mask);
+			}
+			if (_source)
+			{
+				return _source->add_watch(path.c_str(), mask);
+			}
+			return inotify_add_watch(folder, path.c_str(), mask);
+		}
+
+		bool add_directory_watch(int folder, const UnderpinningString& relative)
+		{
+			const UnderpinningString path = join_path(_root_directory, relative);
+			const auto watch = add_watch(folder, path, _listen_filters | IN_ONLYDIR | IN_DONT_FOLLOW);
+			if (watch < 0)
+			{
+				// the directory may already be gone again, or we are out of watches, either way there is nothing to watch
+				return false;
+			}
+			_watched_directories[watch] = relative;
+			return true;
+		}
+
+		// Adds a watch to every directory below `relative` (which must already be watched), walking iteratively so deep trees can't overflow the stack.
+		// When `report` is set every entry seen is queued as added, this covers anything created before the new watches were in place.
+		void watch_subdirectories(int folder, const UnderpinningString& relative, bool report)
+		{
+			std::vector<UnderpinningString> pending = { relative };
+			while (!pending.empty())
+			{
+				const UnderpinningString directory = std::move(pending.back());
+				pending.pop_back();
+
+				DIR* handle = opendir(join_path(_root_directory, directory).c_str());
+				if (handle == nullptr)
+				{
+					continue;
+				}
+				while (const struct dirent* entry = readdir(handle))
+				{
+					const UnderpinningString name{ entry->d_name };
+					if (isParentOrSelfDirectory(name))
+					{
+						continue;
+					}
+					const UnderpinningString child = join_path(directory, name);
+					if (report && pass_filter(child))
+					{
+						enqueue(child, Event::added);
+						note(child, Event::added);
+					}
+
+					bool is_directory = entry->d_type == DT_DIR;
+					if (entry->d_type == DT_UNKNOWN)
+					{
+						struct stat statbuf = {};
+						is_directory = lstat(join_path(_root_directory, child).c_str(), &statbuf) == 0 && S_ISDIR(statbuf.st_mode);
+					}
+					if (is_directory && add_directory_watch(folder, child))
+					{
+						pending.push_back(child);
+					}
+				}
+				closedir(handle);
+			}
+		}
+
+		bool keeps_snapshot() const
+		{
+			// there are no files behind an injected event source to rescan
+			return (_options.rescan_on_overflow || !_options.snapshot_file.empty()) && !_options.event_source;
+		}
+
+		// Keeps the snapshot in step with a reported change.
+		void note(const UnderpinningString& path, const Event event)
+		{
+			// a path that was created, or renamed onto, holds other contents than the ones remembered for it
+			if (_content_hashes && (event == Event::removed || event == Event::added))
+			{
+				_content_hashes->forget(path);
+			}
+			// a pending rescan will rebuild it, and must still see as changed whatever was dropped
+			if (!keeps_snapshot() || _rescan_pending)
+			{
+				return;
+			}
+			_snapshot_dirty = true;
+			if (event == Event::removed)
+			{
+				_snapshot.erase(path);
+				return;
+			}
+			const auto found = _snapshot.find(path);
+			if (found != _snapshot.end())
+			{
+				found->second.known = false;
+			}
+			else
+			{
+				_snapshot.emplace(path, SnapshotState{ typename DirectoryScanner<StringType>::FileState(), false });
+			}
+		}
+
+		// Events were dropped, rescan and report the differences from the snapshot instead.
+		void resynchronize(int folder)
+		{
+			auto found = rescan(folder);
+			report(found);
+		}
+
+		// Scans the tree and compares it with the snapshot. The slow half of resynchronize(), which needs nothing of the
+		// reader's but the snapshot, so it can run before the reader does.
+		Rescan rescan(int folder)
+		{
+			auto scanned = DirectoryScanner<StringType>::scan(_root_directory, _options.recursive && !_watching_single_file);
+			if (_options.recursive && !_watching_single_file)
+			{
+				// directories created while events were dropped never got a watch
+				std::unordered_set<UnderpinningString> watched;
+				for (const auto& directory : _watched_directories)
+				{
+					watched.insert(directory.second);
+				}
+				for (const auto& entry : scanned)
+				{
+					if (entry.second.directory && !watched.count(entry.first))
+					{
+						add_directory_watch(folder, entry.first);
+					}
+				}
+			}
+
+			if (_content_hashes)
+			{
+				// whatever was written while events were dropped was never hashed
+				_content_hashes->clear();
+			}
+
+			// both sides sorted into an index, so the differences come out of a single merge
+			typename SnapshotIndex<StringType>::Entries passed;
+			passed.reserve(scanned.size());
+			for (auto& entry : scanned)
+			{
+				if (pass_filter(entry.first))
+				{
+					passed.push_back(std::move(entry));
+				}
+			}
+			const SnapshotIndex<StringType> now(std::move(passed));
+			typename SnapshotIndex<StringType>::Entries known;
+			known.reserve(_snapshot.size());
+			for (const auto& entry : _snapshot)
+			{
+				auto state = entry.second.state;
+				if (!entry.second.known)
+				{
+					// it may have changed after the event we reported, better to report it twice than never. No stat() gives
+					// inode 0, so it always shows up as modified.
+					const auto found = now.find(entry.first);
+					state = typename SnapshotIndex<StringType>::FileState{ 0, -1, -1, found != now.size() && now.state(found).directory, 0 };
+				}
+				known.emplace_back(entry.first, state);
+			}
+			const SnapshotIndex<StringType> before(std::move(known));
+
+			Rescan found;
+			found.snapshot.reserve(now.size());
+			for (std::size_t i = 0; i < now.size(); ++i)
+			{
+				found.snapshot.emplace(now.path(i), SnapshotState{ now.state(i), true });
+			}
+			now.diff(before, [&](const UnderpinningString& path, const Event event) {
+				const auto known = _snapshot.find(path);
+				if (event == Event::modified && _content_hashes && known != _snapshot.end() && known->second.known && known->second.state.hash != 0
+					&& !_content_hashes->changed_from(known->second.state.hash, path, join_path(_root_directory, path)))
+				{
+					// rewritten with the contents it had when the snapshot was saved
+					count(_events_unchanged);
+					return;
+				}
+				found.changes.emplace_back(path, event);
+			});
+			return found;
+		}
+
+		// Queues what rescan() found and moves the snapshot on, reader thread only.
+		void report(Rescan& found)
+		{
+			// a change the queue had no room for keeps what we knew before, so the next rescan finds it again
+			UnderpinningString dropped;
+			bool has_dropped = false;
+			for (const auto& change : found.changes)
+			{
+				const auto& path = change.first;
+				if (has_dropped && path == dropped)
+				{
+					continue; // the added half of a removed + added that had no room
+				}
+				if (enqueue(path, change.second))
+				{
+					continue;
+				}
+				dropped = path;
+				has_dropped = true;
+				const auto known = _snapshot.find(path);
+				if (known == _snapshot.end())
+				{
+					found.snapshot.erase(path);
+				}
+				else if (found.snapshot.count(path))
+				{
+					found.snapshot[path] = SnapshotState{ known->second.state, false };
+				}
+				else
+				{
+					found.snapshot.insert(*known);
+				}
+			}
+			_snapshot.swap(found.snapshot);
+			_snapshot_dirty = true;
+		}
+
+		// Writes the snapshot to Options::snapshot_file, stat()ing the paths an event has been seen for first.
+		void save_snapshot()
+		{
+			typename SnapshotIndex<StringType>::Entries entries;
+			entries.reserve(_snapshot.size());
+			for (auto& entry : _snapshot)
+			{
+				if (!entry.second.known)
+				{
+					struct stat statbuf = {};
+					if (lstat(join_path(_root_directory, entry.first).c_str(), &statbuf) != 0)
+					{
+						continue; // gone, the event saying so is still to come
+					}
+					entry.second = SnapshotState{ DirectoryScanner<StringType>::state_of(statbuf), true };
+				}
+				entries.emplace_back(entry.first, entry.second.state);
+				// so a restarted watch can tell a rewrite with the same contents from a change
+				entries.back().second.hash = _content_hashes ? _content_hashes->remembered(entry.first) : 0;
+			}
+			SnapshotIndex<StringType>(std::move(entries)).save(_options.snapshot_file, UnderpinningString(_path), _options.recursive && !_watching_single_file);
+			_snapshot_dirty = false;
+		}
+
+		bool watch_for_input(int fd)
+		{
+			struct epoll_event event = {};
+			event.events = EPOLLIN;
+			event.data.fd = fd;
+			return epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &event) == 0;
+		}
+
+		int remove_watch(int folder, int watch)
+		{
+			if (_hub)
+			{
+				_hub->remove_watch(&_hub_client, watch);
+				return 0;
+			}
+			if (_source)
+			{
+				return _source->remove_watch(watch);
+			}
+			return inotify_rm_watch(folder, watch);
+		}
+
+		static bool is_same_or_below(const UnderpinningString& path, const UnderpinningString& directory)
+		{
+			return path.compare(0, directory.size(), directory) == 0
+				&& (path.size() == directory.size() || path[directory.size()] == C('/'));
+		}
+
+		// Wait for the other half of a rename, the cookie pairs them up.
+		void moved_from(const struct inotify_event* event, int folder, const typename InternedPaths<StringType>::Entry& entry)
+		{
+			if (_pending_moves.size() == _max_pending_moves)
+			{
+				expire_move(folder);
+			}
+			_pending_moves.push_back(PendingMove{ event->cookie, entry.path, (event->mask & IN_ISDIR) != 0, entry.passes,
+				std::chrono::steady_clock::now() + std::chrono::milliseconds(20) });
+		}
 
-					FILE_NOTIFY_INFORMATION *file_information = reinterpret_cast<FILE_NOTIFY_INFORMATION*>(&buffer[0]);
-					do
+		void moved_to(const struct inotify_event* event, int folder, const typename InternedPaths<StringType>::Entry& entry)
+		{
+			const auto from = std::find_if(_pending_moves.begin(), _pending_moves.end(),
+				[event](const PendingMove& move) { return move.cookie == event->cookie; });
+			if (from == _pending_moves.end())
+			{
+				// moved in from somewhere we don't watch, the same as being created
+				if (_options.recursive && (event->mask & IN_ISDIR) && add_directory_watch(folder, entry.path))
+				{
+					if (entry.passes)
 					{
-						std::wstring changed_file_w{ file_information->FileName, file_information->FileNameLength / sizeof(file_information->FileName[0]) };
-						UnderpinningString changed_file;
-						convert_wstring(changed_file_w, changed_file);
-						if (pass_filter(changed_file))
-						{
-							parsed_information.emplace_back(StringType{ changed_file }, _event_type_mapping.at(file_information->Action));
-						}
+						enqueue_interned(entry.path, Event::added);
+						note(entry.path, Event::added);
+					}
+					watch_subdirectories(folder, entry.path, true);
+				}
+				else if (entry.passes)
+				{
+					enqueue_interned(entry.path, Event::added);
+					note(entry.path, Event::added);
+				}
+				return;
+			}
 
-						if (file_information->NextEntryOffset == 0) {
-							break;
-						}
+			if (_options.recursive && from->directory)
+			{
+				rename_directory(from->path, entry.path);
+			}
+			if (from->passes && entry.passes)
+			{
+				enqueue(from->path, Event::renamed_old);
+				enqueue_interned(entry.path, Event::renamed_new);
+			}
+			else if (from->passes)
+			{
+				enqueue(from->path, Event::removed);
+			}
+			else if (entry.passes)
+			{
+				enqueue_interned(entry.path, Event::added);
+			}
+			if (from->passes)
+			{
+				note(from->path, Event::removed);
+			}
+			if (entry.passes)
+			{
+				note(entry.path, Event::added);
+			}
+			_pending_moves.erase(from);
+		}
 
-						file_information = reinterpret_cast<FILE_NOTIFY_INFORMATION*>(reinterpret_cast<BYTE*>(file_information) + file_information->NextEntryOffset);
-					} while (true);
-					break;
+		// The oldest IN_MOVED_FROM never got its other half, it was moved out of what we watch.
+		void expire_move(int folder)
+		{
+			const PendingMove& move = _pending_moves.front();
+			if (move.directory && _options.recursive)
+			{
+				// its watches would otherwise keep reporting from outside the tree
+				for (auto directory = _watched_directories.begin(); directory != _watched_directories.end(); )
+				{
+					if (is_same_or_below(directory->second, move.path))
+					{
+						remove_watch(folder, directory->first);
+						_interned_paths.forget(directory->first);
+						directory = _watched_directories.erase(directory);
+					}
+					else
+					{
+						++directory;
+					}
 				}
-				case WAIT_OBJECT_0 + 1:
-					// quit
-					break;
-				case WAIT_FAILED:
-					break;
+				for (auto entry = _snapshot.begin(); entry != _snapshot.end(); )
+				{
+					entry = is_same_or_below(entry->first, move.path) ? _snapshot.erase(entry) : std::next(entry);
 				}
-				//dispatch callbacks
+				forget_hashes_below(move.path);
+			}
+			if (move.passes)
+			{
+				enqueue(move.path, Event::removed);
+				note(move.path, Event::removed);
+			}
+			_pending_moves.pop_front();
+		}
+
+		// A watched directory was renamed, its watches stay but everything below it now has a different path.
+		void rename_directory(const UnderpinningString& from, const UnderpinningString& to)
+		{
+			for (auto& directory : _watched_directories)
+			{
+				if (is_same_or_below(directory.second, from))
 				{
-					std::lock_guard<std::mutex> lock(_callback_mutex);
-					_callback_information.insert(_callback_information.end(), parsed_information.begin(), parsed_information.end());
+					directory.second = to + directory.second.substr(from.size());
+					_interned_paths.forget(directory.first);
 				}
-				_cv.notify_all();
-			} while (_destory == false);
+			}
 
-			if (async_pending)
+			std::vector<std::pair<UnderpinningString, SnapshotState>> moved;
+			for (auto entry = _snapshot.begin(); entry != _snapshot.end(); )
 			{
-				//clean up running async io
-				CancelIo(_directory);
-				GetOverlappedResult(_directory, &overlapped_buffer, &bytes_returned, TRUE);
+				if (entry->first.size() > from.size() && is_same_or_below(entry->first, from))
+				{
+					moved.emplace_back(to + entry->first.substr(from.size()), entry->second);
+					entry = _snapshot.erase(entry);
+				}
+				else
+				{
+					++entry;
+				}
 			}
+			_snapshot.insert(moved.begin(), moved.end());
+			forget_hashes_below(from);
 		}
-#endif // WIN32
 
-#if __unix__
-
-		bool is_file(const StringType& path) const
+		void forget_hashes_below(const UnderpinningString& directory)
 		{
-			struct stat statbuf = {};
-			if (stat(path.c_str(), &statbuf) != 0)
+			if (_content_hashes)
 			{
-				throw std::system_error(errno, std::system_category());
+				_content_hashes->forget_if([&directory](const UnderpinningString& path) { return is_same_or_below(path, directory); });
 			}
-			return S_ISREG(statbuf.st_mode);
 		}
 
-		FolderInfo get_directory(const StringType& path) 
+		// Every event of one read has been handled: give up on renames that waited too long, then let the callbacks run.
+		// Also the first thing the reader does, to catch up before it waits for events.
+		void end_of_read()
 		{
-			const auto folder = inotify_init();
-			if (folder < 0) 
+			const auto folder = _hub ? -1 : _directory.folder;
+			catch_up();
+			const auto now = std::chrono::steady_clock::now();
+			while (!_pending_moves.empty() && _pending_moves.front().deadline <= now)
 			{
-				throw std::system_error(errno, std::system_category());
+				expire_move(folder);
+			}
+			settle_queue(true);
+			publish();
+			if (_inline && _coalescer && !_coalescer->empty())
+			{
+				// a window may have passed without anything new to publish
+				dispatch_pending();
+			}
+			if (_snapshot_dirty && !_options.snapshot_file.empty() && _options.snapshot_interval.count() > 0 && now >= _next_snapshot_save)
+			{
+				save_snapshot();
+				_next_snapshot_save = now + _options.snapshot_interval;
+			}
+			if (_hub && !_pending_moves.empty())
+			{
+				_hub->wake_at(&_hub_client, _pending_moves.front().deadline);
+			}
+			if (_hub && (!_held_back.empty() || _rescan_pending))
+			{
+				_hub->wake_at(&_hub_client, now + settle_interval());
 			}
+		}
 
-			_watching_single_file = is_file(path);
+		// Report what changed since the loaded Options::snapshot_file was saved, ahead of any event.
+		void catch_up()
+		{
+			if (_catch_up)
+			{
+				const std::unique_ptr<Rescan> found(std::move(_catch_up));
+				report(*found);
+			}
+		}
 
-			const StringType watch_path = [this, &path]() {
-				if (_watching_single_file)
+		// Turns one inotify record into queued events, `folder` is the inotify instance new watches go on (-1 when shared).
+		void handle_event(const struct inotify_event* event, int folder)
+		{
+			catch_up();
+			count(_events_read);
+			if (event->mask & IN_Q_OVERFLOW)
+			{
+				count(_overflows);
+				if (keeps_snapshot())
 				{
-					const auto parsed_path = split_directory_and_file(path);
-					_filename = parsed_path.filename;
-					return parsed_path.directory;
+					resynchronize(folder);
 				}
-				else
+			}
+			else if (event->mask & IN_IGNORED)
+			{
+				// the watched directory was deleted (or we removed the watch), the descriptor may be reused by the kernel
+				_watched_directories.erase(event->wd);
+				_interned_paths.forget(event->wd);
+			}
+			else if (event->len) 
+			{
+				const auto& changed_file = interned_path_of(event);
+				if (!changed_file.passes)
 				{
-					return path;
+					count(_events_filtered);
+				}
+				if (_options.recursive && (event->mask & IN_ISDIR) && (event->mask & IN_CREATE)
+					&& add_directory_watch(folder, changed_file.path))
+				{
+					// report the directory before anything found inside it
+					if (changed_file.passes)
+					{
+						enqueue_interned(changed_file.path, Event::added);
+						note(changed_file.path, Event::added);
+					}
+					watch_subdirectories(folder, changed_file.path, true);
+				}
+				else if (event->mask & IN_MOVED_FROM)
+				{
+					moved_from(event, folder, changed_file);
+				}
+				else if (event->mask & IN_MOVED_TO)
+				{
+					moved_to(event, folder, changed_file);
+				}
+				else if (_content_hashes && (event->mask & (IN_MODIFY | IN_CLOSE_WRITE)))
+				{
+					// a write is only looked at once the writer closes the file
+					if (changed_file.passes && (event->mask & IN_CLOSE_WRITE))
+					{
+						if (_content_hashes->changed(changed_file.path, join_path(_root_directory, changed_file.path)))
+						{
+							enqueue_interned(changed_file.path, Event::modified);
+							note(changed_file.path, Event::modified);
+						}
+						else
+						{
+							count(_events_unchanged);
+						}
+					}
+				}
+				else if (changed_file.passes && (event->mask & (IN_CREATE | IN_DELETE | IN_MODIFY)))
+				{
+					const Event change = (event->mask & IN_CREATE) ? Event::added
+						: (event->mask & IN_DELETE) ? Event::removed
+						: Event::modified;
+					enqueue_interned(changed_file.path, change);
+					note(changed_file.path, change);
 				}
-			}();
-
-			const auto watch = inotify_add_watch(folder, watch_path.c_str(), IN_MODIFY | IN_CREATE | IN_DELETE);
-			if (watch < 0) 
-			{
-				throw std::system_error(errno, std::system_category());
 			}
-			return { folder, watch };
 		}
 
 		void monitor_directory() 
 		{
 			std::vector<char> buffer(_buffer_size);
+#if FILEWATCH_IO_URING
+			// created and destroyed on this thread, which owns the reads it queues
+			const auto uring = _options.use_io_uring && !_source ? UringReader::create(_directory.folder, _close_event, _buffer_size) : nullptr;
+#endif // FILEWATCH_IO_URING
 
 			_running.set_value();
+			end_of_read();
 			while (_destory == false) 
 			{
-				const auto length = read(_directory.folder, static_cast<void*>(buffer.data()), buffer.size());
-				if (length > 0) 
+				const auto timeout = next_timeout();
+				if (_source)
 				{
-					int i = 0;
-					std::vector<std::pair<StringType, Event>> parsed_information;
-					while (i < length) 
+					const auto length = _source->read(buffer.data(), buffer.size(), timeout);
+					handle_events(buffer.data(), length);
+					end_of_read();
+					continue;
+				}
+#if FILEWATCH_IO_URING
+				if (uring)
+				{
+					const char* data = nullptr;
+					auto length = uring->next(data, timeout);
+					for (; _destory == false && length > 0; length = uring->next(data, 0))
 					{
-						struct inotify_event *event = reinterpret_cast<struct inotify_event *>(&buffer[i]); // NOLINT
-						if (event->len) 
-						{
-							const UnderpinningString changed_file{ event->name };
-							if (pass_filter(changed_file))
-							{
-								if (event->mask & IN_CREATE) 
-								{
-									parsed_information.emplace_back(StringType{ changed_file }, Event::added);
-								}
-								else if (event->mask & IN_DELETE) 
-								{
-									parsed_information.emplace_back(StringType{ changed_file }, Event::removed);
-								}
-								else if (event->mask & IN_MODIFY) 
-								{
-									parsed_information.emplace_back(StringType{ changed_file }, Event::modified);
-								}
-							}
-						}
-						i += event_size + event->len;
+						handle_events(data, length);
 					}
-					//dispatch callbacks
+					if (length < 0)
 					{
-						std::lock_guard<std::mutex> lock(_callback_mutex);
-						_callback_information.insert(_callback_information.end(), parsed_information.begin(), parsed_information.end());
+						throw std::system_error(errno, std::system_category());
 					}
-					_cv.notify_all();
+					end_of_read();
+					continue;
+				}
+#endif // FILEWATCH_IO_URING
+
+				struct epoll_event ready[2];
+				if (epoll_wait(_epoll, ready, 2, timeout) < 0 && errno != EINTR)
+				{
+					throw std::system_error(errno, std::system_category());
+				}
+
+				ssize_t length = 0;
+				while (_destory == false && (length = read(_directory.folder, static_cast<void*>(buffer.data()), buffer.size())) > 0) 
+				{
+					handle_events(buffer.data(), length);
 				}
+				end_of_read();
+			}
+		}
+
+		void handle_events(const char* buffer, ssize_t length)
+		{
+			ssize_t i = 0;
+			while (i < length) 
+			{
+				const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(&buffer[i]); // NOLINT
+				handle_event(event, _directory.folder);
+				i += event_size + event->len;
+			}
+		}
+
+		// Milliseconds the reader may wait for events, it mustn't sleep past the time a rename may wait for its other half.
+		// Events waiting on the reader for room in the queue need it to look again, too, as do inline callbacks a coalesce
+		// window that passes.
+		int next_timeout() const
+		{
+			int timeout = !_held_back.empty() || _rescan_pending ? static_cast<int>(settle_interval().count()) : -1;
+			const auto now = std::chrono::steady_clock::now();
+			const auto wake_at = [&timeout, now](std::chrono::steady_clock::time_point deadline) {
+				const auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count();
+				const int until = wait < 0 ? 0 : static_cast<int>(wait) + 1;
+				timeout = timeout < 0 ? until : std::min(timeout, until);
+			};
+			if (!_pending_moves.empty())
+			{
+				wake_at(_pending_moves.front().deadline);
+			}
+			if (_inline && _coalescer && !_coalescer->empty())
+			{
+				wake_at(_coalescer->next_deadline());
 			}
+			return timeout;
 		}
 #endif // __unix__
 
@@ -756,14 +6023,15 @@ namespace filewatch {
             template<typename Fn, class = std::enable_if<Invokable<Fn, StringType>::value>>
             static void walkDirectory(const StringType& path, Fn callback) {
                   int fd = open(path.c_str(), O_RDONLY);
-                  char buf[1024];
+                  std::vector<char> buffer(64 * 1024);
+                  char* buf = buffer.data();
                   long basep = 0;
 
                   if (fd == -1) {
                         return;
                   }
 
-                  int ret = __getdirentries64(fd, buf, sizeof(buf), &basep);
+                  int ret = __getdirentries64(fd, buf, static_cast<int>(buffer.size()), &basep);
 
                   while (ret > 0) {
                         char* current = buf;
@@ -779,7 +6047,7 @@ namespace filewatch {
                               current += dirent->d_reclen;
                               offset += dirent->d_reclen;
                         }
-                        ret = __getdirentries64(fd, buf, sizeof(buf), &basep);
+                        ret = __getdirentries64(fd, buf, static_cast<int>(buffer.size()), &basep);
                   }
                   close(fd);
             }
@@ -953,7 +6221,7 @@ namespace filewatch {
                   }
 
                   walkDirectory(_path, [&](StringType file) {
-                        if (isParentOrSelfDirectory(file) || !std::regex_match(file, _pattern)) {
+                        if (isParentOrSelfDirectory(file) || !_filter.match(file)) {
                               return;
                         }
                         if (newSnapshot.count(file) == 0) {
@@ -979,14 +6247,10 @@ namespace filewatch {
                         return a.time.tv_sec < b.time.tv_sec;
                   });
 
-                  {
-                        std::lock_guard<std::mutex> lock(_callback_mutex);
-                        
-                        for (const auto& event : events) {
-                              _callback_information.push_back(std::make_pair(event.file, event.event));
-                        }
+                  for (const auto& event : events) {
+                        enqueue(event.file, event.event);
                   }
-                  _cv.notify_all();
+                  publish();
             }
 
             void seeSingleFileChanges() {
@@ -1039,14 +6303,10 @@ namespace filewatch {
                         }
                   }
 
-                  {
-                        std::lock_guard<std::mutex> lock(_callback_mutex);
-                        for (int i = 0; i < eventCount; i++) {
-                              _callback_information.push_back(
-                                    std::make_pair(eventInfos[i].file, eventInfos[i].event));
-                        }
+                  for (int i = 0; i < eventCount; i++) {
+                        enqueue(eventInfos[i].file, eventInfos[i].event);
                   }
-                  _cv.notify_all();
+                  publish();
             }
 
             void notify(CFStringRef path, const FSEventStreamEventFlags flags) {
@@ -1071,10 +6331,13 @@ namespace filewatch {
                   StringType absolutePath{(const C*)buffer, static_cast<size_t>(pathLength)};
                   PathParts pathPair = splitPath(absolutePath);
 
+                  count(_events_read);
                   if (_watching_single_file && pathPair.filename != _filename) {
+                        count(_events_filtered);
                         return;
                   }
-                  if (pathPair.directory != _path || !std::regex_match(pathPair.filename, _pattern)) {
+                  if (pathPair.directory != _path || !_filter.match(pathPair.filename)) {
+                        count(_events_filtered);
                         return;
                   }
 
@@ -1110,11 +6373,8 @@ namespace filewatch {
                         event = Event::removed;
                   }
 
-                  {
-                        std::lock_guard<std::mutex> lock(_callback_mutex);
-                        _callback_information.push_back(std::make_pair(std::move(pathPair.filename), event));
-                  }
-                  _cv.notify_all();
+                  enqueue(pathPair.filename, event);
+                  publish();
             }
 
             static void handleFsEvent(__attribute__((unused)) ConstFSEventStreamRef streamFef, 
@@ -1175,7 +6435,7 @@ namespace filewatch {
             FSEventStreamRef openStreamForDirectory(const StringType& directory) {
                   FSEventStreamRef stream = openStream(directory);
                   walkDirectory(directory, [this] (StringType path) mutable {
-                        if (!isParentOrSelfDirectory(path) && std::regex_match(path, _pattern)) {
+                        if (!isParentOrSelfDirectory(path) && _filter.match(path)) {
                               _directory_snapshot.insert(std::make_pair(std::move(path), 
                                                 std::move(makeFileState(path))));
                         }
@@ -1193,6 +6453,7 @@ namespace filewatch {
             }
 
             FSEventStreamRef get_directory(const StringType& directory) {
+                  check_executor(_options, false);
                   struct stat stat;
 
                   ::stat((const char*)directory.c_str(), &stat);
@@ -1217,30 +6478,217 @@ namespace filewatch {
 		void callback_thread()
 		{
 			while (_destory == false) {
-				std::unique_lock<std::mutex> lock(_callback_mutex);
-				if (_callback_information.empty() && _destory == false) {
-					_cv.wait(lock, [this] { return _callback_information.size() > 0 || _destory; });
+				const bool woken = (_coalescer && !_coalescer->empty())
+					? _callback_information.wait_for_data(_destory, _coalescer->next_deadline())
+					: _callback_information.wait_for_data(_destory);
+				if (woken || _coalescer) {
+					dispatch_pending();
 				}
-				decltype(_callback_information) callback_information = {};
-				std::swap(callback_information, _callback_information);
-				lock.unlock();
+			}
+		}
 
-				for (const auto& file : callback_information) {
-					if (_callback) {
-						try
-						{
-							_callback(file.first, file.second);
-						}
-						catch (const std::exception&)
-						{
-						}
+		// Run the callbacks for whatever is queued right now, used directly when someone else owns the thread (e.g. InotifyHub).
+		void dispatch_pending()
+		{
+			const FileEvent<StringType>* callback_information = nullptr;
+			std::size_t count = 0;
+			if (_pulling) {
+				// the hub only calls this in pull mode if something went wrong, whoever pulls takes the events
+				return;
+			}
+			if (_coalescer) {
+				absorb();
+				if (_destory == false) {
+					flush_coalesced();
+				}
+				return;
+			}
+			while (_destory == false && (count = _callback_information.peek(callback_information)) > 0) {
+				invoke_callbacks(callback_information, count);
+				_callback_information.release(count);
+			}
+		}
+
+		// Move everything queued into the coalescer.
+		void absorb()
+		{
+			const FileEvent<StringType>* callback_information = nullptr;
+			std::size_t count = 0;
+			while (_destory == false && (count = _callback_information.peek(callback_information)) > 0) {
+				const auto now = Coalescer<StringType>::Clock::now();
+				for (std::size_t i = 0; i < count; ++i) {
+					_coalescer->add(callback_information[i].path(), callback_information[i].type(), now);
+				}
+				_callback_information.release(count);
+			}
+		}
+
+		void check_pulling() const
+		{
+			if (!_pulling) {
+				throw std::logic_error("FileWatch: poll(), try_pop() and wait_for() need a FileWatch constructed without a callback");
+			}
+		}
+
+		// Hands one event to a puller, its path is copied as the interned one may go once the slot is released.
+		void move_out(const FileEvent<StringType>& from, FileEvent<StringType>& to)
+		{
+			record_latency(from, std::chrono::steady_clock::now());
+			count(_events_dispatched);
+
+			to._interned = nullptr;
+			to._path = from.path();
+			to._type = from._type;
+			to._read_at = from._read_at;
+		}
+
+#if __unix__
+		void open_ready_fd()
+		{
+			_ready_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if (_ready_event < 0)
+			{
+				throw std::system_error(errno, std::system_category());
+			}
+			if (_coalescer)
+			{
+				_ready_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+				_ready_epoll = epoll_create1(EPOLL_CLOEXEC);
+				if (_ready_timer < 0 || _ready_epoll < 0)
+				{
+					throw std::system_error(errno, std::system_category());
+				}
+				for (const auto fd : { _ready_event, _ready_timer })
+				{
+					struct epoll_event event = {};
+					event.events = EPOLLIN;
+					event.data.fd = fd;
+					if (epoll_ctl(_ready_epoll, EPOLL_CTL_ADD, fd, &event) != 0)
+					{
+						throw std::system_error(errno, std::system_category());
+					}
+				}
+			}
+		}
+
+		// Reader side, after publishing. Pairs with the fence in rearm_ready(): either it sees the new events or we see it cleared.
+		void signal_ready()
+		{
+			if (!_ready_signalled.exchange(true))
+			{
+				const std::uint64_t one = 1;
+				if (write(_ready_event, &one, sizeof(one)) < 0) {} // only fails if the counter would overflow, it is readable then anyway
+			}
+		}
+
+		// Puller side, after taking events: leave ready_fd() readable only if poll() still has something to return.
+		void rearm_ready()
+		{
+			std::uint64_t signals = 0;
+			if (read(_ready_event, &signals, sizeof(signals)) < 0) {} // EAGAIN, it wasn't signalled
+			_ready_signalled.store(false);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (_callback_information.size() > 0)
+			{
+				signal_ready();
+			}
+
+			if (_coalescer)
+			{
+				// setting the timer also clears a past expiry, a deadline that has already gone fires straight away
+				struct itimerspec when = {};
+				if (!_coalescer->empty())
+				{
+					const auto deadline = std::chrono::duration_cast<std::chrono::nanoseconds>(_coalescer->next_deadline().time_since_epoch()).count();
+					when.it_value.tv_sec = static_cast<time_t>(deadline / 1000000000);
+					when.it_value.tv_nsec = static_cast<long>(deadline % 1000000000);
+					if (when.it_value.tv_sec == 0 && when.it_value.tv_nsec == 0)
+					{
+						when.it_value.tv_nsec = 1; // all zeros would disarm it
+					}
+				}
+				timerfd_settime(_ready_timer, TFD_TIMER_ABSTIME, &when, nullptr);
+			}
+		}
+#endif // __unix__
+
+		// Deliver the merged changes whose window has passed, and arrange to be called again for the rest.
+		void flush_coalesced()
+		{
+			const auto count = _coalescer->take_due(Coalescer<StringType>::Clock::now(), _coalesced);
+			if (count > 0) {
+				invoke_callbacks(_coalesced.data(), count);
+			}
+#if __unix__
+			if (_hub && !_coalescer->empty() && _coalescer->next_deadline() != _flush_scheduled) {
+				_flush_scheduled = _coalescer->next_deadline();
+				if (_inline) {
+					// flushed by end_of_read(), on the thread that runs our callbacks
+					_hub->wake_at(&_hub_client, _flush_scheduled);
+				}
+				else {
+					_hub->schedule_at(&_hub_client, _flush_scheduled);
+				}
+			}
+#endif // __unix__
+		}
+
+		void record_latency(const FileEvent<StringType>& event, std::chrono::steady_clock::time_point now)
+		{
+			const auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(now - event._read_at).count();
+			auto& bucket = _latency[LatencyHistogram::bucket_of(latency < 0 ? 0 : static_cast<std::uint64_t>(latency))];
+			if (_pooled) {
+				// every thread of the pool records
+				bucket.fetch_add(1, std::memory_order_relaxed);
+			}
+			else {
+				bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			}
+		}
+
+		void invoke_callbacks(const FileEvent<StringType>* callback_information, std::size_t count)
+		{
+			FileWatch::count(_events_dispatched, count);
+			if (_pool) {
+				_pool->submit(callback_information, count);
+				return;
+			}
+			call_callbacks(callback_information, count);
+		}
+
+		// Runs the callbacks, on the thread dispatching or on one of the pool's.
+		void call_callbacks(const FileEvent<StringType>* callback_information, std::size_t count)
+		{
+			const auto now = std::chrono::steady_clock::now();
+			for (std::size_t i = 0; i < count; ++i) {
+				record_latency(callback_information[i], now);
+			}
+
+			if (_batch_callback) {
+				try
+				{
+					_batch_callback(EventBatch<StringType>(callback_information, count));
+				}
+				catch (const std::exception&)
+				{
+				}
+				return;
+			}
+			for (std::size_t i = 0; i < count; ++i) {
+				const auto& file = callback_information[i];
+				if (_callback) {
+					try
+					{
+						_callback(file.path(), file.type());
+					}
+					catch (const std::exception&)
+					{
 					}
 				}
 			}
 		}
 	};
 
-	template<class StringType> constexpr typename FileWatch<StringType>::C FileWatch<StringType>::_regex_all[];
 	template<class StringType> constexpr typename FileWatch<StringType>::C FileWatch<StringType>::_this_directory[];
 }
 #endif
@@ -0,0 +1,359 @@
+// Throughput and latency of the event pipeline, from the file system calls to the callbacks.
+//
+//   filewatch_bench [--filter=<substring>] [--files=<count>] [--dir=<directory>] [--out=<file.json>]
+//
+// The synthetic cases replay prebuilt inotify records instead, timing only parsing, filtering, queueing and callbacks.
+// Results are written as JSON in the layout Google Benchmark uses, so the same tooling can compare runs across releases.
+// The directory defaults to /dev/shm, a tmpfs, so the disk doesn't dominate the numbers.
+#include "../FileWatch.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+	typedef std::chrono::steady_clock Clock;
+
+	struct Config
+	{
+		std::string filter = {};
+		std::string directory = "/dev/shm";
+		std::string out = {};
+		std::size_t files = 2000;
+	};
+
+	struct Result
+	{
+		std::string name = {};
+		std::uint64_t operations = 0;
+		std::uint64_t events = 0;
+		double seconds = 0;
+		filewatch::Stats stats = {};
+	};
+
+	// Counts callbacks and remembers when the last one ran, so a run can end once the events stop coming.
+	struct Counter
+	{
+		std::atomic<std::uint64_t> events = { 0 };
+		std::atomic<std::int64_t> last = { 0 };
+
+		void operator()()
+		{
+			events.fetch_add(1, std::memory_order_relaxed);
+			last.store(Clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+		}
+
+		// Waits until no callback has run for `quiet`, returns when the last one ran.
+		Clock::time_point wait_for_quiet(std::chrono::milliseconds quiet = std::chrono::milliseconds(200)) const
+		{
+			auto seen = events.load();
+			while (true) {
+				std::this_thread::sleep_for(quiet);
+				const auto now = events.load();
+				if (now == seen) {
+					return Clock::time_point(Clock::duration(last.load()));
+				}
+				seen = now;
+			}
+		}
+	};
+
+	void touch(const std::string& path, bool create)
+	{
+		const int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC | (create ? O_CREAT | O_TRUNC : O_APPEND), 0644);
+		if (fd >= 0) {
+			if (write(fd, "x", 1) < 0) {}
+			close(fd);
+		}
+	}
+
+	// Creates, modifies and deletes `files` files, every third one ending in .log so filters have something to drop.
+	std::uint64_t storm(const std::string& directory, std::size_t files)
+	{
+		std::vector<std::string> paths;
+		for (std::size_t i = 0; i < files; ++i) {
+			paths.push_back(directory + "/" + std::to_string(i) + (i % 3 == 2 ? ".log" : ".txt"));
+		}
+		for (const auto& path : paths) {
+			touch(path, true);
+		}
+		for (const auto& path : paths) {
+			touch(path, false);
+		}
+		for (const auto& path : paths) {
+			unlink(path.c_str());
+		}
+		// each create is a create and a modify, then a modify and a delete
+		return files * 4;
+	}
+
+	std::string make_directory(const Config& config, const std::string& name)
+	{
+		const auto directory = config.directory + "/filewatch_bench_" + name;
+		mkdir(directory.c_str(), 0755);
+		return directory;
+	}
+
+	Result storm_case(const Config& config, const std::string& name, filewatch::PathFilter<std::string> filter, filewatch::Options options = filewatch::Options())
+	{
+		const auto directory = make_directory(config, "storm");
+		Counter counter;
+		filewatch::FileWatch<std::string> watch(directory, filter, [&counter](const std::string&, const filewatch::Event) { counter(); }, options);
+
+		Result result;
+		result.name = name;
+		const auto start = Clock::now();
+		result.operations = storm(directory, config.files);
+		result.seconds = std::chrono::duration<double>(counter.wait_for_quiet() - start).count();
+		result.events = counter.events;
+		result.stats = watch.stats();
+		rmdir(directory.c_str());
+		return result;
+	}
+
+	Result single_file_case(const Config& config)
+	{
+		const auto directory = make_directory(config, "single");
+		const auto file = directory + "/watched.txt";
+		touch(file, true);
+		Counter counter;
+		filewatch::FileWatch<std::string> watch(file, [&counter](const std::string&, const filewatch::Event) { counter(); });
+
+		Result result;
+		result.name = "single_file/modify";
+		const auto start = Clock::now();
+		for (std::size_t i = 0; i < config.files; ++i) {
+			touch(file, false);
+			// a neighbour the watch has to ignore
+			touch(directory + "/other.txt", i == 0);
+		}
+		result.operations = config.files * 2;
+		result.seconds = std::chrono::duration<double>(counter.wait_for_quiet() - start).count();
+		result.events = counter.events;
+		result.stats = watch.stats();
+		unlink(file.c_str());
+		unlink((directory + "/other.txt").c_str());
+		rmdir(directory.c_str());
+		return result;
+	}
+
+	Result watchers_case(const Config& config, std::size_t watchers, bool shared_hub)
+	{
+		const auto directory = make_directory(config, "watchers");
+		Counter counter;
+		filewatch::Options options;
+		options.shared_hub = shared_hub;
+		std::vector<std::unique_ptr<filewatch::FileWatch<std::string>>> watches;
+		for (std::size_t i = 0; i < watchers; ++i) {
+			watches.emplace_back(new filewatch::FileWatch<std::string>(directory, [&counter](const std::string&, const filewatch::Event) { counter(); }, options));
+		}
+
+		Result result;
+		result.name = std::string("watchers/") + (shared_hub ? "shared_hub/" : "own_threads/") + std::to_string(watchers);
+		const auto start = Clock::now();
+		result.operations = storm(directory, config.files / watchers + 1);
+		result.seconds = std::chrono::duration<double>(counter.wait_for_quiet() - start).count();
+		result.events = counter.events;
+		// latency and queue figures of the first watcher stand in for all of them
+		result.stats = watches.front()->stats();
+		rmdir(directory.c_str());
+		return result;
+	}
+
+	// The pipeline alone: records come from a SyntheticEventSource, so no file system calls are timed.
+	Result synthetic_case(const Config& config, const std::string& name, filewatch::PathFilter<std::string> filter, bool batch)
+	{
+		const std::uint64_t total = config.files * 1000;
+		filewatch::Options options;
+		options.event_source = std::make_shared<filewatch::SyntheticEventSource>(std::vector<filewatch::SyntheticEventSource::Record>{
+			{ "src/main.txt", IN_CREATE },
+			{ "src/main.txt", IN_MODIFY },
+			{ "build/output_with_a_long_name.log", IN_MODIFY },
+			{ "src/main.txt", IN_DELETE },
+		}, total);
+
+		Counter counter;
+		std::unique_ptr<filewatch::FileWatch<std::string>> watch;
+		const auto start = Clock::now();
+		if (batch) {
+			watch.reset(new filewatch::FileWatch<std::string>(config.directory, filter, [&counter](const filewatch::EventBatch<std::string>& events) {
+				counter.events.fetch_add(events.size(), std::memory_order_relaxed);
+				counter.last.store(Clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+			}, options));
+		}
+		else {
+			watch.reset(new filewatch::FileWatch<std::string>(config.directory, filter, [&counter](const std::string&, const filewatch::Event) { counter(); }, options));
+		}
+
+		Result result;
+		result.name = name;
+		result.operations = total;
+		result.seconds = std::chrono::duration<double>(counter.wait_for_quiet() - start).count();
+		result.events = counter.events;
+		result.stats = watch->stats();
+		return result;
+	}
+
+	// The initial scan of a tree of `config.files` files spread over 64 directories, events are the entries found.
+	Result scan_case(const Config& config, bool stat_entries)
+	{
+		const auto directory = make_directory(config, "scan");
+		for (std::size_t i = 0; i < 64; ++i) {
+			mkdir((directory + "/" + std::to_string(i)).c_str(), 0755);
+		}
+		for (std::size_t i = 0; i < config.files; ++i) {
+			touch(directory + "/" + std::to_string(i % 64) + "/" + std::to_string(i) + ".txt", true);
+		}
+
+		Result result;
+		result.name = stat_entries ? "scan/stat" : "scan/types_only";
+		const auto start = Clock::now();
+		for (auto round = 0; round < 10; ++round) {
+			result.events += filewatch::DirectoryScanner<std::string>::index(directory, true, stat_entries).size();
+		}
+		result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+		result.operations = 10;
+
+		for (std::size_t i = 0; i < config.files; ++i) {
+			unlink((directory + "/" + std::to_string(i % 64) + "/" + std::to_string(i) + ".txt").c_str());
+		}
+		for (std::size_t i = 0; i < 64; ++i) {
+			rmdir((directory + "/" + std::to_string(i)).c_str());
+		}
+		rmdir(directory.c_str());
+		return result;
+	}
+
+	void write_json(std::ostream& out, const std::vector<Result>& results)
+	{
+		char date[64] = {};
+		const auto now = std::time(nullptr);
+		std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+
+		out << "{\n"
+			<< "  \"context\": {\n"
+			<< "    \"date\": \"" << date << "\",\n"
+			<< "    \"executable\": \"filewatch_bench\",\n"
+			<< "    \"num_cpus\": " << std::thread::hardware_concurrency() << "\n"
+			<< "  },\n"
+			<< "  \"benchmarks\": [";
+		for (std::size_t i = 0; i < results.size(); ++i) {
+			const auto& result = results[i];
+			const auto& stats = result.stats;
+			out << (i ? ",\n" : "\n")
+				<< "    {\n"
+				<< "      \"name\": \"" << result.name << "\",\n"
+				<< "      \"iterations\": 1,\n"
+				<< "      \"real_time\": " << result.seconds * 1e3 << ",\n"
+				<< "      \"time_unit\": \"ms\",\n"
+				<< "      \"operations\": " << result.operations << ",\n"
+				<< "      \"events\": " << result.events << ",\n"
+				<< "      \"items_per_second\": " << (result.seconds > 0 ? result.events / result.seconds : 0) << ",\n"
+				<< "      \"latency_p50_ns\": " << stats.latency.percentile(0.5) << ",\n"
+				<< "      \"latency_p99_ns\": " << stats.latency.percentile(0.99) << ",\n"
+				<< "      \"latency_p999_ns\": " << stats.latency.percentile(0.999) << ",\n"
+				<< "      \"events_filtered\": " << stats.events_filtered << ",\n"
+				<< "      \"queue_high_water\": " << stats.queue_high_water << ",\n"
+				<< "      \"queue_full_waits\": " << stats.queue_full_waits << ",\n"
+				<< "      \"overflows\": " << stats.overflows << "\n"
+				<< "    }";
+		}
+		out << "\n  ]\n}\n";
+	}
+
+	bool starts_with(const std::string& text, const std::string& prefix)
+	{
+		return text.compare(0, prefix.size(), prefix) == 0;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	Config config;
+	struct stat statbuf = {};
+	if (stat(config.directory.c_str(), &statbuf) != 0) {
+		config.directory = "/tmp";
+	}
+	for (int i = 1; i < argc; ++i) {
+		const std::string arg = argv[i];
+		if (starts_with(arg, "--filter=")) {
+			config.filter = arg.substr(9);
+		}
+		else if (starts_with(arg, "--dir=")) {
+			config.directory = arg.substr(6);
+		}
+		else if (starts_with(arg, "--out=")) {
+			config.out = arg.substr(6);
+		}
+		else if (starts_with(arg, "--files=")) {
+			config.files = std::stoul(arg.substr(8));
+		}
+		else {
+			std::cerr << "usage: " << argv[0] << " [--filter=<substring>] [--files=<count>] [--dir=<directory>] [--out=<file.json>]" << std::endl;
+			return 1;
+		}
+	}
+
+	typedef filewatch::PathFilter<std::string> Filter;
+	const std::vector<std::pair<std::string, std::function<Result()>>> cases = {
+		{ "storm/match_all", [&] { return storm_case(config, "storm/match_all", Filter()); } },
+		{ "storm/std_regex", [&] { return storm_case(config, "storm/std_regex", std::regex(".*\\.txt")); } },
+		{ "storm/compiled_regex", [&] { return storm_case(config, "storm/compiled_regex", Filter::compile(".*\\.txt")); } },
+		{ "storm/extensions", [&] { return storm_case(config, "storm/extensions", Filter::extensions({ "txt" })); } },
+		{ "storm/epoll", [&] {
+			filewatch::Options options;
+			options.use_io_uring = false;
+			return storm_case(config, "storm/epoll", Filter(), options);
+		} },
+		{ "storm/coalesced", [&] {
+			filewatch::Options options;
+			options.coalesce_window = std::chrono::milliseconds(10);
+			return storm_case(config, "storm/coalesced", Filter(), options);
+		} },
+		{ "single_file/modify", [&] { return single_file_case(config); } },
+		{ "synthetic/match_all", [&] { return synthetic_case(config, "synthetic/match_all", Filter(), false); } },
+		{ "synthetic/match_all/batch", [&] { return synthetic_case(config, "synthetic/match_all/batch", Filter(), true); } },
+		{ "synthetic/std_regex", [&] { return synthetic_case(config, "synthetic/std_regex", std::regex(".*\\.txt"), false); } },
+		{ "synthetic/compiled_regex", [&] { return synthetic_case(config, "synthetic/compiled_regex", Filter::compile(".*\\.txt"), false); } },
+		{ "synthetic/extensions", [&] { return synthetic_case(config, "synthetic/extensions", Filter::extensions({ "txt" }), false); } },
+		{ "scan/stat", [&] { return scan_case(config, true); } },
+		{ "scan/types_only", [&] { return scan_case(config, false); } },
+		{ "watchers/own_threads/8", [&] { return watchers_case(config, 8, false); } },
+		{ "watchers/shared_hub/8", [&] { return watchers_case(config, 8, true); } },
+		{ "watchers/shared_hub/256", [&] { return watchers_case(config, 256, true); } },
+	};
+
+	std::vector<Result> results;
+	for (const auto& bench : cases) {
+		if (bench.first.find(config.filter) == std::string::npos) {
+			continue;
+		}
+		results.push_back(bench.second());
+		const auto& result = results.back();
+		std::cerr << result.name << ": " << static_cast<std::uint64_t>(result.seconds > 0 ? result.events / result.seconds : 0) << " events/s, p99 "
+			<< result.stats.latency.percentile(0.99) << "ns" << std::endl;
+	}
+
+	if (config.out.empty()) {
+		write_json(std::cout, results);
+	}
+	else {
+		std::ofstream out(config.out);
+		write_json(out, results);
+	}
+	return 0;
+}
@@ -25,7 +25,14 @@ using test_regex = std::regex;
 #include <mutex>
 #include <vector>
 #include <set>
+#include <map>
+#include <condition_variable>
 #include <thread>
+#include <memory>
+#include <atomic>
+#if __unix__
+#include <poll.h>
+#endif
 
 TEST_CASE("watch for file add", "[added]") {
 	const auto test_folder_path = testhelper::cross_platform_string("./");
@@ -163,4 +170,1681 @@ TEST_CASE("regex", "[regex]") {
 //	auto path = testhelper::get_with_timeout(future);
 //	REQUIRE(path == test_file_name);
 //}
-#endif
\ No newline at end of file
+#endif
+#if __unix__
+TEST_CASE("recursive", "[recursive]") {
+	const auto test_folder_path = testhelper::cross_platform_string("./recursive_test");
+	const auto nested_file_name = testhelper::cross_platform_string("a/b/test.txt");
+	const auto new_file_name = testhelper::cross_platform_string("c/test.txt");
+	testhelper::make_directories(test_folder_path + "/a/b");
+
+	std::mutex mutex;
+	std::set<test_string> seen;
+	std::promise<void> promise;
+	std::future<void> future = promise.get_future();
+
+	filewatch::Options options;
+	options.recursive = true;
+	{
+		filewatch::FileWatch<test_string> watch(test_folder_path, [&](const test_string& path, const filewatch::Event change_type) {
+			std::lock_guard<std::mutex> lock(mutex);
+			if (change_type == filewatch::Event::added && seen.insert(path).second && seen.count(nested_file_name) && seen.count(new_file_name)) {
+				promise.set_value();
+			}
+		}, options);
+
+		const auto nested_file_path = test_folder_path + "/" + nested_file_name;
+		testhelper::create_and_modify_file(nested_file_path);
+		// a directory created after the watch started must be picked up, along with anything made in it straight away
+		testhelper::make_directories(test_folder_path + "/c");
+		const auto new_file_path = test_folder_path + "/" + new_file_name;
+		testhelper::create_and_modify_file(new_file_path);
+
+		testhelper::get_with_timeout(future);
+	}
+	testhelper::remove_all(test_folder_path);
+}
+#endif
+
+#if __unix__
+TEST_CASE("shared hub", "[shared-hub]") {
+	const auto test_folder_path = testhelper::cross_platform_string("./hub_test");
+	const auto test_file_name = testhelper::cross_platform_string("test.txt");
+	testhelper::make_directories(test_folder_path);
+	const auto watcher_count = 16u;
+	const auto threads_before = testhelper::thread_count();
+
+	std::mutex mutex;
+	std::size_t triggered = 0;
+	std::promise<void> promise;
+	std::future<void> future = promise.get_future();
+
+	filewatch::Options options;
+	options.shared_hub = true;
+	{
+		std::vector<std::unique_ptr<filewatch::FileWatch<test_string>>> watches;
+		for (auto i = 0u; i < watcher_count; ++i) {
+			watches.emplace_back(new filewatch::FileWatch<test_string>(test_folder_path, [&](const test_string& path, const filewatch::Event change_type) {
+				std::lock_guard<std::mutex> lock(mutex);
+				if (path == test_file_name && change_type == filewatch::Event::added && ++triggered == watcher_count) {
+					promise.set_value();
+				}
+			}, options));
+		}
+		// one reactor and one dispatch thread, however many watchers there are
+		REQUIRE(testhelper::thread_count() <= threads_before + 2);
+
+		const auto test_file_path = test_folder_path + "/" + test_file_name;
+		testhelper::create_and_modify_file(test_file_path);
+		testhelper::get_with_timeout(future);
+	}
+	testhelper::remove_all(test_folder_path);
+}
+
+TEST_CASE("a held hub client doesn't hold up the others", "[shared-hub]") {
+	const auto test_folder_path = testhelper::cross_platform_string("./hub_hold_test");
+	const auto held_folder_path = test_folder_path + "/held";
+	const auto live_folder_path = test_folder_path + "/live";
+	testhelper::remove_all(test_folder_path);
+	testhelper::make_directories(held_folder_path);
+	testhelper::make_directories(live_folder_path);
+
+	class Recorder : public filewatch::InotifyHub::Client
+	{
+	public:
+		void on_event(const struct inotify_event* event) override
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (event->len) {
+				_names.push_back(event->name);
+			}
+			_changed.notify_all();
+		}
+		void on_read_end() override {}
+		void on_timeout() override {}
+		void dispatch() override {}
+		void on_error(std::exception_ptr) override {}
+
+		std::vector<std::string> wait_for(std::size_t count)
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_changed.wait_for(lock, testhelper::config::test_timeout(1), [this, count] { return _names.size() >= count; });
+			return _names;
+		}
+
+	private:
+		std::mutex _mutex = {};
+		std::condition_variable _changed = {};
+		std::vector<std::string> _names = {};
+	};
+	// declared first, so the hub and its threads are gone before they are
+	Recorder held;
+	Recorder live;
+	filewatch::InotifyHub hub(false);
+
+	hub.hold(&held);
+	REQUIRE(hub.add_watch(&held, held_folder_path.c_str(), IN_CREATE) >= 0);
+	REQUIRE(hub.add_watch(&live, live_folder_path.c_str(), IN_CREATE) >= 0);
+	const auto first_file_path = held_folder_path + "/first.txt";
+	const auto live_file_path = live_folder_path + "/live.txt";
+	const auto second_file_path = held_folder_path + "/second.txt";
+	testhelper::create_and_modify_file(first_file_path);
+	testhelper::create_and_modify_file(live_file_path);
+	REQUIRE(live.wait_for(1) == std::vector<std::string>{ "live.txt" });
+	testhelper::create_and_modify_file(second_file_path);
+	REQUIRE(held.wait_for(0).empty());
+
+	// kept in order, and handed over once released
+	hub.release(&held);
+	REQUIRE(held.wait_for(2) == std::vector<std::string>{ "first.txt", "second.txt" });
+	hub.remove_client(&held);
+	hub.remove_client(&live);
+	testhelper::remove_all(test_folder_path);
+}
+
+TEST_CASE("a failing shared hub is reported in stats", "[shared-hub]") {
+	const auto test_folder_path = testhelper::cross_platform_string("./hub_error_test");
+	testhelper::remove_all(test_folder_path);
+	testhelper::make_directories(test_folder_path);
+
+	filewatch::Options options;
+	options.shared_hub = true;
+	options.use_io_uring = false;
+	const auto epolls_before = testhelper::epoll_descriptors();
+	{
+		filewatch::FileWatch<test_string> first(test_folder_path, [](const test_string&, const filewatch::Event) {}, options);
+		filewatch::FileWatch<test_string> second(test_folder_path, [](const test_string&, const filewatch::Event) {}, options);
+
+		// the hub's epoll is the only new one, swap it for a descriptor epoll_wait() refuses
+		auto epolls = testhelper::epoll_descriptors();
+		epolls.erase(std::remove_if(epolls.begin(), epolls.end(), [&epolls_before](int fd) {
+			return std::find(epolls_before.begin(), epolls_before.end(), fd) != epolls_before.end();
+		}), epolls.end());
+		REQUIRE(epolls.size() == 1);
+		const int null = open("/dev/null", O_RDONLY | O_CLOEXEC);
+		REQUIRE(dup2(null, epolls.front()) == epolls.front());
+		close(null);
+		// wakes the reactor from the epoll_wait() it is in, the next one fails
+		const auto test_file_path = test_folder_path + "/test.txt";
+		testhelper::create_and_modify_file(test_file_path);
+
+		const auto deadline = std::chrono::steady_clock::now() + testhelper::config::test_timeout(1);
+		while ((!first.stats().reader_error || !second.stats().reader_error) && std::chrono::steady_clock::now() < deadline) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		for (const auto& error : { first.stats().reader_error, second.stats().reader_error }) {
+			REQUIRE(error);
+			try {
+				std::rethrow_exception(error);
+			}
+			catch (const std::system_error& thrown) {
+				REQUIRE(thrown.code().value() == EINVAL);
+			}
+		}
+
+		// a watcher created afterwards gets a hub of its own
+		std::promise<void> promise;
+		std::future<void> future = promise.get_future();
+		std::atomic<bool> done{ false };
+		filewatch::FileWatch<test_string> later(test_folder_path, [&](const test_string& path, const filewatch::Event) {
+			if (path == "later.txt" && !done.exchange(true)) {
+				promise.set_value();
+			}
+		}, options);
+		const auto later_file_path = test_folder_path + "/later.txt";
+		testhelper::create_and_modify_file(later_file_path);
+		testhelper::get_with_timeout(future);
+		REQUIRE_FALSE(later.stats().reader_error);
+	}
+	testhelper::remove_all(test_folder_path);
+}
+#endif
+
+#if __unix__
+TEST_CASE("full queue waits for callbacks", "[queue]") {
+	const auto test_folder_path = testhelper::cross_platform_string("./queue_test");
+	testhelper::make_directories(test_folder_path);
+	const auto file_count = 64u;
+
+	std::mutex mutex;
+	std::set<test_string> seen;
+	std::promise<void> promise;
+	std::future<void> future = promise.get_future();
+
+	filewatch::Options options;
+	options.queue_capacity = 4;
+	{
+		filewatch::FileWatch<test_string> watch(test_folder_path, [&](const test_string& path, const filewatch::Event change_type) {
+			// slow callbacks keep the queue full, nothing may be lost while the reader waits
+			std::this_thread::sleep_for(std::chrono::microseconds(200));
+			std::lock_guard<std::mutex> lock(mutex);
+			if (change_type == filewatch::Event::added && seen.insert(path).second && seen.size() == file_count) {
+				promise.set_value();
+			}
+		}, options);
+
+		for (auto i = 0u; i < file_count; ++i) {
+			const auto test_file_path = test_folder_path + "/" + std::to_string(i) + ".txt";
+			testhelper::create_and_modify_file(test_file_path);
+		}
+		testhelper::get_with_timeout(future);
+	}
+	testhelper::remove_all(test_folder_path);
+}
+#endif
+
+#if __unix__
+TEST_CASE("queue full policies", "[queue]") {
+	const auto test_folder_path = testhelper::cross_platform_string("./");
+	const std::size_t total = 64;
+	std::vector<filewatch::SyntheticEventSource::Record> records;
+	std::vector<test_string> names;
+	for (std::size_t i = 0; i < total; ++i) {
+		names.push_back((i < 10 ? "file0" : "file") + std::to_string(i) + ".txt");
+		records.push_back({ names.back(), IN_CREATE });
+	}
+
+	filewatch::Options options;
+	options.event_source = std::make_shared<filewatch::SyntheticEventSource>(records, total);
+	options.queue_capacity = 8;
+	SECTION("block") { options.queue_full_policy = filewatch::QueueFullPolicy::block; }
+	SECTION("drop oldest") { options.queue_full_policy = filewatch::QueueFullPolicy::drop_oldest; }
+	SECTION("drop newest") { options.queue_full_policy = filewatch::QueueFullPolicy::drop_newest; }
+	SECTION("rescan") { options.queue_full_policy = filewatch::QueueFullPolicy::rescan; }
+
+	// the callbacks are stuck until the reader has read everything, or is waiting for them
+	std::mutex mutex;
+	std::condition_variable opened;
+	bool open = false;
+	std::vector<std::pair<test_string, filewatch::Event>> seen;
+	filewatch::FileWatch<test_string> watch(test_folder_path, [&](const test_string& path, const filewatch::Event change_type) {
+		std::unique_lock<std::mutex> lock(mutex);
+		opened.wait(lock, [&] { return open; });
+		seen.emplace_back(path, change_type);
+	}, options);
+
+	const auto wait_until = [](std::function<bool()> done) {
+		for (int i = 0; i < 500 && !done(); ++i) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		REQUIRE(done());
+	};
+	wait_until([&] { const auto stats = watch.stats(); return stats.events_read == total || stats.queue_full_waits > 0; });
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		open = true;
+	}
+	opened.notify_all();
+
+	const auto delivered = [&] { std::lock_guard<std::mutex> lock(mutex); return seen.size(); };
+	const auto in_order = [&] {
+		std::lock_guard<std::mutex> lock(mutex);
+		for (std::size_t i = 1; i < seen.size(); ++i) {
+			if (seen[i].second != filewatch::Event::rescan && !(seen[i - 1].first < seen[i].first)) {
+				return false;
+			}
+		}
+		return true;
+	};
+	switch (options.queue_full_policy) {
+	case filewatch::QueueFullPolicy::block:
+		wait_until([&] { return delivered() == total; });
+		REQUIRE(watch.stats().queue_full_waits > 0);
+		break;
+	case filewatch::QueueFullPolicy::drop_oldest:
+		// the newest make it
+		wait_until([&] { return delivered() + watch.stats().events_dropped_oldest == total; });
+		REQUIRE(watch.stats().events_dropped_oldest > 0);
+		REQUIRE(seen.back().first == names.back());
+		break;
+	case filewatch::QueueFullPolicy::drop_newest:
+		wait_until([&] { return delivered() + watch.stats().events_dropped_newest == total; });
+		REQUIRE(watch.stats().events_dropped_newest > 0);
+		REQUIRE(seen.front().first == names.front());
+		REQUIRE(seen.back().first == names[seen.size() - 1]);
+		break;
+	case filewatch::QueueFullPolicy::rescan:
+		// nothing to rescan behind a synthetic source, so a marker says it is needed
+		wait_until([&] { std::lock_guard<std::mutex> lock(mutex); return !seen.empty() && seen.back().second == filewatch::Event::rescan; });
+		REQUIRE(watch.stats().queue_rescans == 1);
+		REQUIRE(seen.back().first.empty());
+		REQUIRE(seen.front().first == names.front());
+		break;
+	}
+	REQUIRE(in_order());
+	REQUIRE(watch.stats().events_dispatched == delivered());
+}
+
+TEST_CASE("a collapsed queue is caught up by a rescan", "[queue]") {
+	const auto test_folder_path = testhelper::cross_platform_string("./collapse_test");
+	testhelper::remove_all(test_folder_path);
+	testhelper::make_directories(test_folder_path);
+	const auto file_count = 64u;
+
+	filewatch::Options options;
+	options.queue_capacity = 4;
+	options.queue_full_policy = filewatch::QueueFullPolicy::rescan;
+	// with a snapshot to compare with, the rescan reports each file that was added
+	options.rescan_on_overflow = true;
+	SECTION("own threads") {}
+	SECTION("shared hub") { options.shared_hub = true; }
+
+	std::mutex mutex;
+	std::set<test_string> added;
+	std::promise<void> promise;
+	std::future<void> future = promise.get_future();
+	{
+		filewatch::FileWatch<test_string> watch(test_folder_path, [&](const test_string& path, const filewatch::Event change_type) {
+			// slow enough for the queue to fill up
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			std::lock_guard<std::mutex> lock(mutex);
+			if (change_type == filewatch::Event::added && added.insert(path).second && added.size() == file_count) {
+				promise.set_value();
+			}
+		}, options);
+
+		for (auto i = 0u; i < file_count; ++i) {
+			const auto test_file_path = test_folder_path + "/" + std::to_string(i) + ".txt";
+			testhelper::create_and_modify_file(test_file_path);
+		}
+		testhelper::get_with_timeout(future);
+		REQUIRE(watch.stats().queue_rescans > 0);
+	}
+	testhelper::remove_all(test_folder_path);
+}
+#endif
+
+TEST_CASE("batch callback", "[batch]") {
+	const auto test_folder_path = testhelper::cross_platform_string("./");
+	const auto test_file_name = testhelper::cross_platform_string("test.txt");
+
+	std::promise<test_string> promise;
+	std::future<test_string> future = promise.get_future();
+	std::atomic<bool> done{ false };
+	filewatch::FileWatch<test_string> watch(test_folder_path, [&promise, &done](const filewatch::EventBatch<test_string>& events) {
+		for (const auto& event : events) {
+			if (!done.exchange(true)) {
+				promise.set_value(event.path());
+			}
+		}
+	});
+
+	testhelper::create_and_modify_file(test_file_name);
+
+	auto path = testhelper::get_with_timeout(future);
+	REQUIRE(path == test_file_name);
+}
+
+TEST_CASE("compiled filters match like std::regex", "[filter]") {
+	const std::vector<std::string> patterns = {
+		".*", "test.*", ".*\\.cpp", "^[a-z]+\\.(h|hpp|cpp)$", "file_[0-9]{2,3}\\.log", "(foo|bar)+baz?", "[^._][\\w-]*", "a.c", "\\d+\\s?x", "[]", "(?:ab)*c{0,2}"
+	};
+	const std::vector<std::string> paths = {
+		"", "test.txt", "test", "main.cpp", "sub/main.cpp", "a.hpp", "A.hpp", "file_12.log", "file_1234.log", "foobarbaz", "fooba",
+		"_hidden", "name-1", ".dot", "abc", "a\nc", "12 x", "12x", "ababcc", "ababccc", "\xc3\xa9.cpp"
+	};
+	for (const auto& pattern : patterns) {
+		const auto filter = filewatch::PathFilter<std::string>::compile(pattern);
+		REQUIRE(filter.is_compiled());
+		const std::regex regex(pattern);
+		for (const auto& path : paths) {
+			INFO(pattern << " against " << path);
+			REQUIRE(filter.match(path) == std::regex_match(path, regex));
+		}
+	}
+
+	// back references can't be compiled, they fall back to std::regex
+	const auto fallback = filewatch::PathFilter<std::string>::compile("(a)\\1");
+	REQUIRE_FALSE(fallback.is_compiled());
+	REQUIRE(fallback.match("aa"));
+
+	const auto globs = filewatch::PathFilter<std::string>::globs({ "*.cpp", "src/**/*.h", "data_?.[!t]*" });
+	REQUIRE(globs.match("main.cpp"));
+	REQUIRE_FALSE(globs.match("sub/main.cpp"));
+	REQUIRE(globs.match("src/a.h"));
+	REQUIRE(globs.match("src/a/b/c.h"));
+	REQUIRE(globs.match("data_1.bin"));
+	REQUIRE_FALSE(globs.match("data_1.txt"));
+
+	// a ] straight after the [ is part of the class, and a class that is never closed is literal
+	const auto brackets = filewatch::PathFilter<std::string>::globs({ "[]]", "x[]a]", "[!]" });
+	REQUIRE(brackets.match("]"));
+	REQUIRE(brackets.match("x]"));
+	REQUIRE(brackets.match("xa"));
+	REQUIRE(brackets.match("[!]"));
+	REQUIRE_FALSE(brackets.match("a"));
+	REQUIRE(filewatch::PathFilter<std::string>::globs({ "[]" }).match("[]"));
+	REQUIRE(filewatch::PathFilter<std::string>::globs({ "[a" }).match("[a"));
+	REQUIRE_FALSE(filewatch::PathFilter<std::string>::globs({ "[a" }).match("a"));
+
+	const auto extensions = filewatch::PathFilter<std::string>::extensions({ "cpp", ".h" });
+	REQUIRE(extensions.match("sub/main.cpp"));
+	REQUIRE(extensions.match("main.h"));
+	REQUIRE_FALSE(extensions.match("main.hpp"));
+	REQUIRE_FALSE(extensions.match("cpp"));
+	REQUIRE_FALSE(extensions.match("sub.cpp/file"));
+}
+
+TEST_CASE("coalescer merges changes to a path", "[coalesce]") {
+	using clock = filewatch::Coalescer<std::string>::Clock;
+	const auto window = std::chrono::milliseconds(10);
+	const auto start = clock::now();
+	filewatch::Coalescer<std::string> coalescer(window);
+	std::vector<filewatch::FileEvent<std::string>> ready;
+
+	coalescer.add("a", filewatch::Event::added, start);
+	coalescer.add("b", filewatch::Event::modified, start);
+	coalescer.add("a", filewatch::Event::modified, start);
+	coalescer.add("c", filewatch::Event::added, start);
+	coalescer.add("c", filewatch::Event::removed, start);
+	coalescer.add("b", filewatch::Event::removed, start);
+	coalescer.add("d", filewatch::Event::removed, start);
+	coalescer.add("d", filewatch::Event::added, start);
+	REQUIRE(coalescer.take_due(start, ready) == 0);
+
+	// "a" starts a new window once the first has been delivered
+	REQUIRE(coalescer.take_due(start + window, ready) == 3);
+	coalescer.add("a", filewatch::Event::modified, start + window);
+	REQUIRE(ready[0].path() == "a");
+	REQUIRE(ready[0].type() == filewatch::Event::added);
+	REQUIRE(ready[1].path() == "b");
+	REQUIRE(ready[1].type() == filewatch::Event::removed);
+	REQUIRE(ready[2].path() == "d");
+	REQUIRE(ready[2].type() == filewatch::Event::modified);
+	REQUIRE(coalescer.next_deadline() == start + window * 2);
+	REQUIRE(coalescer.take_due(start + window * 2, ready) == 1);
+	REQUIRE(ready[0].type() == filewatch::Event::modified);
+	REQUIRE(coalescer.empty());
+
+	// renames are never merged
+	coalescer.add("e", filewatch::Event::renamed_old, start);
+	coalescer.add("e", filewatch::Event::renamed_new, start);
+	coalescer.add("e", filewatch::Event::modified, start);
+	REQUIRE(coalescer.take_due(start + window, ready) == 3);
+	REQUIRE(ready[0].type() == filewatch::Event::renamed_old);
+	REQUIRE(ready[1].type() == filewatch::Event::renamed_new);
+	REQUIRE(ready[2].type() == filewatch::Event::modified);
+}
+
+#if __unix__
+TEST_CASE("coalesce window", "[coalesce]") {
+	const auto test_folder_path = testhelper::cross_platform_string("./coalesce_test");
+	const auto test_file_name = testhelper::cross_platform_string("test.txt");
+	testhelper::make_directories(test_folder_path);
+
+	filewatch::Options options;
+	options.coalesce_window = std::chrono::milliseconds(100);
+	SECTION("own threads") {}
+	SECTION("shared hub") { options.shared_hub = true; }
+
+	std::mutex mutex;
+	std::vector<std::pair<test_string, filewatch::Event>> seen;
+	std::promise<void> promise;
+	std::future<void> future = promise.get_future();
+	{
+		filewatch::FileWatch<test_string> watch(test_folder_path, [&](const test_string& path, const filewatch::Event change_type) {
+			std::lock_guard<std::mutex> lock(mutex);
+			seen.emplace_back(path, change_type);
+			if (seen.size() == 1) {
+				promise.set_value();
+			}
+		}, options);
+
+		const auto test_file_path = test_folder_path + "/" + test_file_name;
+		testhelper::create_and_modify_file(test_file_path);
+		testhelper::get_with_timeout(future);
+		std::this_thread::sleep_for(options.coalesce_window * 2);
+	}
+	REQUIRE(seen.size() == 1);
+	REQUIRE(seen[0].first == test_file_name);
+	REQUIRE(seen[0].second == filewatch::Event::added);
+	testhelper::remove_all(test_folder_path);
+}
+#endif
+
+TEST_CASE("interned paths", "[interned]") {
+	filewatch::InternedPaths<std::string> paths;
+	const auto passes = [](const std::string& path) { return path != "dir/skip"; };
+	REQUIRE(paths.find(1, "name", 4) == nullptr);
+
+	const auto& first = paths.insert(1, "name", 4, [] { return std::string("dir/name"); }, passes);
+	const auto& skipped = paths.insert(1, "skip", 4, [] { return std::string("dir/skip"); }, passes);
+	REQUIRE(first.path == "dir/name");
+	REQUIRE(first.passes);
+	REQUIRE_FALSE(skipped.passes);
+	REQUIRE(paths.find(1, "name", 4) == &first);
+	REQUIRE(paths.find(2, "name", 4) == nullptr);
+	REQUIRE(paths.find(1, "nam", 3) == nullptr);
+
+	// growing the table must not move what events point at
+	for (int i = 0; i < 1000; ++i) {
+		const auto name = std::to_string(i);
+		paths.insert(3, name.c_str(), name.size(), [&name] { return name; }, passes);
+	}
+	REQUIRE(paths.find(1, "name", 4) == &first);
+	REQUIRE(paths.find(3, "999", 3)->path == "999");
+
+	// a reused descriptor must not find the old entries, which stay alive for queued events
+	paths.forget(1);
+	REQUIRE(paths.find(1, "name", 4) == nullptr);
+	REQUIRE(first.path == "dir/name");
+	const auto& again = paths.insert(1, "name", 4, [] { return std::string("other/name"); }, passes);
+	REQUIRE(paths.find(1, "name", 4) == &again);
+	// other descriptors keep theirs, and so does the reused one through another rehash
+	REQUIRE(paths.find(3, "999", 3)->path == "999");
+	const auto size = paths.size();
+	for (int i = 0; i < 1000; ++i) {
+		const auto name = std::to_string(i);
+		paths.insert(4, name.c_str(), name.size(), [&name] { return name; }, passes);
+	}
+	REQUIRE(paths.find(1, "name", 4) == &again);
+	REQUIRE(paths.find(1, "skip", 4) == nullptr);
+	REQUIRE(paths.find(3, "0", 1)->path == "0");
+	REQUIRE(paths.size() == size + 1000);
+}
+
+#if __unix__
+TEST_CASE("kernel queue overflow is caught up by a rescan", "[overflow]") {
+	const auto test_folder_path = testhelper::cross_platform_string("./overflow_test");
+	testhelper::make_directories(test_folder_path);
+	// every file is a create and a modify, so this is more than the kernel will queue
+	const auto file_count = testhelper::max_queued_events() / 2 + 256;
+
+	filewatch::Options options;
+	options.queue_capacity = 4;
+	options.rescan_on_overflow = true;
+	SECTION("own threads") {}
+	SECTION("shared hub") { options.shared_hub = true; }
+
+	std::mutex mutex;
+	std::set<test_string> seen;
+	std::promise<void> release;
+	std::shared_future<void> released = release.get_future().share();
+	std::promise<void> promise;
+	std::future<void> future = promise.get_future();
+	{
+		filewatch::FileWatch<test_string> watch(test_folder_path, [&](const test_string& path, const filewatch::Event change_type) {
+			// hold the reader up until the kernel has had to drop events
+			released.wait();
+			std::lock_guard<std::mutex> lock(mutex);
+			if (change_type == filewatch::Event::added && seen.insert(path).second && seen.size() == file_count) {
+				promise.set_value();
+			}
+		}, options);
+
+		for (auto i = 0u; i < file_count; ++i) {
+			const auto test_file_path = test_folder_path + "/" + std::to_string(i) + ".txt";
+			testhelper::create_and_modify_file(test_file_path);
+		}
+		release.set_value();
+		testhelper::get_with_timeout(future);
+	}
+	testhelper::remove_all(test_folder_path);
+}
+#endif
+
+#if __unix__
+TEST_CASE("directory scanner", "[overflow]") {
+	const auto test_folder_path = testhelper::cross_platform_string("./scan_test");
+	for (const auto& directory : { "/a/b", "/c", "/d/e/f" }) {
+		testhelper::make_directories(test_folder_path + directory);
+	}
+	for (const auto& file : { "/1.txt", "/a/b/2.txt", "/d/e/f/3.txt" }) {
+		const auto test_file_path = test_folder_path + file;
+		testhelper::create_and_modify_file(test_file_path);
+	}
+
+	std::set<std::string> paths;
+	for (const auto& entry : filewatch::DirectoryScanner<std::string>::scan(test_folder_path, true)) {
+		REQUIRE(entry.second.directory == (entry.first.find(".txt") == std::string::npos));
+		paths.insert(entry.first);
+	}
+	REQUIRE(paths == std::set<std::string>{ "1.txt", "a", "a/b", "a/b/2.txt", "c", "d", "d/e", "d/e/f", "d/e/f/3.txt" });
+	REQUIRE(filewatch::DirectoryScanner<std::string>::scan(test_folder_path, false).size() == 4);
+
+	// without stat() the types still come from the listing
+	for (const auto& entry : filewatch::DirectoryScanner<std::string>::scan(test_folder_path, true, false)) {
+		REQUIRE(entry.second.directory == (entry.first.find(".txt") == std::string::npos));
+		REQUIRE(entry.second.inode != 0);
+	}
+	testhelper::remove_all(test_folder_path);
+}
+#endif
+
+TEST_CASE("snapshot index", "[overflow]") {
+	typedef filewatch::SnapshotIndex<test_string> Index;
+	const auto state = [](std::uint64_t inode, std::int64_t size, bool directory) {
+		return Index::FileState{ inode, size, 0, directory, 0 };
+	};
+	const Index before(Index::Entries{
+		{ "b.txt", state(2, 10, false) },
+		{ "a", state(1, 0, true) },
+		{ "c.txt", state(3, 10, false) },
+		{ "d", state(4, 0, true) },
+	});
+	const Index after(Index::Entries{
+		{ "d", state(4, 0, false) },
+		{ "c.txt", state(3, 20, false) },
+		{ "a", state(1, 0, true) },
+		{ "a/e.txt", state(5, 1, false) },
+	});
+	REQUIRE(after.path(0) == "a");
+	REQUIRE(after.path(1) == "a/e.txt");
+	REQUIRE(after.find("c.txt") == 2);
+	REQUIRE(after.find("b.txt") == after.size());
+	REQUIRE(Index().find("a") == 0);
+
+	typedef std::pair<test_string, filewatch::Event> Change;
+	std::vector<Change> changes;
+	after.diff(before, [&changes](const test_string& path, filewatch::Event event) { changes.emplace_back(path, event); });
+	REQUIRE(changes == std::vector<Change>{
+		{ "a/e.txt", filewatch::Event::added },
+		{ "b.txt", filewatch::Event::removed },
+		{ "c.txt", filewatch::Event::modified },
+		{ "d", filewatch::Event::removed },
+		{ "d", filewatch::Event::added },
+	});
+}
+
+#if __unix__
+TEST_CASE("snapshot file", "[snapshot]") {
+	typedef filewatch::SnapshotIndex<test_string> Index;
+	const auto test_file_path = testhelper::cross_platform_string("./snapshot_test.bin");
+	const Index saved(Index::Entries{
+		{ "b.txt", Index::FileState{ 2, 10, 20, false, 30 } },
+		{ "a", Index::FileState{ 1, 0, 0, true, 0 } },
+	});
+	REQUIRE(saved.save(test_file_path, "/root", true));
+
+	Index loaded;
+	REQUIRE_FALSE(Index::load(test_file_path, "/other", true, loaded));
+	REQUIRE_FALSE(Index::load(test_file_path, "/root", false, loaded));
+	REQUIRE(loaded.empty());
+	REQUIRE(Index::load(test_file_path, "/root", true, loaded));
+	REQUIRE(loaded.size() == 2);
+	REQUIRE(loaded.path(1) == "b.txt");
+	REQUIRE(loaded.state(1).hash == 30);
+	loaded.diff(saved, [](const test_string&, filewatch::Event) { FAIL("a loaded snapshot differs"); });
+
+	// cut short, it must be refused rather than read past its end
+	REQUIRE(truncate(test_file_path.c_str(), 60) == 0);
+	REQUIRE_FALSE(Index::load(test_file_path, "/root", true, loaded));
+	std::remove(test_file_path.c_str());
+}
+
+TEST_CASE("catch up from a saved snapshot", "[snapshot]") {
+	const auto test_folder_path = testhelper::cross_platform_string("./catch_up_test");
+	const auto snapshot_path = testhelper::cross_platform_string("./catch_up_test.snapshot");
+	const auto kept_file_path = test_folder_path + "/kept.txt";
+	const auto removed_file_path = test_folder_path + "/removed.txt";
+	const auto added_file_path = test_folder_path + "/sub/added.txt";
+	const auto live_file_path = test_folder_path + "/live.txt";
+	testhelper::remove_all(test_folder_path);
+	testhelper::make_directories(test_folder_path + "/sub");
+	testhelper::create_and_modify_file(kept_file_path);
+	testhelper::create_and_modify_file(removed_file_path);
+
+	filewatch::Options options;
+	options.recursive = true;
+	options.snapshot_file = snapshot_path;
+	SECTION("own threads") {}
+	SECTION("shared hub") { options.shared_hub = true; }
+	SECTION("shared hub and an executor") {
+		// the catch up may be published before the constructor has returned
+		options.shared_hub = true;
+		options.executor = [](std::function<void()> task) { task(); };
+	}
+	SECTION("shared hub and callback threads") {
+		options.shared_hub = true;
+		options.callback_threads = 4;
+	}
+	std::remove(snapshot_path.c_str());
+
+	{
+		filewatch::FileWatch<test_string> watch(test_folder_path, [](const test_string&, const filewatch::Event) {}, options);
+	}
+	// while nobody is watching
+	std::ofstream(kept_file_path, std::ios::app) << "more" << std::endl;
+	REQUIRE(std::remove(removed_file_path.c_str()) == 0);
+	testhelper::create_and_modify_file(added_file_path);
+
+	typedef std::pair<test_string, filewatch::Event> Change;
+	std::mutex mutex;
+	std::vector<Change> seen;
+	std::promise<void> caught_up;
+	std::future<void> caught_up_future = caught_up.get_future();
+	std::promise<void> promise;
+	std::future<void> future = promise.get_future();
+	{
+		filewatch::FileWatch<test_string> watch(test_folder_path, [&](const test_string& path, const filewatch::Event change_type) {
+			std::lock_guard<std::mutex> lock(mutex);
+			seen.emplace_back(path, change_type);
+			if (seen.size() == 4) {
+				caught_up.set_value();
+			}
+			if (path == "live.txt" && change_type == filewatch::Event::added) {
+				promise.set_value();
+			}
+		}, options);
+		testhelper::get_with_timeout(caught_up_future);
+		testhelper::create_and_modify_file(live_file_path);
+		testhelper::get_with_timeout(future);
+	}
+	// the catch up comes first, in no particular order
+	REQUIRE(seen.size() >= 5);
+	REQUIRE(std::set<Change>(seen.begin(), seen.begin() + 4) == std::set<Change>{
+		{ "kept.txt", filewatch::Event::modified },
+		{ "removed.txt", filewatch::Event::removed },
+		{ "sub", filewatch::Event::modified },
+		{ "sub/added.txt", filewatch::Event::added },
+	});
+	REQUIRE(seen[4].first == "live.txt");
+	std::remove(snapshot_path.c_str());
+	testhelper::remove_all(test_folder_path);
+}
+
+TEST_CASE("catch up skips rewrites with the saved contents", "[snapshot]") {
+	const auto test_folder_path = testhelper::cross_platform_string("./catch_up_hash_test");
+	const auto snapshot_path = testhelper::cross_platform_string("./catch_up_hash_test.snapshot");
+	const auto same_file_path = test_folder_path + "/same.txt";
+	const auto changed_file_path = test_folder_path + "/changed.txt";
+	testhelper::remove_all(test_folder_path);
+	testhelper::make_directories(test_folder_path);
+	std::remove(snapshot_path.c_str());
+
+	filewatch::Options options;
+	options.snapshot_file = snapshot_path;
+	options.suppress_unchanged_writes = true;
+	const auto write = [](const test_string& path, const char* contents) {
+		std::ofstream file(path);
+		file << contents;
+	};
+
+	{
+		std::promise<void> promise;
+		std::future<void> future = promise.get_future();
+		std::atomic<int> closed = { 0 };
+		filewatch::FileWatch<test_string> watch(test_folder_path, [&](const test_string&, const filewatch::Event change_type) {
+			// each file is hashed when its close is handled, which reports it as modified
+			if (change_type == filewatch::Event::modified && ++closed == 2) {
+				promise.set_value();
+			}
+		}, options);
+		write(same_file_path, "same");
+		write(changed_file_path, "before");
+		testhelper::get_with_timeout(future);
+	}
+	// while nobody is watching, both are rewritten but only one differs
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	write(same_file_path, "same");
+	write(changed_file_path, "after");
+
+	std::mutex mutex;
+	std::vector<std::pair<test_string, filewatch::Event>> seen;
+	std::promise<void> promise;
+	std::future<void> future = promise.get_future();
+	{
+		filewatch::FileWatch<test_string> watch(test_folder_path, [&](const test_string& path, const filewatch::Event change_type) {
+			std::lock_guard<std::mutex> lock(mutex);
+			seen.emplace_back(path, change_type);
+			if (seen.size() == 1) {
+				promise.set_value();
+			}
+		}, options);
+		testhelper::get_with_timeout(future);
+		for (int i = 0; i < 300 && watch.stats().events_unchanged == 0; ++i) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		REQUIRE(watch.stats().events_unchanged == 1);
+	}
+	REQUIRE(seen == std::vector<std::pair<test_string, filewatch::Event>>{ { "changed.txt", filewatch::Event::modified } });
+	std::remove(snapshot_path.c_str());
+	testhelper::remove_all(test_folder_path);
+}
+#endif
+
+#if __unix__
+TEST_CASE("renames are paired", "[rename]") {
+	const auto test_folder_path = testhelper::cross_platform_string("./rename_test");
+	const auto outside_folder_path = testhelper::cross_platform_string("./rename_test_outside");
+	testhelper::make_directories(test_folder_path + "/directory");
+	testhelper::make_directories(outside_folder_path);
+	const auto old_file_path = test_folder_path + "/old.txt";
+	const auto nested_file_path = test_folder_path + "/directory/nested.txt";
+	testhelper::create_and_modify_file(old_file_path);
+	testhelper::create_and_modify_file(nested_file_path);
+
+	filewatch::Options options;
+	options.recursive = true;
+	SECTION("own threads") {}
+	SECTION("shared hub") { options.shared_hub = true; }
+
+	typedef std::pair<test_string, filewatch::Event> Change;
+	const std::vector<Change> expected = {
+		{ "old.txt", filewatch::Event::renamed_old },
+		{ "new.txt", filewatch::Event::renamed_new },
+		{ "directory", filewatch::Event::renamed_old },
+		{ "renamed", filewatch::Event::renamed_new },
+		{ "renamed/nested.txt", filewatch::Event::modified },
+		{ "new.txt", filewatch::Event::removed },
+	};
+	std::mutex mutex;
+	std::vector<Change> seen;
+	std::promise<void> promise;
+	std::future<void> future = promise.get_future();
+	{
+		filewatch::FileWatch<test_string> watch(test_folder_path, [&](const test_string& path, const filewatch::Event change_type) {
+			std::lock_guard<std::mutex> lock(mutex);
+			seen.emplace_back(path, change_type);
+			if (seen.size() == expected.size()) {
+				promise.set_value();
+			}
+		}, options);
+
+		REQUIRE(std::rename(old_file_path.c_str(), (test_folder_path + "/new.txt").c_str()) == 0);
+		REQUIRE(std::rename((test_folder_path + "/directory").c_str(), (test_folder_path + "/renamed").c_str()) == 0);
+		// the watch on the directory must now report its new name
+		std::ofstream(test_folder_path + "/renamed/nested.txt", std::ios::app) << "more" << std::endl;
+		// moved out of the watch, so the other half never arrives
+		REQUIRE(std::rename((test_folder_path + "/new.txt").c_str(), (outside_folder_path + "/new.txt").c_str()) == 0);
+
+		testhelper::get_with_timeout(future);
+	}
+	REQUIRE(seen == expected);
+	testhelper::remove_all(test_folder_path);
+	testhelper::remove_all(outside_folder_path);
+}
+#endif
+
+#if __unix__
+TEST_CASE("destroy after the watched directory is gone", "[shutdown]") {
+	const auto test_folder_path = testhelper::cross_platform_string("./shutdown_test");
+	testhelper::make_directories(test_folder_path);
+
+	auto destroyed = std::async(std::launch::async, [&]() {
+		filewatch::FileWatch<test_string> watch(test_folder_path, [](const test_string&, const filewatch::Event) {});
+		testhelper::remove_all(test_folder_path);
+		// there is no watch left to remove, destroying must not rely on one
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	});
+	REQUIRE(destroyed.wait_for(testhelper::config::test_timeout(1)) == std::future_status::ready);
+}
+#endif
+
+TEST_CASE("latency histogram buckets", "[stats]") {
+	using filewatch::LatencyHistogram;
+	for (std::uint64_t value : { 0ull, 1ull, 15ull, 16ull, 17ull, 1000ull, 123456789ull, ~0ull }) {
+		const auto bucket = LatencyHistogram::bucket_of(value);
+		REQUIRE(bucket < LatencyHistogram::bucket_count);
+		REQUIRE(value <= LatencyHistogram::upper_bound_of(bucket));
+		REQUIRE((bucket == 0 || value > LatencyHistogram::upper_bound_of(bucket - 1)));
+		// within an eighth of the value
+		REQUIRE(LatencyHistogram::upper_bound_of(bucket) - value <= value / 8);
+	}
+	REQUIRE(LatencyHistogram::bucket_of(~0ull) == LatencyHistogram::bucket_count - 1);
+	REQUIRE(LatencyHistogram().percentile(0.5) == 0);
+}
+
+TEST_CASE("stats", "[stats]") {
+	const auto test_folder_path = testhelper::cross_platform_string("./");
+	const auto test_file_name = testhelper::cross_platform_string("test.txt");
+	const auto ignored_file_name = testhelper::cross_platform_string("ignore.txt");
+
+	std::promise<void> promise;
+	std::future<void> future = promise.get_future();
+	std::atomic<bool> done{ false };
+	filewatch::FileWatch<test_string> watch(test_folder_path, std::regex(test_file_name), [&](const test_string&, const filewatch::Event) {
+		if (!done.exchange(true)) {
+			promise.set_value();
+		}
+	});
+
+	testhelper::create_and_modify_file(ignored_file_name);
+	testhelper::create_and_modify_file(test_file_name);
+	testhelper::get_with_timeout(future);
+
+	const auto stats = watch.stats();
+	REQUIRE(stats.events_read >= 2);
+	REQUIRE(stats.events_filtered >= 1);
+	REQUIRE(stats.events_dispatched >= 1);
+	REQUIRE(stats.queue_high_water >= 1);
+	REQUIRE(stats.latency.count() == stats.events_dispatched);
+	REQUIRE(stats.latency.percentile(1.0) >= stats.latency.percentile(0.5));
+}
+
+#if __unix__
+TEST_CASE("synthetic event source", "[synthetic]") {
+	const auto test_folder_path = testhelper::cross_platform_string("./");
+	const std::uint64_t total = 30000;
+	auto source = std::make_shared<filewatch::SyntheticEventSource>(std::vector<filewatch::SyntheticEventSource::Record>{
+		{ "a.txt", IN_CREATE },
+		{ "a.txt", IN_MODIFY },
+		{ "a_much_longer_name_than_the_small_string_buffer.log", IN_MODIFY },
+	}, total);
+
+	filewatch::Options options;
+	options.event_source = source;
+	std::mutex mutex;
+	std::size_t added = 0;
+	std::size_t modified = 0;
+	std::size_t unexpected = 0;
+	std::promise<void> promise;
+	std::future<void> future = promise.get_future();
+	filewatch::FileWatch<test_string> watch(test_folder_path, filewatch::PathFilter<test_string>::extensions({ "txt" }), [&](const test_string& path, const filewatch::Event change_type) {
+		std::lock_guard<std::mutex> lock(mutex);
+		unexpected += path != "a.txt";
+		(change_type == filewatch::Event::added ? added : modified)++;
+		if (added + modified == total / 3 * 2) {
+			promise.set_value();
+		}
+	}, options);
+
+	testhelper::get_with_timeout(future);
+	std::lock_guard<std::mutex> lock(mutex);
+	REQUIRE(unexpected == 0);
+	REQUIRE(added == total / 3);
+	REQUIRE(modified == total / 3);
+	REQUIRE(source->emitted() == total);
+	REQUIRE(watch.stats().events_filtered == total / 3);
+}
+
+TEST_CASE("a failing event source is reported in stats", "[synthetic]") {
+	// reads nothing once, then fails the way a broken descriptor would
+	class FailingSource : public filewatch::EventSource
+	{
+	public:
+		int add_watch(const char*, std::uint32_t) override { return 1; }
+		int remove_watch(int) override { return 0; }
+		ssize_t read(char*, std::size_t, int) override
+		{
+			if (_stopped) {
+				return -1;
+			}
+			if (_reads++ == 0) {
+				return 0;
+			}
+			throw std::system_error(EBADF, std::system_category());
+		}
+		void stop() override { _stopped = true; }
+
+	private:
+		std::atomic<bool> _stopped = { false };
+		int _reads = { 0 };
+	};
+
+	filewatch::Options options;
+	options.event_source = std::make_shared<FailingSource>();
+	filewatch::FileWatch<test_string> watch(testhelper::cross_platform_string("./"), [](const test_string&, const filewatch::Event) {}, options);
+	const auto deadline = std::chrono::steady_clock::now() + testhelper::config::test_timeout(1);
+	while (!watch.stats().reader_error && std::chrono::steady_clock::now() < deadline) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	const auto error = watch.stats().reader_error;
+	REQUIRE(error);
+	try {
+		std::rethrow_exception(error);
+	}
+	catch (const std::system_error& thrown) {
+		REQUIRE(thrown.code().value() == EBADF);
+	}
+}
+
+TEST_CASE("callback threads", "[threads]") {
+	const auto test_folder_path = testhelper::cross_platform_string("./");
+	filewatch::Options options;
+	options.callback_threads = 4;
+
+	SECTION("changes to a path stay in order") {
+		std::vector<filewatch::SyntheticEventSource::Record> records;
+		for (int i = 0; i < 16; ++i) {
+			const auto name = "file" + std::to_string(i) + ".txt";
+			records.push_back({ name, IN_CREATE });
+			records.push_back({ name, IN_MODIFY });
+			records.push_back({ name, IN_DELETE });
+		}
+		const std::uint64_t total = records.size() * 300;
+		options.event_source = std::make_shared<filewatch::SyntheticEventSource>(records, total);
+
+		std::mutex mutex;
+		std::map<test_string, filewatch::Event> last;
+		std::size_t seen = 0;
+		std::size_t out_of_order = 0;
+		std::promise<void> promise;
+		std::future<void> future = promise.get_future();
+		filewatch::FileWatch<test_string> watch(test_folder_path, [&](const test_string& path, const filewatch::Event change_type) {
+			std::lock_guard<std::mutex> lock(mutex);
+			const auto found = last.find(path);
+			const auto expected = found == last.end() || found->second == filewatch::Event::removed ? filewatch::Event::added
+				: found->second == filewatch::Event::added ? filewatch::Event::modified
+				: filewatch::Event::removed;
+			out_of_order += change_type != expected;
+			last[path] = change_type;
+			if (++seen == total) {
+				promise.set_value();
+			}
+		}, options);
+
+		testhelper::get_with_timeout(future);
+		std::lock_guard<std::mutex> lock(mutex);
+		REQUIRE(out_of_order == 0);
+		REQUIRE(watch.stats().events_dispatched == total);
+	}
+
+	SECTION("a slow path doesn't hold up the others") {
+		std::vector<filewatch::SyntheticEventSource::Record> records = { { "slow.txt", IN_CREATE } };
+		for (int i = 0; i < 16; ++i) {
+			records.push_back({ "fast" + std::to_string(i) + ".txt", IN_CREATE });
+		}
+		options.event_source = std::make_shared<filewatch::SyntheticEventSource>(records, records.size());
+
+		std::mutex mutex;
+		std::condition_variable fast_seen;
+		std::size_t fast = 0;
+		std::size_t fast_while_slow = 0;
+		std::promise<void> promise;
+		std::future<void> future = promise.get_future();
+		filewatch::FileWatch<test_string> watch(test_folder_path, [&](const test_string& path, const filewatch::Event) {
+			std::unique_lock<std::mutex> lock(mutex);
+			if (path == "slow.txt") {
+				// only the few paths sharing its shard wait behind it
+				fast_seen.wait_for(lock, std::chrono::seconds(5), [&] { return fast > 0; });
+				fast_while_slow = fast;
+			}
+			else {
+				++fast;
+				fast_seen.notify_all();
+			}
+			if (fast == records.size() - 1 && fast_while_slow > 0) {
+				promise.set_value();
+			}
+		}, options);
+
+		testhelper::get_with_timeout(future);
+		std::lock_guard<std::mutex> lock(mutex);
+		REQUIRE(fast_while_slow > 0);
+	}
+
+	SECTION("a callback throwing something other than std::exception doesn't stop its thread") {
+		std::vector<filewatch::SyntheticEventSource::Record> records;
+		for (int i = 0; i < 64; ++i) {
+			records.push_back({ "file" + std::to_string(i) + ".txt", IN_CREATE });
+		}
+		options.event_source = std::make_shared<filewatch::SyntheticEventSource>(records, records.size());
+
+		std::atomic<std::size_t> seen{ 0 };
+		std::promise<void> promise;
+		std::future<void> future = promise.get_future();
+		filewatch::FileWatch<test_string> watch(test_folder_path, [&](const filewatch::EventBatch<test_string>& events) {
+			if ((seen += events.size()) == records.size()) {
+				promise.set_value();
+			}
+			throw 42;
+		}, options);
+
+		testhelper::get_with_timeout(future);
+		REQUIRE(seen == records.size());
+	}
+}
+#endif
+
+#if __unix__
+TEST_CASE("executor", "[executor]") {
+	const auto test_folder_path = testhelper::cross_platform_string("./executor_test");
+	const auto first_file_path = test_folder_path + "/first.txt";
+	const auto second_file_path = test_folder_path + "/second.txt";
+	testhelper::remove_all(test_folder_path);
+	testhelper::make_directories(test_folder_path);
+
+	// runs nothing until the test does, on the test's own thread
+	std::mutex mutex;
+	std::condition_variable submitted;
+	std::deque<std::function<void()>> tasks;
+	filewatch::Options options;
+	options.executor = [&](std::function<void()> task) {
+		std::lock_guard<std::mutex> lock(mutex);
+		tasks.push_back(task);
+		submitted.notify_all();
+	};
+	SECTION("own threads") {}
+	SECTION("shared hub") { options.shared_hub = true; }
+	const auto next_task = [&]() {
+		std::unique_lock<std::mutex> lock(mutex);
+		REQUIRE(submitted.wait_for(lock, std::chrono::seconds(5), [&] { return !tasks.empty(); }));
+		const auto task = tasks.front();
+		tasks.pop_front();
+		return task;
+	};
+
+	std::vector<test_string> seen;
+	std::set<std::thread::id> threads;
+	std::function<void()> late;
+	{
+		filewatch::FileWatch<test_string> watch(test_folder_path, [&](const test_string& path, const filewatch::Event change_type) {
+			if (change_type == filewatch::Event::added) {
+				seen.push_back(path);
+			}
+			threads.insert(std::this_thread::get_id());
+		}, options);
+
+		testhelper::create_and_modify_file(first_file_path);
+		while (seen.empty()) {
+			next_task()();
+		}
+		REQUIRE(seen == std::vector<test_string>{ "first.txt" });
+		REQUIRE(threads == std::set<std::thread::id>{ std::this_thread::get_id() });
+
+		// still with the executor when the watch goes
+		testhelper::create_and_modify_file(second_file_path);
+		late = next_task();
+	}
+	late();
+	REQUIRE(seen == std::vector<test_string>{ "first.txt" });
+
+	options.coalesce_window = std::chrono::milliseconds(10);
+	if (!options.shared_hub) {
+		REQUIRE_THROWS_AS(filewatch::FileWatch<test_string>(test_folder_path, [](const test_string&, const filewatch::Event) {}, options), std::invalid_argument);
+	}
+	testhelper::remove_all(test_folder_path);
+}
+#endif
+
+#if __unix__
+TEST_CASE("inline callbacks", "[inline]") {
+	filewatch::Options options;
+	options.inline_callbacks = true;
+	// ignored
+	options.callback_threads = 4;
+
+	SECTION("a full queue is emptied by the reader") {
+		std::vector<filewatch::SyntheticEventSource::Record> records;
+		for (int i = 0; i < 64; ++i) {
+			records.push_back({ "file" + std::to_string(i) + ".txt", IN_CREATE });
+			records.push_back({ "file" + std::to_string(i) + ".txt", IN_DELETE });
+		}
+		const std::uint64_t total = records.size() * 50;
+		options.event_source = std::make_shared<filewatch::SyntheticEventSource>(records, total);
+		// far fewer than one read brings
+		options.queue_capacity = 8;
+
+		std::mutex mutex;
+		std::set<std::thread::id> threads;
+		std::uint64_t seen = 0;
+		std::uint64_t out_of_order = 0;
+		std::promise<void> promise;
+		std::future<void> future = promise.get_future();
+		filewatch::FileWatch<test_string> watch(testhelper::cross_platform_string("./"), [&](const test_string&, const filewatch::Event change_type) {
+			std::lock_guard<std::mutex> lock(mutex);
+			threads.insert(std::this_thread::get_id());
+			out_of_order += change_type != (seen % 2 == 0 ? filewatch::Event::added : filewatch::Event::removed);
+			if (++seen == total) {
+				promise.set_value();
+			}
+		}, options);
+
+		testhelper::get_with_timeout(future);
+		std::lock_guard<std::mutex> lock(mutex);
+		REQUIRE(out_of_order == 0);
+		REQUIRE(threads.size() == 1);
+		REQUIRE(threads.count(std::this_thread::get_id()) == 0);
+		REQUIRE(watch.stats().queue_full_waits == 0);
+		REQUIRE(watch.stats().events_dispatched == total);
+	}
+
+	SECTION("coalesce window") {
+		const auto test_folder_path = testhelper::cross_platform_string("./inline_test");
+		const auto test_file_name = testhelper::cross_platform_string("test.txt");
+		testhelper::remove_all(test_folder_path);
+		testhelper::make_directories(test_folder_path);
+		options.coalesce_window = std::chrono::milliseconds(100);
+		SECTION("own threads") {}
+		SECTION("shared hub") { options.shared_hub = true; }
+
+		std::mutex mutex;
+		std::vector<std::pair<test_string, filewatch::Event>> seen;
+		std::promise<void> promise;
+		std::future<void> future = promise.get_future();
+		{
+			filewatch::FileWatch<test_string> watch(test_folder_path, [&](const test_string& path, const filewatch::Event change_type) {
+				std::lock_guard<std::mutex> lock(mutex);
+				seen.emplace_back(path, change_type);
+				if (seen.size() == 1) {
+					promise.set_value();
+				}
+			}, options);
+
+			// nothing is read after this, the reader has to wake for the window by itself
+			auto test_file_path = test_folder_path + "/" + test_file_name;
+			testhelper::create_and_modify_file(test_file_path);
+			testhelper::get_with_timeout(future);
+			std::this_thread::sleep_for(options.coalesce_window * 2);
+		}
+		REQUIRE(seen.size() == 1);
+		REQUIRE(seen[0].first == test_file_name);
+		REQUIRE(seen[0].second == filewatch::Event::added);
+		testhelper::remove_all(test_folder_path);
+	}
+}
+#endif
+
+TEST_CASE("pull events", "[pull]") {
+	const auto test_folder_path = testhelper::cross_platform_string("./");
+	const auto test_file_name = testhelper::cross_platform_string("test.txt");
+
+	filewatch::Options options;
+	SECTION("own threads") {}
+#if __unix__
+	SECTION("shared hub") { options.shared_hub = true; }
+#endif
+	SECTION("coalesced") { options.coalesce_window = std::chrono::milliseconds(20); }
+#if __unix__
+	SECTION("without io_uring") { options.use_io_uring = false; }
+#endif
+
+	filewatch::FileWatch<test_string> watch(test_folder_path, std::regex(test_file_name), options);
+	filewatch::FileEvent<test_string> event;
+	REQUIRE_FALSE(watch.try_pop(event));
+	REQUIRE_FALSE(watch.wait_for(std::chrono::milliseconds(1)));
+
+	testhelper::create_and_modify_file(test_file_name);
+
+	std::array<filewatch::FileEvent<test_string>, 16> events;
+	std::size_t count = 0;
+	const auto deadline = std::chrono::steady_clock::now() + testhelper::config::test_timeout(1);
+	while (count == 0 && std::chrono::steady_clock::now() < deadline) {
+		if (watch.wait_for(std::chrono::milliseconds(100))) {
+			count = watch.poll(events.data(), events.size());
+		}
+	}
+	REQUIRE(count > 0);
+	REQUIRE(events[0].path() == test_file_name);
+	REQUIRE(watch.stats().events_dispatched >= count);
+}
+
+#if __unix__
+TEST_CASE("ready fd", "[pull]") {
+	const auto test_folder_path = testhelper::cross_platform_string("./");
+	const auto test_file_name = testhelper::cross_platform_string("test.txt");
+
+	filewatch::Options options;
+	SECTION("own threads") {}
+	SECTION("shared hub") { options.shared_hub = true; }
+	SECTION("coalesced") { options.coalesce_window = std::chrono::milliseconds(20); }
+
+	filewatch::FileWatch<test_string> watch(test_folder_path, std::regex(test_file_name), options);
+	const auto readable = [&watch](int timeout_ms) {
+		struct pollfd ready = { watch.ready_fd(), POLLIN, 0 };
+		return ::poll(&ready, 1, timeout_ms) == 1;
+	};
+	REQUIRE_FALSE(readable(0));
+
+	testhelper::create_and_modify_file(test_file_name);
+
+	std::array<filewatch::FileEvent<test_string>, 16> events;
+	std::size_t count = 0;
+	const auto deadline = std::chrono::steady_clock::now() + testhelper::config::test_timeout(1);
+	while (count == 0 && std::chrono::steady_clock::now() < deadline) {
+		if (readable(100)) {
+			count = watch.poll(events.data(), events.size());
+		}
+	}
+	REQUIRE(count > 0);
+	REQUIRE(events[0].path() == test_file_name);
+
+	// once everything has been taken it stops being readable
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	while (readable(0) && std::chrono::steady_clock::now() < deadline) {
+		watch.poll(events.data(), events.size());
+	}
+	REQUIRE_FALSE(readable(50));
+}
+#endif
+
+#if FILEWATCH_COROUTINES
+namespace {
+	// just enough of a coroutine type to start one that runs to its end on its own
+	struct Detached
+	{
+		struct promise_type
+		{
+			Detached get_return_object() { return {}; }
+			std::suspend_never initial_suspend() noexcept { return {}; }
+			std::suspend_never final_suspend() noexcept { return {}; }
+			void return_void() {}
+			void unhandled_exception() { std::terminate(); }
+		};
+	};
+
+	struct Awaited
+	{
+		std::mutex mutex = {};
+		std::vector<test_string> paths = {};
+		std::set<std::thread::id> threads = {};
+		std::uint64_t wanted = 0;
+		std::promise<void> promise = {};
+		bool got_wanted = false;
+		bool ended = false;
+	};
+
+	Detached await_events(filewatch::FileWatch<test_string>& watch, Awaited& awaited)
+	{
+		for (;;) {
+			const auto batch = co_await watch.next_batch();
+			std::lock_guard<std::mutex> lock(awaited.mutex);
+			if (batch.empty()) {
+				awaited.ended = true;
+				co_return;
+			}
+			awaited.threads.insert(std::this_thread::get_id());
+			for (const auto& event : batch) {
+				awaited.paths.push_back(event.path());
+			}
+			if (!awaited.got_wanted && awaited.paths.size() >= awaited.wanted) {
+				awaited.got_wanted = true;
+				awaited.promise.set_value();
+			}
+		}
+	}
+}
+
+TEST_CASE("co_await batches", "[coroutine]") {
+	filewatch::Options options;
+	Awaited awaited;
+	std::future<void> future = awaited.promise.get_future();
+
+	SECTION("resumed by the reader") {
+		const auto test_folder_path = testhelper::cross_platform_string("./coroutine_test");
+		const auto test_file_name = testhelper::cross_platform_string("test.txt");
+		testhelper::remove_all(test_folder_path);
+		testhelper::make_directories(test_folder_path);
+		SECTION("own threads") {}
+		SECTION("shared hub") { options.shared_hub = true; }
+		awaited.wanted = 1;
+		{
+			filewatch::FileWatch<test_string> watch(test_folder_path, std::regex("test.txt"), options);
+			// nothing has happened yet, so it waits
+			await_events(watch, awaited);
+			auto test_file_path = test_folder_path + "/test.txt";
+			testhelper::create_and_modify_file(test_file_path);
+			testhelper::get_with_timeout(future);
+			std::lock_guard<std::mutex> lock(awaited.mutex);
+			// creating and then modifying the file may come as one event or two
+			for (const auto& path : awaited.paths) {
+				REQUIRE(path == test_file_name);
+			}
+			REQUIRE(awaited.threads.count(std::this_thread::get_id()) == 0);
+			REQUIRE_FALSE(awaited.ended);
+		}
+		REQUIRE(awaited.ended);
+		testhelper::remove_all(test_folder_path);
+	}
+
+	SECTION("every event in order through a small queue") {
+		std::vector<filewatch::SyntheticEventSource::Record> records;
+		for (int i = 0; i < 64; ++i) {
+			records.push_back({ "file" + std::to_string(i) + ".txt", IN_CREATE });
+		}
+		awaited.wanted = records.size() * 50;
+		options.event_source = std::make_shared<filewatch::SyntheticEventSource>(records, awaited.wanted);
+		options.queue_capacity = 8;
+		{
+			filewatch::FileWatch<test_string> watch(testhelper::cross_platform_string("./"), options);
+			await_events(watch, awaited);
+			testhelper::get_with_timeout(future);
+			REQUIRE(watch.stats().events_dispatched == awaited.wanted);
+		}
+		REQUIRE(awaited.ended);
+		std::size_t out_of_order = 0;
+		for (std::size_t i = 0; i < awaited.paths.size(); ++i) {
+			out_of_order += awaited.paths[i] != records[i % records.size()].name;
+		}
+		REQUIRE(out_of_order == 0);
+	}
+
+	filewatch::Options coalescing;
+	coalescing.coalesce_window = std::chrono::milliseconds(10);
+	filewatch::FileWatch<test_string> coalesced(testhelper::cross_platform_string("./"), coalescing);
+	REQUIRE_THROWS_AS(coalesced.next_batch(), std::logic_error);
+}
+#endif
+
+#if FILEWATCH_IO_URING
+TEST_CASE("io_uring reader", "[io_uring]") {
+	int pipe_ends[2];
+	REQUIRE(pipe2(pipe_ends, O_NONBLOCK | O_CLOEXEC) == 0);
+	const int wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	auto reader = filewatch::UringReader::create(pipe_ends[0], wake, 4096);
+	if (reader) {
+		const char* data = nullptr;
+		REQUIRE(reader->next(data, 0) == 0);
+
+		// each write is picked up by the next read in the chain, and handed out in order
+		for (const std::string chunk : { "first", "second", "third", "fourth", "fifth", "sixth" }) {
+			REQUIRE(write(pipe_ends[1], chunk.data(), chunk.size()) == static_cast<ssize_t>(chunk.size()));
+			const auto length = reader->next(data, 1000);
+			REQUIRE(std::string(data, length) == chunk);
+		}
+		REQUIRE(reader->next(data, 10) == 0);
+
+		const std::uint64_t one = 1;
+		REQUIRE(write(wake, &one, sizeof(one)) == sizeof(one));
+		REQUIRE(reader->next(data, -1) == 0);
+		REQUIRE(reader->next(data, -1) == 0);
+	}
+	else {
+		WARN("io_uring is not available, skipping");
+	}
+	reader.reset();
+	for (const auto fd : { pipe_ends[0], pipe_ends[1], wake }) {
+		close(fd);
+	}
+}
+#endif
+
+#if FILEWATCH_FANOTIFY
+TEST_CASE("fanotify", "[fanotify]") {
+	const auto test_folder_path = testhelper::cross_platform_string("./fanotify_test");
+	const auto old_file_path = test_folder_path + "/old.txt";
+	const auto outside_file_path = test_folder_path + "_outside.txt";
+	const auto nested_file_path = test_folder_path + "/a/test.txt";
+	const auto new_file_path = test_folder_path + "/b/test.txt";
+	testhelper::make_directories(test_folder_path + "/a");
+	testhelper::create_and_modify_file(old_file_path);
+
+	// marking a filesystem needs CAP_SYS_ADMIN, e.g. run as root from a loop mounted ext4 or tmpfs image
+	if (!filewatch::FanotifyEventSource::create(test_folder_path.c_str())) {
+		WARN("fanotify is not available, skipping");
+		testhelper::remove_all(test_folder_path);
+		return;
+	}
+
+	filewatch::Options options;
+	options.recursive = true;
+	options.use_fanotify = true;
+
+	typedef std::pair<test_string, filewatch::Event> Change;
+	const std::vector<Change> expected = {
+		{ "a/test.txt", filewatch::Event::added },
+		{ "b", filewatch::Event::added },
+		{ "b/test.txt", filewatch::Event::added },
+		{ "old.txt", filewatch::Event::renamed_old },
+		{ "new.txt", filewatch::Event::renamed_new },
+		{ "new.txt", filewatch::Event::removed },
+	};
+	std::mutex mutex;
+	std::vector<Change> seen;
+	std::promise<void> promise;
+	std::future<void> future = promise.get_future();
+	{
+		filewatch::FileWatch<test_string> watch(test_folder_path, [&](const test_string& path, const filewatch::Event change_type) {
+			std::lock_guard<std::mutex> lock(mutex);
+			if (change_type != filewatch::Event::modified) {
+				seen.emplace_back(path, change_type);
+			}
+			if (seen.size() == expected.size()) {
+				promise.set_value();
+			}
+		}, options);
+
+		// elsewhere on the same filesystem, it must not be reported
+		testhelper::create_and_modify_file(outside_file_path);
+		testhelper::create_and_modify_file(nested_file_path);
+		testhelper::make_directories(test_folder_path + "/b");
+		testhelper::create_and_modify_file(new_file_path);
+		REQUIRE(std::rename(old_file_path.c_str(), (test_folder_path + "/new.txt").c_str()) == 0);
+		REQUIRE(std::remove((test_folder_path + "/new.txt").c_str()) == 0);
+
+		testhelper::get_with_timeout(future);
+	}
+	REQUIRE(seen == expected);
+	std::remove(outside_file_path.c_str());
+	testhelper::remove_all(test_folder_path);
+}
+#endif
+
+TEST_CASE("xxh64", "[hash]") {
+	REQUIRE(filewatch::Xxh64::of("", 0) == 0xEF46DB3751D8E999ull);
+	REQUIRE(filewatch::Xxh64::of("a", 1) == 0xD24EC4F1A98C6E5Bull);
+	REQUIRE(filewatch::Xxh64::of("abc", 3) == 0x44BC2CF5AD770999ull);
+	const std::string long_input = "Nobody inspects the spammish repetition";
+	REQUIRE(filewatch::Xxh64::of(long_input.data(), long_input.size()) == 0xFBCEA83C8A378BF1ull);
+
+	// fed in pieces that straddle the 32 byte stripes, the hash is the same as all at once
+	std::string data;
+	for (int i = 0; i < 1000; ++i) {
+		data += static_cast<char>(i * 7);
+	}
+	filewatch::Xxh64 pieces;
+	for (std::size_t offset = 0, piece = 1; offset < data.size(); offset += piece, piece = piece * 3 % 47 + 1) {
+		pieces.update(data.data() + offset, std::min(piece, data.size() - offset));
+	}
+	REQUIRE(pieces.digest() == filewatch::Xxh64::of(data.data(), data.size()));
+}
+
+#if __unix__
+TEST_CASE("content hashes", "[hash]") {
+	const auto test_folder_path = testhelper::cross_platform_string("./content_hashes_test");
+	const auto first_path = test_folder_path + "/first.txt";
+	const auto second_path = test_folder_path + "/second.txt";
+	testhelper::make_directories(test_folder_path);
+	const auto write = [](const std::string& path, const char* contents) {
+		std::ofstream file(path);
+		file << contents;
+	};
+
+	write(first_path, "one");
+	write(second_path, "two");
+	filewatch::ContentHashes<std::string> hashes(1024 * 1024);
+	REQUIRE(hashes.changed("first.txt", first_path));
+	REQUIRE_FALSE(hashes.changed("first.txt", first_path));
+	write(first_path, "uno");
+	REQUIRE(hashes.changed("first.txt", first_path));
+	REQUIRE_FALSE(hashes.changed("first.txt", first_path));
+	REQUIRE(hashes.changed("missing.txt", test_folder_path + "/missing.txt"));
+	REQUIRE(hashes.size() == 1);
+
+	// only room for one, the least recently written is forgotten
+	filewatch::ContentHashes<std::string> small(hashes.bytes() + 16);
+	REQUIRE(small.changed("first.txt", first_path));
+	REQUIRE(small.changed("second.txt", second_path));
+	REQUIRE(small.size() == 1);
+	REQUIRE(small.changed("first.txt", first_path));
+	REQUIRE(small.bytes() <= hashes.bytes() + 16);
+
+	// past the size limit a file isn't read, so it is always changed
+	filewatch::ContentHashes<std::string> limited(1024 * 1024, 3);
+	REQUIRE(limited.changed("first.txt", first_path));
+	REQUIRE_FALSE(limited.changed("first.txt", first_path));
+	write(first_path, "four");
+	REQUIRE(limited.changed("first.txt", first_path));
+	REQUIRE(limited.changed("first.txt", first_path));
+	REQUIRE(limited.size() == 0);
+
+	hashes.changed("second.txt", second_path);
+	hashes.forget_if([](const std::string& path) { return path == "first.txt"; });
+	REQUIRE(hashes.size() == 1);
+	REQUIRE(hashes.remembered("first.txt") == 0);
+	REQUIRE(hashes.remembered("second.txt") != 0);
+	testhelper::remove_all(test_folder_path);
+}
+
+TEST_CASE("unchanged writes are dropped", "[hash]") {
+	const auto test_folder_path = testhelper::cross_platform_string("./unchanged_test");
+	const auto test_file_path = test_folder_path + "/test.txt";
+	testhelper::remove_all(test_folder_path);
+	testhelper::make_directories(test_folder_path);
+
+	filewatch::Options options;
+	options.suppress_unchanged_writes = true;
+	SECTION("own threads") {}
+	SECTION("shared hub") { options.shared_hub = true; }
+	SECTION("fanotify") { options.use_fanotify = true; }
+
+	typedef std::pair<test_string, filewatch::Event> Change;
+	const std::vector<Change> expected = {
+		{ "test.txt", filewatch::Event::added },
+		{ "test.txt", filewatch::Event::modified },
+		{ "test.txt", filewatch::Event::modified },
+	};
+	std::mutex mutex;
+	std::vector<Change> seen;
+	std::promise<void> added;
+	std::future<void> added_future = added.get_future();
+	std::promise<void> modified;
+	std::future<void> modified_future = modified.get_future();
+	filewatch::FileWatch<test_string> watch(test_folder_path, [&](const test_string& path, const filewatch::Event change_type) {
+		std::lock_guard<std::mutex> lock(mutex);
+		seen.emplace_back(path, change_type);
+		if (seen.size() == 2) {
+			added.set_value();
+		}
+		if (seen.size() == expected.size()) {
+			modified.set_value();
+		}
+	}, options);
+
+	// the file is hashed when its close is read, not when it happens, so each write waits for the last to be looked at
+	const auto write = [&test_file_path](const char* contents) {
+		std::ofstream file(test_file_path);
+		file << contents;
+	};
+	write("same");
+	testhelper::get_with_timeout(added_future);
+	write("same");
+	for (int i = 0; i < 300 && watch.stats().events_unchanged == 0; ++i) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	REQUIRE(watch.stats().events_unchanged == 1);
+	write("different");
+	testhelper::get_with_timeout(modified_future);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		REQUIRE(seen == expected);
+	}
+	REQUIRE(watch.stats().events_unchanged == 1);
+	testhelper::remove_all(test_folder_path);
+}
+
+TEST_CASE("a rename onto a path forgets its contents", "[hash]") {
+	const auto test_folder_path = testhelper::cross_platform_string("./renamed_onto_test");
+	const auto test_file_path = test_folder_path + "/test.txt";
+	const auto saved_file_path = test_folder_path + "/test.txt.tmp";
+	testhelper::remove_all(test_folder_path);
+	testhelper::make_directories(test_folder_path);
+
+	filewatch::Options options;
+	options.suppress_unchanged_writes = true;
+	SECTION("own threads") {}
+	SECTION("shared hub") { options.shared_hub = true; }
+
+	typedef std::pair<test_string, filewatch::Event> Change;
+	std::mutex mutex;
+	std::vector<Change> seen;
+	std::promise<void> written;
+	std::future<void> written_future = written.get_future();
+	std::promise<void> renamed;
+	std::future<void> renamed_future = renamed.get_future();
+	std::promise<void> reverted;
+	std::future<void> reverted_future = reverted.get_future();
+	filewatch::FileWatch<test_string> watch(test_folder_path, [&](const test_string& path, const filewatch::Event change_type) {
+		std::lock_guard<std::mutex> lock(mutex);
+		seen.emplace_back(path, change_type);
+		if (path != "test.txt") {
+			return;
+		}
+		const auto modified = std::count(seen.begin(), seen.end(), Change{ "test.txt", filewatch::Event::modified });
+		if (change_type == filewatch::Event::modified && modified == 1) {
+			written.set_value();
+		}
+		if (change_type == filewatch::Event::renamed_new) {
+			renamed.set_value();
+		}
+		if (change_type == filewatch::Event::modified && modified == 2) {
+			reverted.set_value();
+		}
+	}, options);
+
+	const auto write = [](const std::string& path, const char* contents) {
+		std::ofstream file(path);
+		file << contents;
+	};
+	write(test_file_path, "before");
+	testhelper::get_with_timeout(written_future);
+	// an atomic save, then back to what it was before in place
+	write(saved_file_path, "after");
+	REQUIRE(std::rename(saved_file_path.c_str(), test_file_path.c_str()) == 0);
+	testhelper::get_with_timeout(renamed_future);
+	write(test_file_path, "before");
+	testhelper::get_with_timeout(reverted_future);
+
+	REQUIRE(watch.stats().events_unchanged == 0);
+	testhelper::remove_all(test_folder_path);
+}
+#endif
+
+TEST_CASE("pulling from a callback watch throws", "[pull]") {
+	const auto test_folder_path = testhelper::cross_platform_string("./");
+	filewatch::FileWatch<test_string> watch(test_folder_path, [](const test_string&, const filewatch::Event) {});
+	filewatch::FileEvent<test_string> event;
+	REQUIRE_THROWS_AS(watch.try_pop(event), std::logic_error);
+}
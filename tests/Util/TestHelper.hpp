@@ -8,6 +8,13 @@
 #include <utility>
 #include <iostream>
 #include <fstream>
+#include <vector>
+#if __unix__
+#include <dirent.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace testhelper {
 	namespace config {
@@ -56,5 +63,66 @@ namespace testhelper {
 		file << "test" << std::endl;
 		file.close();
 	}
+
+#if __unix__
+	static void make_directories(const std::string& path)
+	{
+		for (std::size_t i = path.find('/', 1); ; i = path.find('/', i + 1)) {
+			mkdir(path.substr(0, i).c_str(), 0755);
+			if (i == std::string::npos) {
+				break;
+			}
+		}
+	}
+
+	static int remove_entry(const char* path, const struct stat*, int, struct FTW*)
+	{
+		return ::remove(path);
+	}
+
+	static void remove_all(const std::string& path)
+	{
+		nftw(path.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	}
+
+	static std::size_t thread_count()
+	{
+		std::ifstream status("/proc/self/status");
+		std::string line;
+		while (std::getline(status, line)) {
+			if (line.compare(0, 8, "Threads:") == 0) {
+				return std::stoul(line.substr(8));
+			}
+		}
+		return 0;
+	}
+
+	// The descriptors this process has open on an epoll instance.
+	static std::vector<int> epoll_descriptors()
+	{
+		std::vector<int> found;
+		DIR* directory = opendir("/proc/self/fd");
+		if (directory == nullptr) {
+			return found;
+		}
+		while (const struct dirent* entry = readdir(directory)) {
+			char target[64] = {};
+			const auto path = std::string("/proc/self/fd/") + entry->d_name;
+			if (readlink(path.c_str(), target, sizeof(target) - 1) > 0 && std::string(target) == "anon_inode:[eventpoll]") {
+				found.push_back(std::stoi(entry->d_name));
+			}
+		}
+		closedir(directory);
+		return found;
+	}
+
+	static std::size_t max_queued_events()
+	{
+		std::ifstream limit("/proc/sys/fs/inotify/max_queued_events");
+		std::size_t events = 16384;
+		limit >> events;
+		return events;
+	}
+#endif
 }
 #endif
\ No newline at end of file